@@ -2,6 +2,7 @@
 
 SECONDS=0
 HOSTNAME=$(hostname)
+FINGERPRINT_BITS=${FINGERPRINT_BITS:-0} # hash bits stored in each table2 record
 
 case $HOSTNAME in
 "eightsocket")
@@ -49,7 +50,7 @@ run_tests() {
     local file_size_log_file="${file_path}/file_sizes.csv"
 
     make clean
-    make $make_name NONCE_SIZE=$nonce_size RECORD_SIZE=16
+    make $make_name NONCE_SIZE=$nonce_size RECORD_SIZE=16 FINGERPRINT_BITS=$FINGERPRINT_BITS
 
     # Create file size CSV with headers if it doesn't exist
     if [ ! -f "$file_size_log_file" ]; then
@@ -75,8 +76,7 @@ run_tests() {
 
         for search_size in 3 4 8 16 32; do
             echo "Running vaultx with K=$k, search size $search_size ..."
-            ./scripts/drop-all-caches.sh
-            ./vaultx -a for -t $threads -K $k -m $memory -j "$file_path/memo.xx" -p $search_size -x true >>"$lookup_data_file"
+            ./vaultx -a for -t $threads -K $k -m $memory -j "$file_path/memo.xx" -p $search_size -x true --cold >>"$lookup_data_file"
         done
 
         rm -f memo.t memo.x memo.xx
@@ -123,7 +123,7 @@ for disk in "${disks[@]}"; do
 
     echo "APPROACH,K,NONCE_SIZE(B),NUM_THREADS,MEMORY_SIZE(MB),FILE_SIZE(GB),BATCH_SIZE,THROUGHPUT(MH/S),THROUGHPUT(MB/S),HASH_TIME,IO_TIME,SHUFFLE_TIME,OTHER_TIME,TOTAL_TIME,STORAGE_EFFICIENCY" >"$data_file"
     echo "APPROACH,K,NONCE_SIZE(B),NUM_THREADS,MEMORY_SIZE(MB),FILE_SIZE(GB),BATCH_SIZE,THROUGHPUT(MH/S),THROUGHPUT(MB/S),HASH_TIME,IO_TIME,SHUFFLE_TIME,OTHER_TIME,TOTAL_TIME,STORAGE_EFFICIENCY" >"$cached_gen_data_file"
-    echo "FILENAME,NUM_THREADS,FILE_SIZE(GB),NUM_BUCKETS_SEARCH,NUM_RECORDS_IN_BUCKET,NUM_LOOKUPS,SEARCH_SIZE,FOUND_RECORDS,NOT_FOUND_RECORDS,TOTAL_TIME,TIME_PER_LOOKUP" >"$lookup_data_file"
+    echo "FILENAME,NUM_THREADS,FILE_SIZE(GB),NUM_BUCKETS_SEARCH,NUM_RECORDS_IN_BUCKET,NUM_LOOKUPS,SEARCH_SIZE,FOUND_RECORDS,NOT_FOUND_RECORDS,TOTAL_TIME,TIME_PER_LOOKUP,LOOKUPS_PER_SECOND,FINGERPRINT_BITS,P50_US,P90_US,P99_US,MAX_US,IO_P50_US,IO_P99_US,HASH_P50_US,HASH_P99_US,COLD" >"$lookup_data_file"
 
     if [ "$disk_name" == "hdd" ]; then
         if [ -z "$nvme_disk" ]; then
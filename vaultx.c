@@ -1,3 +1,7 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // For syncfs, copy_file_range
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <omp.h>
@@ -17,6 +21,29 @@
 #include <limits.h> // For UINT64_MAX
 
 #include <inttypes.h>
+#include <stddef.h>   // For offsetof
+#include <sys/mman.h>   // For mmap
+#include <sys/socket.h> // For the lookup server
+#include <sys/un.h>     // For sockaddr_un
+#include <poll.h>
+#include <dirent.h>        // For opendir, to list a farm
+#include <pthread.h>
+#include <sys/wait.h> // For waitpid, the --bench runs
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // For the AVX2 occupancy scan
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h> // For the NEON occupancy scan
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>    // For ioctl
+#include <linux/fs.h>     // For FICLONE
+#include <sys/sendfile.h> // For sendfile
+#include <sys/syscall.h>      // For syscall
+#include <linux/perf_event.h> // For perf_event_open, the --perf counters
+#include <sys/sysmacros.h>    // For major, minor; macOS has them in sys/types.h
+#endif
 
 #ifdef __cplusplus
 // Your C++-specific code here
@@ -25,6 +52,10 @@
 #endif
 
 #include "blake3/blake3.h" // Include Blake3 header
+// a system libblake3 (-DBLAKE3_SYSTEM) exports only the hasher API, not the internals of the vendored sources
+#ifndef BLAKE3_SYSTEM
+#include "blake3/blake3_impl.h" // For blake3_compress_in_place, the single block kernel
+#endif
 
 #ifndef NONCE_SIZE
 #define NONCE_SIZE 5 // Default nonce size
@@ -34,8 +65,19 @@
 #define RECORD_SIZE 8 // Default record size
 #endif
 
+#ifndef FINGERPRINT_BITS
+#define FINGERPRINT_BITS 0 // Default hash bits stored in each table2 record
+#endif
+
+#if FINGERPRINT_BITS < 0 || FINGERPRINT_BITS > 64
+#error "FINGERPRINT_BITS must be between 0 and 64"
+#endif
+
 #define HASH_SIZE (RECORD_SIZE - NONCE_SIZE)
 #define PREFIX_SIZE 3 // Example prefix size for getBucketIndex
+#define PAIR_KEY_SIZE 4 // bytes of the table2 hash after the prefix that order a sorted bucket
+#define FINGERPRINT_BYTES ((FINGERPRINT_BITS + 7) / 8)
+#define PAIR_HASH_SIZE max(HASH_SIZE, PREFIX_SIZE + max(PAIR_KEY_SIZE, FINGERPRINT_BYTES))
 
 int K = 24; // Default exponent
 
@@ -59,7 +101,16 @@ bool BENCHMARK = false;
 bool HASHGEN = true;
 bool SEARCH = false;
 bool SEARCH_BATCH = false;
+bool RESUME = false;
+bool COMPACT = false;
+bool SEARCH_MMAP = false;
+bool SORTED_BUCKETS = false;
+bool FILTER = false;
+bool COLD = false; // evict the plot from the page cache before the search and after every lookup
+size_t FILTER_KEY_SIZE = 4;
+size_t FILTER_BITS = 16;
 size_t PREFIX_SEARCH_SIZE = 1;
+size_t SEARCH_LIMIT = 1; // matches a range query stops at
 int NUM_THREADS = 0;
 
 // Structure to hold a record with nonce and hash
@@ -80,6 +131,9 @@ typedef struct
 {
     uint8_t nonce1[NONCE_SIZE]; // Nonce to store the seed
     uint8_t nonce2[NONCE_SIZE]; // Nonce to store the seed
+#if FINGERPRINT_BITS > 0
+    uint8_t fingerprint[FINGERPRINT_BYTES]; // FINGERPRINT_BITS hash bits after the prefix, so lookups rehash only candidates
+#endif
 } MemoRecord2;
 
 typedef struct
@@ -88,21 +142,32 @@ typedef struct
     size_t count;       // Number of records in the bucket
     size_t count_waste; // Number of records generated but not stored
     bool full;          // Number of records in the bucket
-    size_t flush;       // Number of flushes of bucket
 } Bucket;
 
 typedef struct
 {
     MemoRecord2 *records;
+    uint32_t *keys;     // sort key of each record, only while buckets are sorted
     size_t count;       // Number of records in the bucket
     size_t count_waste; // Number of records generated but not stored
     bool full;          // Number of records in the bucket
-    size_t flush;       // Number of flushes of bucket
 } Bucket2;
 
 Bucket *buckets;
 Bucket2 *buckets2;
 
+#define MAX_STRIPES 64
+
+// A logical temporary or final file striped over several devices, one file per device
+typedef struct
+{
+    size_t count;
+    char *paths[MAX_STRIPES];
+} StripeSet;
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
 // Function to display usage information
 void print_usage(char *prog_name)
 {
@@ -111,14 +176,55 @@ void print_usage(char *prog_name)
     printf("  -a [xtask|task|for|tbb]   Select parallelization approach (default: for)\n");
     printf("  -t NUM                    Number of threads to use (default: number of available cores)\n");
     printf("  -K NUM                    Exponent K to compute iterations as 2^K (default: 4)\n");
-    printf("  -m NUM                    Memory size in MB (default: 1)\n");
-    printf("  -f NAME                   Temporary file name raw\n");
-    printf("  -g NAME                   Temporary file name table1\n");
-    printf("  -j NAME                   Final file name table2\n");
+    printf("  -m NUM                    Memory budget in MB of a round: table1 and table2 buckets, their metadata,\n");
+    printf("                            sort scratch and shuffle buffers (default: 1)\n");
+    printf("  -f NAME[,NAME...]         Temporary file name raw\n");
+    printf("  -g NAME[,NAME...]         Temporary file name table1\n");
+    printf("  -j NAME[,NAME...]         Final file name table2\n");
+    printf("                            (a list stripes the file over several disks, one NAME or directory per disk)\n");
     printf("  -b NUM                    Batch size (default: 1024)\n");
+    printf("  --resume                  Continue an interrupted run from its journal (same options required)\n");
+    printf("  --compact                 Store table2 without empty slots, with a bucket index (CSR layout)\n");
+    printf("  --sorted                  Sort every table2 bucket by hash, so searches interpolate instead of hashing\n");
+    printf("                            the whole bucket (4 extra bytes per record of memory while generating)\n");
+    printf("  --filter                  Build a Bloom filter of the plot next to it (NAME.bf); when searching, load it\n");
+    printf("                            to answer most misses without reading the plot\n");
+    printf("  --filter-bytes NUM        Leading hash bytes the filter holds per record (default: 4)\n");
+    printf("  --filter-bits NUM         Filter bits per record (default: 16)\n");
+    printf("  --mmap                    Search a memory mapped plot instead of reading each bucket\n");
+    printf("  --cold                    Evict the plot from the page cache before searching and after every lookup\n");
+    printf("                            (posix_fadvise, no root needed, Linux only), so every lookup reads the device\n");
+    printf("  --queries FILE            Answer the prefixes in FILE (- for stdin) on stdout, one line each\n");
+    printf("  --query-format hex|binary Hex: one prefix per line (default); binary: fixed size prefixes\n");
+    printf("  --query-bytes NUM         Bytes per binary prefix (default: 3)\n");
+    printf("  --in-flight NUM           Queries answered together at most (default: 4096)\n");
+    printf("  --serve SOCKET            Serve lookups on a Unix socket from the plots given with -j (repeat -j for more)\n");
+    printf("  --client SOCKET           Send -b random lookups of -p bytes to a server, --in-flight per connection\n");
+    printf("  --limit NUM               Matches a -s query prints at most (default: 1); -s takes HEX or HEX/BITS, and a\n");
+    printf("                            prefix shorter than a bucket index scans the buckets it spans in large reads\n");
+    printf("  --verify-proofs FILE      Check the proofs in FILE (- for stdin), as --queries prints them, against the\n");
+    printf("                            pairing predicate of the plot given with -j (or of -K); failures go to stdout\n");
+    printf("  --verify-sample NUM       Check NUM random buckets of the plot given with -j instead of all of it, and report\n");
+    printf("                            storage and sort efficiency with 95%% confidence intervals\n");
+    printf("  --seed NUM                Seed of the --verify-sample buckets (default: the time; printed to check them again)\n");
+    printf("  --metrics FILE            Write per round, per thread phase times (hash, insert, sort, pair, write, shuffle,\n");
+    printf("                            sync) and record, pair and waste counts of plot generation to FILE as JSON\n");
+    printf("  --perf                    Count cycles, instructions, LLC, dTLB and branch misses of the generate, sort/pair,\n");
+    printf("                            write and shuffle phases (perf_event_open); with -x true, 20 more CSV columns\n");
+    printf("  --bench SPEC              Sweep plot generation with the other options given, e.g. \"approach=for,task\n");
+    printf("                            threads=1,4 batch=1024 K=25,26 memory=2048 repeat=3\": each point runs repeat times\n");
+    printf("                            and its median goes out as one -x true CSV row; 95%% intervals go to stderr\n");
+    printf("  --bench-csv FILE          Append the --bench rows to FILE (with the header when it is new) instead of stdout\n");
+    printf("  --microbench STAGES       Time generation stages on a synthetic round of -K/-m: hash, hash_block,\n");
+    printf("                            partition, sort, pair, write (to -f FILE) or all; records/s and bytes/s\n");
+    printf("  --microbench-threads LIST Thread counts of --microbench, e.g. 1,2,4,8 (default powers of two up to -t or the cores)\n");
+    printf("  --occupancy               Print the histogram of bucket fill of the plot given with -j\n");
+    printf("  --farm DIR|FILE           Search every plot of a farm: the *.xx files of DIR, or one -j list per line of\n");
+    printf("                            FILE; -s for one challenge, or -b random ones of -p bytes, fanned out to all disks\n");
     printf("  -h, --help                Display this help message\n");
     printf("\nExample:\n");
-    printf("  %s -t 16 -K 26 -m 1024 -g memo.tmp -f memo2.tmp -j k26-memo.x\n", prog_name);     
+    printf("  %s -t 16 -K 26 -m 2048 -g memo.tmp -f memo2.tmp -j k26-memo.x\n", prog_name);
+    printf("  %s -t 16 -K 30 -m 4096 -f /data-l,/data-fast2 -j /ssd-raid0,/data-fast2\n", prog_name);
 }
 
 // Function to compute the bucket index based on hash prefix
@@ -163,7 +269,7 @@ void generateBlake3(uint8_t *record_hash, MemoRecord *record, unsigned long long
     blake3_hasher_finalize(&hasher, record_hash, HASH_SIZE);
 }
 
-// Function to generate Blake3 hash
+// Function to generate Blake3 hash; record_hash receives PAIR_HASH_SIZE bytes
 void generate2Blake3(uint8_t *record_hash, MemoRecord2 *record, unsigned long long nonce1, unsigned long long nonce2)
 {
     // Ensure that the pointers are valid
@@ -182,7 +288,33 @@ void generate2Blake3(uint8_t *record_hash, MemoRecord2 *record, unsigned long lo
     blake3_hasher_init(&hasher);
     blake3_hasher_update(&hasher, record->nonce1, NONCE_SIZE);
     blake3_hasher_update(&hasher, record->nonce2, NONCE_SIZE);
-    blake3_hasher_finalize(&hasher, record_hash, HASH_SIZE);
+    blake3_hasher_finalize(&hasher, record_hash, PAIR_HASH_SIZE);
+
+#if FINGERPRINT_BITS > 0
+    memcpy(record->fingerprint, &record_hash[PREFIX_SIZE], FINGERPRINT_BYTES);
+    record->fingerprint[FINGERPRINT_BYTES - 1] &= (uint8_t)(0xFF << (FINGERPRINT_BYTES * 8 - FINGERPRINT_BITS));
+#endif
+}
+
+// Function to hash a message of at most one block (64 bytes) with one compression and no hasher state;
+// out receives the first out_len (at most 32) bytes of what blake3_hasher_finalize() gives for it
+void blake3_single_block(const uint8_t *input, size_t len, uint8_t *out, size_t out_len)
+{
+#ifdef BLAKE3_SYSTEM
+    blake3_hasher hasher;
+    blake3_hasher_init(&hasher);
+    blake3_hasher_update(&hasher, input, len);
+    blake3_hasher_finalize(&hasher, out, out_len);
+#else
+    uint8_t block[BLAKE3_BLOCK_LEN] = {0};
+    memcpy(block, input, len);
+    uint32_t cv[8];
+    memcpy(cv, IV, sizeof(cv));
+    blake3_compress_in_place(cv, block, (uint8_t)len, 0, CHUNK_START | CHUNK_END | ROOT);
+    uint8_t bytes[BLAKE3_OUT_LEN];
+    store_cv_words(bytes, cv);
+    memcpy(out, bytes, out_len);
+#endif
 }
 
 // Comparison function for qsort(), comparing the hash fields.
@@ -285,6 +417,153 @@ void sort_bucket_records_inplace(MemoRecord *records, size_t total_records)
     free(all_records);
 }
 
+// A table2 record with the key it is sorted by
+typedef struct
+{
+    uint32_t key;
+    MemoRecord2 record;
+} MemoKeyRecord2;
+
+int compare_memo_key_record2(const void *a, const void *b)
+{
+    const MemoKeyRecord2 *recA = (const MemoKeyRecord2 *)a;
+    const MemoKeyRecord2 *recB = (const MemoKeyRecord2 *)b;
+    return recA->key < recB->key ? -1 : (recA->key > recB->key ? 1 : 0);
+}
+
+// The fingerprint bits a record must carry for its hash to start with a lookup key
+typedef struct
+{
+    uint64_t mask;
+    uint64_t value;
+} FingerprintFilter;
+
+// Function to derive the filter of a key; a key no longer than the prefix lets every record through
+FingerprintFilter fingerprint_filter(const uint8_t *key, size_t key_length)
+{
+    FingerprintFilter filter = {0, 0};
+#if FINGERPRINT_BITS > 0
+    uint8_t mask[8] = {0};
+    uint8_t value[8] = {0};
+    for (size_t n = 0; n < FINGERPRINT_BYTES && PREFIX_SIZE + n < key_length; n++)
+    {
+        mask[n] = 0xFF;
+        value[n] = key[PREFIX_SIZE + n];
+    }
+    mask[FINGERPRINT_BYTES - 1] &= (uint8_t)(0xFF << (FINGERPRINT_BYTES * 8 - FINGERPRINT_BITS));
+    memcpy(&filter.mask, mask, sizeof(mask));
+    memcpy(&filter.value, value, sizeof(value));
+    filter.value &= filter.mask;
+#else
+    (void)key;
+    (void)key_length;
+#endif
+    return filter;
+}
+
+// Function to test a record against a filter with one masked word compare, without hashing it
+bool fingerprint_pass(const MemoRecord2 *record, FingerprintFilter filter)
+{
+#if FINGERPRINT_BITS > 0
+    uint64_t word = 0;
+    memcpy(&word, record->fingerprint, FINGERPRINT_BYTES);
+    return ((word ^ filter.value) & filter.mask) == 0;
+#else
+    (void)record;
+    (void)filter;
+    return true;
+#endif
+}
+
+// Function to read the pair key bits a record's fingerprint holds; a lower bound of its pair key
+uint32_t fingerprint_key(const MemoRecord2 *record)
+{
+#if FINGERPRINT_BITS > 0
+    uint8_t bytes[PAIR_KEY_SIZE] = {0};
+    memcpy(bytes, record->fingerprint, min(FINGERPRINT_BYTES, PAIR_KEY_SIZE));
+    return (uint32_t)byteArrayToLongLong(bytes, PAIR_KEY_SIZE);
+#else
+    (void)record;
+    return 0;
+#endif
+}
+
+// Function to compute the sort key of a table2 record: the PAIR_KEY_SIZE hash bytes after the prefix, big-endian;
+// read from the fingerprint when it holds all of them
+uint32_t pair_key(const MemoRecord2 *record)
+{
+#if FINGERPRINT_BITS >= PAIR_KEY_SIZE * 8
+    return fingerprint_key(record);
+#else
+    uint8_t hash[PAIR_HASH_SIZE];
+    blake3_hasher hasher;
+    blake3_hasher_init(&hasher);
+    blake3_hasher_update(&hasher, record->nonce1, NONCE_SIZE);
+    blake3_hasher_update(&hasher, record->nonce2, NONCE_SIZE);
+    blake3_hasher_finalize(&hasher, hash, PAIR_HASH_SIZE);
+    return (uint32_t)byteArrayToLongLong(&hash[PREFIX_SIZE], PAIR_KEY_SIZE);
+#endif
+}
+
+#define SORT_INSERTION_MAX 32 // buckets up to this size are insertion sorted on the stack
+
+/**
+ * sort_bucket_records2:
+ *   - Sorts the first count records of a table2 bucket by pair key, so that a lookup
+ *     can interpolate inside the bucket instead of hashing all of it.
+ *   - keys holds the key of each record, as computed when the pair was generated, and is
+ *     sorted along with the records; when NULL the keys are recomputed from the nonces.
+ *
+ * @param records Records of the bucket.
+ * @param keys    Sort key of each record, or NULL.
+ * @param count   Number of records to sort.
+ */
+void sort_bucket_records2(MemoRecord2 *records, uint32_t *keys, size_t count)
+{
+    MemoKeyRecord2 local[SORT_INSERTION_MAX];
+    MemoKeyRecord2 *all_records = count <= SORT_INSERTION_MAX ? local : (MemoKeyRecord2 *)malloc(count * sizeof(MemoKeyRecord2));
+    if (!all_records)
+    {
+        perror("Error allocating memory for MemoKeyRecord2 array");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        all_records[i].key = keys != NULL ? keys[i] : pair_key(&records[i]);
+        all_records[i].record = records[i];
+    }
+
+    if (count <= SORT_INSERTION_MAX)
+    {
+        for (size_t i = 1; i < count; i++)
+        {
+            MemoKeyRecord2 current = all_records[i];
+            size_t j = i;
+            while (j > 0 && all_records[j - 1].key > current.key)
+            {
+                all_records[j] = all_records[j - 1];
+                j--;
+            }
+            all_records[j] = current;
+        }
+    }
+    else
+    {
+        qsort(all_records, count, sizeof(MemoKeyRecord2), compare_memo_key_record2);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        records[i] = all_records[i].record;
+        if (keys != NULL)
+            keys[i] = all_records[i].key;
+    }
+
+    if (all_records != local)
+        free(all_records);
+}
+
 // Function to write a bucket of records to disk sequentially
 size_t writeBucketToDiskSequential(const Bucket *bucket, FILE *fd)
 {
@@ -343,8 +622,8 @@ void insert_record(Bucket *buckets, MemoRecord *record, size_t bucketIndex)
     }
 }
 
-// Function to insert a record into a bucket
-void insert_record2(Bucket2 *buckets2, MemoRecord2 *record, size_t bucketIndex)
+// Function to insert a record into a bucket; key is kept when the bucket stores sort keys
+void insert_record2(Bucket2 *buckets2, MemoRecord2 *record, size_t bucketIndex, uint32_t key)
 {
     if (bucketIndex >= num_buckets)
     {
@@ -367,6 +646,11 @@ void insert_record2(Bucket2 *buckets2, MemoRecord2 *record, size_t bucketIndex)
     {
         memcpy(bucket->records[idx].nonce1, record->nonce1, NONCE_SIZE);
         memcpy(bucket->records[idx].nonce2, record->nonce2, NONCE_SIZE);
+#if FINGERPRINT_BITS > 0
+        memcpy(bucket->records[idx].fingerprint, record->fingerprint, FINGERPRINT_BYTES);
+#endif
+        if (bucket->keys != NULL)
+            bucket->keys[idx] = key;
     }
     else
     {
@@ -424,6 +708,14 @@ bool is_nonce_nonzero(const uint8_t *nonce, size_t nonce_size)
         return false;
     }
 
+    // A nonce of the build's size is tested as one word
+    if (nonce_size == NONCE_SIZE && NONCE_SIZE <= sizeof(uint64_t))
+    {
+        uint64_t word = 0;
+        memcpy(&word, nonce, NONCE_SIZE);
+        return word != 0;
+    }
+
     // Iterate over each byte of the nonce
     for (size_t i = 0; i < nonce_size; ++i)
     {
@@ -438,6 +730,108 @@ bool is_nonce_nonzero(const uint8_t *nonce, size_t nonce_size)
     return false;
 }
 
+// Function to set bit i of bitmap for every nonzero byte i of bytes[0..len), 8 bytes at a time (SWAR);
+// bitmap holds (len + 63) / 64 words, the tail of the last one cleared
+void nonzero_bytes_swar(const uint8_t *bytes, size_t len, uint64_t *bitmap, size_t from)
+{
+    for (size_t i = from; i < len; i += 8)
+    {
+        uint64_t x = 0;
+        memcpy(&x, &bytes[i], min(len - i, (size_t)8));
+        // the high bit of a byte is set when any of its bits is; the multiply gathers the 8 high bits
+        uint64_t nonzero = (((x & 0x7F7F7F7F7F7F7F7FULL) + 0x7F7F7F7F7F7F7F7FULL) | x) & 0x8080808080808080ULL;
+        uint64_t bits = ((nonzero >> 7) * 0x0102040810204080ULL) >> 56;
+        if (i % 64 == 0)
+            bitmap[i / 64] = 0;
+        bitmap[i / 64] |= bits << (i % 64);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Function to set the bits of nonzero bytes 32 at a time with AVX2; see nonzero_bytes_swar()
+__attribute__((target("avx2"))) void nonzero_bytes_avx2(const uint8_t *bytes, size_t len, uint64_t *bitmap)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+    {
+        __m256i lo = _mm256_loadu_si256((const __m256i *)&bytes[i]);
+        __m256i hi = _mm256_loadu_si256((const __m256i *)&bytes[i + 32]);
+        uint32_t zero_lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, zero));
+        uint32_t zero_hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, zero));
+        bitmap[i / 64] = ~(((uint64_t)zero_hi << 32) | zero_lo);
+    }
+    nonzero_bytes_swar(bytes, len, bitmap, i);
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+// Function to set the bits of nonzero bytes 16 at a time with NEON; see nonzero_bytes_swar()
+void nonzero_bytes_neon(const uint8_t *bytes, size_t len, uint64_t *bitmap)
+{
+    static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    const uint8x16_t weight = vld1q_u8(weights);
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+    {
+        uint64_t word = 0;
+        for (int part = 0; part < 4; part++)
+        {
+            // nonzero bytes become their bit weight, and each half adds up to the mask of its 8 bytes
+            uint8x16_t v = vld1q_u8(&bytes[i + part * 16]);
+            uint8x16_t bits = vandq_u8(vtstq_u8(v, v), weight);
+            uint64_t mask = (uint64_t)vaddv_u8(vget_low_u8(bits)) | ((uint64_t)vaddv_u8(vget_high_u8(bits)) << 8);
+            word |= mask << (part * 16);
+        }
+        bitmap[i / 64] = word;
+    }
+    nonzero_bytes_swar(bytes, len, bitmap, i);
+}
+#endif
+
+/**
+ * nonzero_bytes:
+ *   - Sets bit i of bitmap for every nonzero byte i of bytes[0..len), the occupancy of packed records
+ *     of any size in one pass; record_occupied() then tests a record with a shift and two masks.
+ *   - Uses AVX2 when the CPU has it, NEON on 64-bit ARM, otherwise 8 bytes per step in a word.
+ *
+ * @param bytes  Packed records.
+ * @param len    Number of bytes.
+ * @param bitmap Receives (len + 63) / 64 words; one more must be allocated for record_occupied().
+ */
+void nonzero_bytes(const uint8_t *bytes, size_t len, uint64_t *bitmap)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static int has_avx2 = -1;
+    if (has_avx2 < 0)
+        has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    if (has_avx2)
+    {
+        nonzero_bytes_avx2(bytes, len, bitmap);
+        return;
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    nonzero_bytes_neon(bytes, len, bitmap);
+    return;
+#endif
+    nonzero_bytes_swar(bytes, len, bitmap, 0);
+}
+
+// Function to test record index of records of record_size bytes scanned by nonzero_bytes(): it is occupied
+// when both masks (bits of the record's bytes, at most 64) have a nonzero byte, e.g. both nonces of a MemoRecord2
+bool record_occupied(const uint64_t *bitmap, size_t index, size_t record_size, uint64_t mask1, uint64_t mask2)
+{
+    size_t bit = index * record_size;
+    uint64_t bits = bitmap[bit / 64] >> (bit % 64);
+    if (bit % 64 != 0)
+        bits |= bitmap[bit / 64 + 1] << (64 - bit % 64);
+    return (bits & mask1) != 0 && (bits & mask2) != 0;
+}
+
+// Masks of record_occupied() for the nonces of a MemoRecord2
+#define NONCE1_MASK ((1ULL << NONCE_SIZE) - 1)
+#define NONCE2_MASK (NONCE1_MASK << NONCE_SIZE)
+
 // Function to count zero-value MemoRecords in a binary file
 size_t count_zero_memo_records(const char *filename)
 {
@@ -457,23 +851,26 @@ size_t count_zero_memo_records(const char *filename)
         return 0;
     }
 
-    // Allocate memory for the batch of MemoRecords
+    // Allocate memory for the batch of MemoRecords and the bitmap of their nonzero bytes
     buffer = (MemoRecord *)malloc(BATCH_SIZE * sizeof(MemoRecord));
-    if (buffer == NULL)
+    uint64_t *bitmap = (uint64_t *)malloc(((BATCH_SIZE * sizeof(MemoRecord) + 63) / 64 + 1) * sizeof(uint64_t));
+    if (buffer == NULL || bitmap == NULL)
     {
         fprintf(stderr, "Error: Unable to allocate memory.\n");
         fclose(file);
+        free(buffer);
+        free(bitmap);
         return 0;
     }
 
     // Read the file in batches
     while ((records_read = fread(buffer, sizeof(MemoRecord), BATCH_SIZE, file)) > 0)
     {
-        // Process each MemoRecord in the batch
+        // Find the nonzero bytes of the batch at once, then check each MemoRecord's nonce
+        nonzero_bytes((const uint8_t *)buffer, records_read * sizeof(MemoRecord), bitmap);
         for (size_t i = 0; i < records_read; ++i)
         {
-            // Check if the MemoRecord's nonce is all zeros
-            if (is_nonce_nonzero(buffer[i].nonce, NONCE_SIZE))
+            if (record_occupied(bitmap, i, sizeof(MemoRecord), NONCE1_MASK, NONCE1_MASK))
             {
                 ++total_nonzero_records;
             }
@@ -493,6 +890,7 @@ size_t count_zero_memo_records(const char *filename)
     // Clean up
     fclose(file);
     free(buffer);
+    free(bitmap);
 
     // Print the total number of zero-value MemoRecords
     printf("total_zero_records=%zu total_nonzero_records=%zu efficiency=%.2f%%\n", total_zero_records, total_nonzero_records, total_nonzero_records * 100.0 / (total_zero_records + total_nonzero_records));
@@ -534,783 +932,1455 @@ long get_file_size(const char *filename)
     return size;
 }
 
-uint64_t compute_hash_hamming_distance(const uint8_t *hash_output,
-                                       const uint8_t *prev_hash,
-                                       size_t hash_size)
+// Function to read exactly len bytes at offset, retrying on short reads; returns bytes read
+ssize_t read_full_at(int fd, void *buf, size_t len, off_t offset)
 {
-    uint64_t distance = 0;
-    for (size_t i = 0; i < hash_size; i++)
+    size_t done = 0;
+    while (done < len)
     {
-        uint8_t diff = hash_output[i] ^ prev_hash[i];
-        // Count bits set in diff (Brian Kernighan's algorithm)
-        while (diff)
+        ssize_t n = pread(fd, (uint8_t *)buf + done, len - done, offset + done);
+        if (n < 0)
         {
-            distance++;
-            diff &= (diff - 1);
+            if (errno == EINTR)
+                continue;
+            return -1;
         }
+        if (n == 0)
+            break;
+        done += n;
     }
-    return distance;
+    return done;
 }
 
-uint64_t compute_hash_match(const uint8_t *hash1, const uint8_t *hash2, size_t hash_size)
+// Function to write exactly len bytes at offset, retrying on short writes; returns bytes written
+ssize_t write_full_at(int fd, const void *buf, size_t len, off_t offset)
 {
-    uint64_t match = 0;
-    for (size_t i = 0; i < hash_size; i++)
+    size_t done = 0;
+    while (done < len)
     {
-        // XOR gives 0 where bits are the same, so invert to mark matching bits as 1.
-        uint8_t equal = ~(hash1[i] ^ hash2[i]);
-        // Count the bits that are 1 (i.e. bits that match) using Brian Kernighan's algorithm.
-        while (equal)
+        ssize_t n = pwrite(fd, (const uint8_t *)buf + done, len - done, offset + done);
+        if (n < 0)
         {
-            match++;
-            equal &= (equal - 1);
+            if (errno == EINTR)
+                continue;
+            return -1;
         }
+        done += n;
     }
-    return match;
+    return done;
 }
 
-uint64_t compute_hash_match_leading(const uint8_t *hash1, const uint8_t *hash2, size_t hash_size)
+// Function to reserve the final size of an output file up front so it does not grow extent by extent,
+// and to tell the kernel that it is written sequentially and not read back soon
+void preallocate_file(int fd, off_t size)
 {
-    uint64_t match = 0;
-
-    // Iterate over each byte in the hash
-    for (size_t i = 0; i < hash_size; i++)
-    {
-        // Check each bit starting with the most significant bit
-        for (int bit = 7; bit >= 0; bit--)
-        {
-            uint8_t mask = 1 << bit;
-            // If the bits match, increase the counter; if not, return immediately.
-            if ((hash1[i] & mask) == (hash2[i] & mask))
-                match++;
-            else
-                return match;
-        }
-    }
-    return match;
+#ifdef __linux__
+    if (size > 0 && fallocate(fd, 0, 0, size) != 0 && errno != EOPNOTSUPP)
+        perror("Warning: fallocate failed");
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+#else
+    (void)fd;
+    (void)size;
+#endif
 }
 
-uint64_t compute_hash_distance(const uint8_t *hash_output, const uint8_t *prev_hash, size_t hash_size)
+// Function to start writeback of a freshly written range without waiting for it
+void sync_range_start(int fd, off_t offset, off_t len)
 {
-    // Ensure there are at least 8 bytes in the hash
-    if (hash_size < 8)
-    {
-        fprintf(stderr, "Error: hash_size must be at least 8 bytes.\n");
-        return 0;
-    }
-
-    // Convert the first 8 bytes of each hash to a uint64_t
-    uint64_t current = byteArrayToLongLong(hash_output, 8);
-    uint64_t previous = byteArrayToLongLong(prev_hash, 8);
+#ifdef __linux__
+    if (sync_file_range(fd, offset, len, SYNC_FILE_RANGE_WRITE) != 0)
+        perror("Warning: sync_file_range failed");
+#else
+    (void)fd;
+    (void)offset;
+    (void)len;
+#endif
+}
 
-    // Subtract the previous hash value from the current one and return the result
-    return previous - current;
+// Function to wait until a range has reached the disk, then drop it from the page cache
+void sync_range_finish(int fd, off_t offset, off_t len)
+{
+#ifdef __linux__
+    if (sync_file_range(fd, offset, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0)
+        perror("Warning: sync_file_range failed");
+    posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+#else
+    (void)fd;
+    (void)offset;
+    (void)len;
+#endif
 }
 
-int print_table2_entry(const uint8_t *nonce_output, const uint8_t *prev_nonce, const uint8_t *hash_output, const uint8_t *prev_hash, size_t hash_size)
+// Function to split a comma separated list of files or directories into a StripeSet;
+// a directory gets default_name appended so that each device holds one stripe file
+int parse_stripe_list(const char *list, const char *default_name, StripeSet *set)
 {
-    // Ensure there are at least 8 bytes in the hash
-    if (hash_size < 8)
+    set->count = 0;
+    char *copy = strdup(list);
+    if (copy == NULL)
     {
-        fprintf(stderr, "Error: hash_size must be at least 8 bytes.\n");
+        fprintf(stderr, "Error: Memory allocation failed in parse_stripe_list.\n");
         return -1;
     }
 
-    // Convert the first 8 bytes of each hash to a uint64_t
-    // uint64_t current = byteArrayToLongLong(hash_output, 8);
-    // uint64_t previous = byteArrayToLongLong(prev_hash, 8);
-    // uint64_t distance = previous - current;
-
-    // Print debugging information
-    fprintf(stderr, "Debug Info:\n");
-
-    // Print the first 8 bytes of hash_output
-    fprintf(stderr, "hash_output (first 8 bytes): ");
-    for (size_t i = 0; i < 8; i++)
+    char *saveptr = NULL;
+    for (char *token = strtok_r(copy, ",", &saveptr); token != NULL; token = strtok_r(NULL, ",", &saveptr))
     {
-        fprintf(stderr, "%02X ", hash_output[i]);
+        if (set->count == MAX_STRIPES)
+        {
+            fprintf(stderr, "Error: at most %d stripes are supported in '%s'.\n", MAX_STRIPES, list);
+            free(copy);
+            return -1;
+        }
+
+        struct stat st;
+        if (stat(token, &st) == 0 && S_ISDIR(st.st_mode))
+        {
+            char *dir = concat_strings(token, token[strlen(token) - 1] == '/' ? "" : "/");
+            set->paths[set->count] = concat_strings(dir, default_name);
+            free(dir);
+        }
+        else
+        {
+            set->paths[set->count] = strdup(token);
+        }
+        set->count++;
     }
-    fprintf(stderr, "\n");
+    free(copy);
 
-    // Print the first 8 bytes of prev_hash
-    fprintf(stderr, "prev_hash (first 8 bytes): ");
-    for (size_t i = 0; i < 8; i++)
+    if (set->count == 0)
     {
-        fprintf(stderr, "%02X ", prev_hash[i]);
+        fprintf(stderr, "Error: no file or directory given in '%s'.\n", list);
+        return -1;
     }
-    fprintf(stderr, "\n");
+    return 0;
+}
 
-    // Print the computed 64-bit values and the difference
-    // fprintf(stderr, "current: %" PRIu64 "\n", current);
-    // fprintf(stderr, "previous: %" PRIu64 "\n", previous);
-    // fprintf(stderr, "current - previous: %" PRIu64 "\n", distance);
+// First bucket held by stripe s when total_buckets are split into contiguous ranges over count stripes
+unsigned long long stripe_first_bucket(size_t s, size_t count, unsigned long long total_buckets)
+{
+    return total_buckets * s / count;
+}
 
-    uint8_t hash_table2[hash_size];
-    blake3_hasher hasher;
-    blake3_hasher_init(&hasher);
-    blake3_hasher_update(&hasher, prev_nonce, NONCE_SIZE);
-    blake3_hasher_update(&hasher, nonce_output, NONCE_SIZE);
+#define PLOT_MAGIC 0x544f4c5058544c56ULL // "VLTXPLOT"
+#define PLOT_VERSION 1
+#define PLOT_HEADER_SIZE 4096 // one page, so the data that follows stays page aligned
 
-    blake3_hasher_finalize(&hasher, hash_table2, HASH_SIZE);
+#define PLOT_LAYOUT_FIXED 0   // every bucket has bucket_capacity slots, empty ones zeroed
+#define PLOT_LAYOUT_COMPACT 1 // index groups, then only the occupied records (CSR)
 
-    // Print the first 8 bytes of hash_table2
-    fprintf(stderr, "hash_table2 (first 8 bytes): ");
-    for (size_t i = 0; i < 8; i++)
+#define PLOT_FLAG_SORTED 1        // the occupied records of every bucket come first, sorted by pair key
+#define PLOT_FLAG_TABLE1_NONCES 2 // the nonces of a record are those of its table1 pair, so it is a proof
+
+// Header at the start of every table2 stripe; everything a reader needs to interpret the stripe
+typedef struct
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    int32_t k;
+    uint32_t nonce_size;
+    uint32_t record_size;
+    uint32_t hash_size;
+    uint32_t prefix_bits;
+    uint32_t entry_size; // bytes per table2 record
+    uint32_t layout;
+    uint32_t flags;
+    uint32_t stripe_index;
+    uint32_t num_stripes;
+    uint32_t fingerprint_bits; // hash bits stored in each record after the nonces
+    uint64_t rounds;
+    uint64_t num_buckets;      // buckets of the whole plot
+    uint64_t bucket_capacity;  // records per bucket in the fixed layout
+    uint64_t first_bucket;     // first bucket held by this stripe
+    uint64_t stripe_buckets;   // buckets held by this stripe
+    uint64_t num_records;      // records stored in this stripe, compact layout only
+    uint64_t pairing_distance; // hash distance under which two nonces were paired, 2^(64-K)
+    uint64_t checksum;
+} PlotHeader;
+
+// FNV-1a over everything but the trailing checksum
+uint64_t plot_header_checksum(const PlotHeader *h)
+{
+    const uint8_t *bytes = (const uint8_t *)h;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < offsetof(PlotHeader, checksum); i++)
     {
-        fprintf(stderr, "%02X ", hash_table2[i]);
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
     }
-    fprintf(stderr, "\n");
-
-    return 0;
+    return hash;
 }
 
-uint64_t compute_hash_distance_debug(const uint8_t *hash_output, const uint8_t *prev_hash, size_t hash_size)
+// Function to write the header of stripe s of num_stripes final stripes, describing the plot being generated
+int plot_write_header(int fd, size_t s, size_t num_stripes, uint32_t layout, unsigned long long num_records)
 {
-    // Ensure there are at least 8 bytes in the hash
-    if (hash_size < 8)
+    uint8_t page[PLOT_HEADER_SIZE] = {0};
+    PlotHeader *h = (PlotHeader *)page;
+    h->magic = PLOT_MAGIC;
+    h->version = PLOT_VERSION;
+    h->header_size = PLOT_HEADER_SIZE;
+    h->k = K;
+    h->nonce_size = NONCE_SIZE;
+    h->record_size = RECORD_SIZE;
+    h->hash_size = HASH_SIZE;
+    h->prefix_bits = PREFIX_SIZE * 8;
+    h->entry_size = sizeof(MemoRecord2);
+    h->fingerprint_bits = FINGERPRINT_BITS;
+    h->layout = layout;
+    h->flags = PLOT_FLAG_TABLE1_NONCES | (SORTED_BUCKETS ? PLOT_FLAG_SORTED : 0);
+    h->stripe_index = s;
+    h->num_stripes = num_stripes;
+    h->rounds = rounds;
+    h->num_buckets = num_buckets;
+    h->bucket_capacity = num_records_in_bucket * rounds;
+    h->first_bucket = stripe_first_bucket(s, num_stripes, num_buckets);
+    h->stripe_buckets = stripe_first_bucket(s + 1, num_stripes, num_buckets) - h->first_bucket;
+    h->num_records = num_records;
+    h->pairing_distance = 1ULL << (64 - K);
+    h->checksum = plot_header_checksum(h);
+
+    if (write_full_at(fd, page, PLOT_HEADER_SIZE, 0) != PLOT_HEADER_SIZE)
     {
-        fprintf(stderr, "Error: hash_size must be at least 8 bytes.\n");
-        return 0;
+        perror("Error writing plot header");
+        return -1;
     }
+    return 0;
+}
 
-    // Convert the first 8 bytes of each hash to a uint64_t
-    uint64_t current = byteArrayToLongLong(hash_output, 8);
-    uint64_t previous = byteArrayToLongLong(prev_hash, 8);
-    uint64_t distance = previous - current;
+#define CSR_GROUP 64 // buckets described by one index group
 
-    // Print debugging information
-    fprintf(stderr, "Debug Info:\n");
+// Compact (CSR) table2 stripe: header, one index group per CSR_GROUP buckets, then the occupied records back to back
+typedef struct
+{
+    uint64_t base;              // first record of the group, counted from the start of the record area
+    uint16_t counts[CSR_GROUP]; // records in each bucket of the group
+} CompactGroup;
 
-    // Print the first 8 bytes of hash_output
-    fprintf(stderr, "hash_output (first 8 bytes): ");
-    for (size_t i = 0; i < 8; i++)
+// Function to compute where the record area of a compact stripe starts
+off_t compact_data_offset(unsigned long long num_buckets_in_stripe)
+{
+    return PLOT_HEADER_SIZE + (num_buckets_in_stripe + CSR_GROUP - 1) / CSR_GROUP * sizeof(CompactGroup);
+}
+
+// Writer of one compact stripe; buckets must be appended in order
+typedef struct
+{
+    int fd;
+    size_t stripe;
+    size_t num_stripes;
+    unsigned long long num_buckets;
+    unsigned long long num_appended; // buckets appended so far
+    unsigned long long num_records;  // records appended so far
+    off_t data_offset;
+    CompactGroup *index;
+} CompactWriter;
+
+// Function to start (or continue after buckets_done buckets) compact stripe s of num_stripes; a continued
+// stripe gets its record count back from the index groups already on disk
+int compact_writer_open(CompactWriter *w, int fd, size_t s, size_t num_stripes, unsigned long long buckets_done)
+{
+    unsigned long long num_buckets_in_stripe = stripe_first_bucket(s + 1, num_stripes, num_buckets) - stripe_first_bucket(s, num_stripes, num_buckets);
+    size_t num_groups = (num_buckets_in_stripe + CSR_GROUP - 1) / CSR_GROUP;
+    memset(w, 0, sizeof(CompactWriter));
+    w->fd = fd;
+    w->stripe = s;
+    w->num_stripes = num_stripes;
+    w->num_buckets = num_buckets_in_stripe;
+    w->data_offset = compact_data_offset(num_buckets_in_stripe);
+    w->index = (CompactGroup *)calloc(max(num_groups, 1), sizeof(CompactGroup));
+    if (w->index == NULL)
     {
-        fprintf(stderr, "%02X ", hash_output[i]);
+        fprintf(stderr, "Error: Unable to allocate memory for the compact index.\n");
+        return -1;
     }
-    fprintf(stderr, "\n");
 
-    // Print the first 8 bytes of prev_hash
-    fprintf(stderr, "prev_hash (first 8 bytes): ");
-    for (size_t i = 0; i < 8; i++)
+    if (buckets_done > 0)
     {
-        fprintf(stderr, "%02X ", prev_hash[i]);
+        size_t groups_done = (buckets_done + CSR_GROUP - 1) / CSR_GROUP;
+        size_t bytes = groups_done * sizeof(CompactGroup);
+        if (read_full_at(fd, w->index, bytes, PLOT_HEADER_SIZE) != (ssize_t)bytes)
+        {
+            perror("Error reading compact index");
+            return -1;
+        }
+        const CompactGroup *g = &w->index[groups_done - 1];
+        w->num_records = g->base;
+        for (size_t b = 0; b < buckets_done - (groups_done - 1) * CSR_GROUP; b++)
+            w->num_records += g->counts[b];
+        w->num_appended = buckets_done;
     }
-    fprintf(stderr, "\n");
-
-    // Print the computed 64-bit values and the difference
-    fprintf(stderr, "current: %" PRIu64 "\n", current);
-    fprintf(stderr, "previous: %" PRIu64 "\n", previous);
-    fprintf(stderr, "current - previous: %" PRIu64 "\n", distance);
+    return 0;
+}
 
-    return distance;
+// Function to record that the next bucket of the stripe holds count records
+void compact_writer_append(CompactWriter *w, size_t count)
+{
+    CompactGroup *g = &w->index[w->num_appended / CSR_GROUP];
+    if (w->num_appended % CSR_GROUP == 0)
+        g->base = w->num_records;
+    g->counts[w->num_appended % CSR_GROUP] = (uint16_t)count;
+    w->num_appended++;
+    w->num_records += count;
 }
 
-// Returns true if the first 'prefix_bits' of hash1 and hash2 are identical.
-bool compute_hash_similarity(const uint8_t *hash1, const uint8_t *hash2, size_t hash_size, int prefix_bits)
+// Function to write the index groups describing buckets [from, to) of the stripe
+int compact_writer_write_index(CompactWriter *w, unsigned long long from, unsigned long long to)
 {
-    // Determine how many full bytes are covered by prefix_bits.
-    int full_bytes = prefix_bits / 8;
-    // And how many extra bits remain.
-    int extra_bits = prefix_bits % 8;
+    if (to <= from)
+        return 0;
+    size_t g0 = from / CSR_GROUP;
+    size_t g1 = (to + CSR_GROUP - 1) / CSR_GROUP;
+    size_t bytes = (g1 - g0) * sizeof(CompactGroup);
+    if (write_full_at(w->fd, &w->index[g0], bytes, PLOT_HEADER_SIZE + g0 * sizeof(CompactGroup)) != (ssize_t)bytes)
+    {
+        perror("Error writing compact index");
+        return -1;
+    }
+    return 0;
+}
 
-    // Compare all the full bytes.
-    for (size_t i = 0; i < (size_t)full_bytes; i++)
+// Function to finish a stripe: write the header and cut the file to the records it holds
+int compact_writer_close(CompactWriter *w)
+{
+    int rc = 0;
+    if (plot_write_header(w->fd, w->stripe, w->num_stripes, PLOT_LAYOUT_COMPACT, w->num_records) != 0 ||
+        ftruncate(w->fd, w->data_offset + w->num_records * sizeof(MemoRecord2)) != 0)
     {
-        if (hash1[i] != hash2[i])
-            return false;
+        perror("Error finishing compact file");
+        rc = -1;
     }
+    free(w->index);
+    w->index = NULL;
+    return rc;
+}
 
-    // If there are extra bits, compare only the high bits of the next byte.
-    if (extra_bits > 0 && full_bytes < (int)hash_size)
+// Function to write the in-memory table2 buckets of a single round straight to the final stripes in
+// compact layout; the records of each bucket are its first buckets2[i].count slots
+void write_table2_compact(const StripeSet *dest)
+{
+    size_t staging_records = max(num_records_in_bucket, (size_t)1024 * 1024);
+    MemoRecord2 *staging = (MemoRecord2 *)malloc(staging_records * sizeof(MemoRecord2));
+    if (staging == NULL)
     {
-        // Create a mask to extract the top 'extra_bits' bits.
-        uint8_t mask = 0xFF << (8 - extra_bits);
-        if ((hash1[full_bytes] & mask) != (hash2[full_bytes] & mask))
-            return false;
+        fprintf(stderr, "Error: Unable to allocate memory for the compact writer.\n");
+        exit(EXIT_FAILURE);
     }
 
-    return true;
-}
+    for (size_t s = 0; s < dest->count; s++)
+    {
+        unsigned long long first = stripe_first_bucket(s, dest->count, num_buckets);
+        unsigned long long last = stripe_first_bucket(s + 1, dest->count, num_buckets);
+        int fd = open(dest->paths[s], O_RDWR | O_CREAT | O_TRUNC, 0644);
+        CompactWriter w;
+        if (fd == -1 || compact_writer_open(&w, fd, s, dest->count, 0) != 0)
+        {
+            printf("Error opening file %s (#6)\n", dest->paths[s]);
+            perror("Error opening file");
+            exit(EXIT_FAILURE);
+        }
 
-uint64_t hash_pass_count_global = 0;
+        size_t staged = 0;
+        off_t offset = w.data_offset;
+        for (unsigned long long i = first; i < last; i++)
+        {
+            size_t count = min(buckets2[i].count, num_records_in_bucket);
+            if (staged + count > staging_records)
+            {
+                if (write_full_at(fd, staging, staged * sizeof(MemoRecord2), offset) != (ssize_t)(staged * sizeof(MemoRecord2)))
+                {
+                    perror("Error writing bucket to file");
+                    exit(EXIT_FAILURE);
+                }
+                offset += staged * sizeof(MemoRecord2);
+                staged = 0;
+            }
+            memcpy(&staging[staged], buckets2[i].records, count * sizeof(MemoRecord2));
+            staged += count;
+            compact_writer_append(&w, count);
+        }
+        if (write_full_at(fd, staging, staged * sizeof(MemoRecord2), offset) != (ssize_t)(staged * sizeof(MemoRecord2)) ||
+            compact_writer_write_index(&w, 0, last - first) != 0 || compact_writer_close(&w) != 0 || fdatasync(fd) != 0)
+        {
+            perror("Error writing compact file");
+            exit(EXIT_FAILURE);
+        }
+        close(fd);
+    }
+    free(staging);
+}
 
-size_t process_memo_records(const char *filename, const size_t BATCH_SIZE)
+// Function to find the first record of a bucket whose hash starts with key; one thread, no copies
+const MemoRecord2 *search_bucket_records(const MemoRecord2 *records, size_t count, const uint8_t *key, size_t key_length)
 {
-    // const size_t BATCH_SIZE = 1000000; // 1 million MemoRecords per batch
-    MemoRecord *buffer = NULL;
-    size_t total_records = 0;
-    size_t zero_nonce_count = 0;
-    size_t full_buckets = 0;
-    bool bucket_not_full = false;
-    size_t records_read;
-    FILE *file = NULL;
-    uint8_t prev_hash[HASH_SIZE] = {0};   // Initialize previous hash prefix to zero
-    uint8_t prev_nonce[NONCE_SIZE] = {0}; // Initialize previous nonce to zero
-    size_t count_condition_met = 0;       // Counter for records meeting the condition
-    size_t count_condition_not_met = 0;
+    uint8_t hash_output[BLAKE3_OUT_LEN];
+    size_t hash_length = min(max(key_length, (size_t)8), (size_t)BLAKE3_OUT_LEN);
+    FingerprintFilter filter = fingerprint_filter(key, key_length);
 
-    long filesize = get_file_size(filename);
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (!fingerprint_pass(&records[i], filter))
+            continue;
+        if (!is_nonce_nonzero(records[i].nonce1, NONCE_SIZE) || !is_nonce_nonzero(records[i].nonce2, NONCE_SIZE))
+            continue;
 
-    if (filesize != -1)
+        blake3_hasher hasher;
+        blake3_hasher_init(&hasher);
+        blake3_hasher_update(&hasher, records[i].nonce1, NONCE_SIZE);
+        blake3_hasher_update(&hasher, records[i].nonce2, NONCE_SIZE);
+        blake3_hasher_finalize(&hasher, hash_output, hash_length);
+
+        if (memcmp(hash_output, key, key_length) == 0)
+            return &records[i];
+    }
+    return NULL;
+}
+
+// Function to find the first record of a sorted bucket whose hash starts with key: an interpolation search on the
+// pair key finds the first record that can match, and the scan from there stops at the first key past it
+const MemoRecord2 *search_bucket_sorted(const MemoRecord2 *records, size_t count, const uint8_t *key, size_t key_length)
+{
+    uint8_t hash_output[BLAKE3_OUT_LEN];
+    size_t hash_length = min(max(key_length, (size_t)8), (size_t)BLAKE3_OUT_LEN);
+
+    // the occupied records come first, the empty slots of a fixed layout bucket after them
+    size_t lo = 0;
+    size_t hi = count;
+    while (lo < hi)
     {
-        if (!BENCHMARK)
-            printf("Size of '%s' is %ld bytes.\n", filename, filesize);
+        size_t mid = lo + (hi - lo) / 2;
+        if (is_nonce_nonzero(records[mid].nonce1, NONCE_SIZE) || is_nonce_nonzero(records[mid].nonce2, NONCE_SIZE))
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    count = lo;
 
-    printf("num_records_in_bucket=%llu\n", num_records_in_bucket);
-    printf("BATCH_SIZE=%lu\n", BATCH_SIZE);
-    printf("filesize=%ld\n", filesize);
+    // the keys a match can have: the key bytes after the prefix, padded with 0x00 and with 0xFF
+    uint8_t first[PAIR_KEY_SIZE];
+    uint8_t last[PAIR_KEY_SIZE];
+    for (size_t n = 0; n < PAIR_KEY_SIZE; n++)
+    {
+        first[n] = PREFIX_SIZE + n < key_length ? key[PREFIX_SIZE + n] : 0x00;
+        last[n] = PREFIX_SIZE + n < key_length ? key[PREFIX_SIZE + n] : 0xFF;
+    }
+    uint32_t key_first = (uint32_t)byteArrayToLongLong(first, PAIR_KEY_SIZE);
+    uint32_t key_last = (uint32_t)byteArrayToLongLong(last, PAIR_KEY_SIZE);
+
+    // interpolation search for the first record with a key of at least key_first; the keys of [lo, hi) lie in
+    // [bound_lo, bound_hi], and a probe that does not halve the range is followed by a bisection
+    lo = 0;
+    hi = count;
+    uint64_t bound_lo = 0;
+    uint64_t bound_hi = UINT32_MAX;
+    bool bisect = false;
+    while (hi - lo > 4)
+    {
+        size_t before = hi - lo;
+        size_t pos = lo + before / 2;
+        if (!bisect)
+            pos = lo + (size_t)((double)(key_first - bound_lo) / (double)(bound_hi - bound_lo + 1) * before);
+        pos = min(max(pos, lo), hi - 1);
+
+        uint32_t probe = pair_key(&records[pos]);
+        if (probe < key_first)
+        {
+            lo = pos + 1;
+            bound_lo = probe;
+        }
+        else
+        {
+            hi = pos;
+            bound_hi = probe;
+        }
+        bisect = !bisect && (hi - lo) * 2 > before;
+    }
 
-    // Open the file for reading in binary mode
-    file = fopen(filename, "rb");
-    if (file == NULL)
+    // the fingerprint ends the scan and skips the records that cannot match without hashing them
+    FingerprintFilter filter = fingerprint_filter(key, key_length);
+    for (size_t i = lo; i < count; ++i)
     {
-        printf("Error opening file %s (#3)\n", filename);
+        if (fingerprint_key(&records[i]) > key_last)
+            break;
+        if (!fingerprint_pass(&records[i], filter))
+            continue;
 
-        perror("Error opening file");
-        return 0;
+        blake3_hasher hasher;
+        blake3_hasher_init(&hasher);
+        blake3_hasher_update(&hasher, records[i].nonce1, NONCE_SIZE);
+        blake3_hasher_update(&hasher, records[i].nonce2, NONCE_SIZE);
+        blake3_hasher_finalize(&hasher, hash_output, hash_length);
+
+        if ((uint32_t)byteArrayToLongLong(&hash_output[PREFIX_SIZE], PAIR_KEY_SIZE) > key_last)
+            break;
+        if (memcmp(hash_output, key, key_length) == 0)
+            return &records[i];
     }
+    return NULL;
+}
 
-    // Allocate memory for the batch of MemoRecords
-    buffer = (MemoRecord *)malloc(BATCH_SIZE * sizeof(MemoRecord));
-    if (buffer == NULL)
+#define FILTER_MAGIC 0x4d4f4c4258544c56ULL // "VLTXBLOM"
+#define FILTER_VERSION 1
+#define FILTER_HEADER_SIZE 64
+#define FILTER_BLOCK_WORDS 8 // 512-bit blocks: every key sets and tests bits of one cache line
+#define FILTER_HASHES 8      // bits set per key
+
+// Header of the blocked Bloom filter kept next to a plot, in <first stripe>.bf
+typedef struct
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t key_size;   // leading hash bytes of each record that were inserted
+    uint32_t num_hashes; // bits per key
+    uint32_t reserved;
+    uint64_t num_blocks;
+    uint64_t num_keys;
+    uint64_t plot_id; // identity of the plot it was built from, see PlotFile.id
+    uint64_t checksum;
+} FilterHeader;
+
+// A filter loaded for search, with the outcome of the lookups it answered
+typedef struct
+{
+    FilterHeader header;
+    uint64_t *blocks;
+    unsigned long long checked;         // lookups long enough to be tested
+    unsigned long long rejected;        // lookups answered without touching the plot
+    unsigned long long false_positives; // lookups that passed and were not found
+} PlotFilter;
+
+// An open (possibly striped) table2 file, as seen by search and verify
+typedef struct PlotFile
+{
+    size_t num_stripes;
+    int fds[MAX_STRIPES];
+    const char *paths[MAX_STRIPES];
+    unsigned long long first_bucket[MAX_STRIPES + 1];
+    long filesize; // total bytes over all stripes
+    int k;
+    unsigned long long rounds;
+    unsigned long long num_buckets;
+    unsigned long long num_records_in_bucket; // bucket capacity
+    bool legacy;                              // written before plot headers existed, geometry derived from the size
+    bool compact;                             // CSR layout: only occupied records are stored
+    bool sorted;                              // buckets sorted by pair key
+    bool table1_nonces;                       // records hold their table1 nonces and can be verified as proofs
+    uint64_t pairing_distance;                // see PlotHeader
+    off_t data_offset[MAX_STRIPES];           // start of the records in each stripe
+    unsigned long long num_records;           // records stored, compact layout only
+    const uint8_t *maps[MAX_STRIPES];         // whole stripes mapped read only by plot_map(), or NULL
+    size_t map_sizes[MAX_STRIPES];
+    // reader matching the layout; reads count buckets starting at bucket rel of stripe s
+    ssize_t (*read_range)(const struct PlotFile *plot, size_t s, unsigned long long rel, unsigned long long count, MemoRecord2 *buffer, uint32_t *counts);
+    // kernel matching the bucket order; finds the first of count records whose hash starts with key
+    const MemoRecord2 *(*search)(const MemoRecord2 *records, size_t count, const uint8_t *key, size_t key_length);
+    uint64_t id;        // checksum of the first stripe header, or the file size of a legacy plot
+    PlotFilter *filter; // loaded by plot_load_filter(), or NULL
+} PlotFile;
+
+void plot_close(PlotFile *plot)
+{
+    for (size_t s = 0; s < plot->num_stripes; s++)
     {
-        fprintf(stderr, "Error: Unable to allocate memory.\n");
-        fclose(file);
-        return 0;
+        if (plot->maps[s] != NULL)
+            munmap((void *)plot->maps[s], plot->map_sizes[s]);
+        plot->maps[s] = NULL;
+        if (plot->fds[s] >= 0)
+            close(plot->fds[s]);
+        plot->fds[s] = -1;
+    }
+    plot->num_stripes = 0;
+    if (plot->filter != NULL)
+    {
+        free(plot->filter->blocks);
+        free(plot->filter);
+        plot->filter = NULL;
     }
+}
 
-    // Start walltime measurement
-    double start_time = omp_get_wtime();
-    // double end_time = omp_get_wtime();
+// Function to read the records of a range of buckets of a fixed layout stripe, empty slots included
+ssize_t plot_read_fixed(const PlotFile *plot, size_t s, unsigned long long rel, unsigned long long count, MemoRecord2 *buffer, uint32_t *counts)
+{
+    size_t bytes = count * plot->num_records_in_bucket * sizeof(MemoRecord2);
+    off_t offset = plot->data_offset[s] + rel * plot->num_records_in_bucket * sizeof(MemoRecord2);
 
-    // Read the file in batches
-    while ((records_read = fread(buffer, sizeof(MemoRecord), BATCH_SIZE, file)) > 0)
+    ssize_t bytes_read = read_full_at(plot->fds[s], buffer, bytes, offset);
+    if (bytes_read != (ssize_t)bytes)
+        return -1;
+    if (counts != NULL)
     {
-        double start_time_verify = omp_get_wtime();
-        double end_time_verify = omp_get_wtime();
-        bucket_not_full = false;
-        // uint64_t distance = 0;
-        // uint64_t HASH_SPACE = 1 << K;
-        // uint64_t M = 1 << 64;
-        // uint64_t M = UINT64_MAX;
-        // uint64_t expected_distance = M/(HASH_SPACE+1);
-        // uint64_t expected_distance = 1 << (64 - K + 1);
-        // printf("expected_distance=%llu\n",expected_distance);
-        // uint64_t min_distance = UINT64_MAX;
-        // uint64_t max_distance = 0;
-        // uint64_t total_distance = 0;
-        uint64_t count = 0;
-        // bool hash_pass = false;
-        // uint64_t hash_pass_count = 0;
-        // printf("records_read=%ld\n",records_read);
-        //  Process each MemoRecord in the batch
-        for (size_t i = 0; i < records_read; ++i)
-        {
-            ++total_records;
+        for (unsigned long long b = 0; b < count; b++)
+            counts[b] = plot->num_records_in_bucket;
+    }
+    return count * plot->num_records_in_bucket;
+}
 
-            if (is_nonce_nonzero(buffer[i].nonce, NONCE_SIZE))
-            {
-                uint8_t hash_output[HASH_SIZE];
+// Function to read the records of a range of buckets of a compact stripe into buffer, back to back;
+// one read for the index groups covering the range and one for the records
+ssize_t plot_read_compact(const PlotFile *plot, size_t s, unsigned long long rel, unsigned long long count, MemoRecord2 *buffer, uint32_t *counts)
+{
+    CompactGroup local[2];
+    size_t g0 = rel / CSR_GROUP;
+    size_t num_groups = (rel + count + CSR_GROUP - 1) / CSR_GROUP - g0;
+    CompactGroup *groups = num_groups <= 2 ? local : (CompactGroup *)malloc(num_groups * sizeof(CompactGroup));
+    if (groups == NULL)
+        return -1;
 
-                // Compute Blake3 hash of the nonce
-                blake3_hasher hasher;
-                blake3_hasher_init(&hasher);
-                blake3_hasher_update(&hasher, buffer[i].nonce, NONCE_SIZE);
-                blake3_hasher_finalize(&hasher, hash_output, HASH_SIZE);
+    ssize_t result = -1;
+    size_t bytes = num_groups * sizeof(CompactGroup);
+    if (read_full_at(plot->fds[s], groups, bytes, PLOT_HEADER_SIZE + g0 * sizeof(CompactGroup)) == (ssize_t)bytes)
+    {
+        unsigned long long start = groups[0].base;
+        for (size_t b = 0; b < rel % CSR_GROUP; b++)
+            start += groups[0].counts[b];
 
-                // Compare the first PREFIX_SIZE bytes of the current hash to the previous hash prefix
-                if (memcmp(hash_output, prev_hash, PREFIX_SIZE) >= 0)
-                {
-                    // Current hash's first PREFIX_SIZE bytes are equal to or greater than previous
-                    ++count_condition_met;
-                }
-                else
-                {
-                    ++count_condition_not_met;
+        unsigned long long total = 0;
+        for (unsigned long long b = 0; b < count; b++)
+        {
+            unsigned long long k = rel % CSR_GROUP + b;
+            uint16_t n = groups[k / CSR_GROUP].counts[k % CSR_GROUP];
+            if (counts != NULL)
+                counts[b] = n;
+            total += n;
+        }
 
-                    if (DEBUG)
-                    {
-                        // Print previous hash and nonce, and current hash and nonce
-                        printf("Condition not met at record %zu:\n", total_records);
-                        printf("Previous nonce: ");
-                        for (size_t n = 0; n < NONCE_SIZE; ++n)
-                            printf("%02X", prev_nonce[n]);
-                        printf("\n");
-                        printf("Previous hash prefix: ");
-                        for (size_t n = 0; n < PREFIX_SIZE; ++n)
-                            printf("%02X", prev_hash[n]);
-                        printf("\n");
+        bytes = total * sizeof(MemoRecord2);
+        if (read_full_at(plot->fds[s], buffer, bytes, plot->data_offset[s] + start * sizeof(MemoRecord2)) == (ssize_t)bytes)
+            result = total;
+    }
 
-                        printf("Current nonce: ");
-                        for (size_t n = 0; n < NONCE_SIZE; ++n)
-                            printf("%02X", buffer[i].nonce[n]);
-                        printf("\n");
-                        printf("Current hash prefix: ");
-                        for (size_t n = 0; n < PREFIX_SIZE; ++n)
-                            printf("%02X", hash_output[n]);
-                        printf("\n");
-                    }
-                }
+    if (groups != local)
+        free(groups);
+    return result;
+}
 
-                /*            // Call the function and capture the Hamming distance.
-                            distance = compute_hash_hamming_distance(hash_output, prev_hash, HASH_SIZE);
+// Function to open every stripe of a table2 file: one header read per stripe gives the geometry and layout,
+// and a plot written by a build with other record parameters is rejected
+int plot_open(PlotFile *plot, const StripeSet *set)
+{
+    memset(plot, 0, sizeof(PlotFile));
+    off_t sizes[MAX_STRIPES];
 
-                                    // Update min and max values.
-                    if (distance < min_distance) {
-                        min_distance = distance;
-                    }
-                    if (distance > max_distance) {
-                        max_distance = distance;
-                    }*/
+    for (size_t s = 0; s < set->count; s++)
+    {
+        plot->paths[s] = set->paths[s];
+        plot->fds[s] = open(set->paths[s], O_RDONLY);
+        if (plot->fds[s] == -1)
+        {
+            printf("Error opening file %s (#3)\n", set->paths[s]);
+            perror("Error opening file");
+            plot->num_stripes = s;
+            plot_close(plot);
+            return -1;
+        }
+        plot->num_stripes = s + 1;
 
-                // hash_pass = compute_hash_similarity(prev_hash, hash_output, HASH_SIZE, 25);
-                /*distance = compute_hash_distance(prev_hash, hash_output, HASH_SIZE);
-                if (distance <= expected_distance)
-                {
-                    hash_pass_count++;
-                    }*/
+        struct stat st;
+        if (fstat(plot->fds[s], &st) != 0)
+        {
+            perror("Error getting file size");
+            plot_close(plot);
+            return -1;
+        }
+        sizes[s] = st.st_size;
+        plot->filesize += st.st_size;
+    }
 
-                /*
-                             printf("Record %zu:\n", total_records);
-                             printf("Previous nonce: ");
-                             for (size_t n = 0; n < NONCE_SIZE; ++n)
-                                 printf("%02X", prev_nonce[n]);
-                             printf("\n");
-                             printf("Previous hash prefix: ");
-                             for (size_t n = 0; n < HASH_SIZE; ++n)
-                                 printf("%02X", prev_hash[n]);
-                             printf("\n");
-
-                             printf("Current nonce: ");
-                             for (size_t n = 0; n < NONCE_SIZE; ++n)
-                                 printf("%02X", buffer[i].nonce[n]);
-                             printf("\n");
-                             printf("Current hash prefix: ");
-                             for (size_t n = 0; n < HASH_SIZE; ++n)
-                                 printf("%02X", hash_output[n]);
-                             printf("\n");
-                             */
-
-                // Update running total and count.
-                // total_distance += distance;
-                count++;
+    PlotHeader first;
+    if (read_full_at(plot->fds[0], &first, sizeof(first), 0) != (ssize_t)sizeof(first) || first.magic != PLOT_MAGIC)
+    {
+        // a plot from before headers existed: trust that this build matches it and derive the geometry from the size
+        if (!BENCHMARK)
+            fprintf(stderr, "Warning: %s has no plot header, assuming it was written by this build (NONCE_SIZE=%d)\n", plot->paths[0], NONCE_SIZE);
+        plot->legacy = true;
+        plot->pairing_distance = 1ULL << (64 - K);
+        plot->k = K;
+        plot->rounds = 1;
+        plot->num_buckets = 1ULL << (PREFIX_SIZE * 8);
+        plot->num_records_in_bucket = plot->filesize / plot->num_buckets / sizeof(MemoRecord2);
+        plot->read_range = plot_read_fixed;
+        plot->search = search_bucket_records;
+        plot->id = plot->filesize;
+        for (size_t s = 0; s <= plot->num_stripes; s++)
+        {
+            plot->first_bucket[s] = stripe_first_bucket(s, plot->num_stripes, plot->num_buckets);
+        }
 
-                //	printf("count=%llu distance=%llu min_distance=%llu max_distance=%llu total_distance=%llu hash_pass_count=%llu\n",count, distance, min_distance, max_distance, total_distance,hash_pass_count);
-                // printf("count=%llu hash_pass_count=%llu\n",count,hash_pass_count);
-                //  Update the previous hash prefix and nonce
-                memcpy(prev_hash, hash_output, HASH_SIZE);
-                memcpy(prev_nonce, buffer[i].nonce, NONCE_SIZE);
-            }
-            else
+        // every stripe must hold exactly its bucket range, otherwise a stripe is missing or listed out of order
+        for (size_t s = 0; s < plot->num_stripes; s++)
+        {
+            off_t expected = (plot->first_bucket[s + 1] - plot->first_bucket[s]) * plot->num_records_in_bucket * sizeof(MemoRecord2);
+            if (sizes[s] != expected)
             {
-                ++zero_nonce_count;
-                bucket_not_full = true;
-                // Optionally, handle zero nonces here
+                fprintf(stderr, "Error: stripe %s has %lld bytes, expected %lld; check the stripe list and its order.\n",
+                        plot->paths[s], (long long)sizes[s], (long long)expected);
+                plot_close(plot);
+                return -1;
             }
         }
-        if (bucket_not_full == false)
-            full_buckets++;
-        end_time_verify = omp_get_wtime();
+        return 0;
+    }
 
-        // Calculate average distance.
-        // double average_distance = (count > 0) ? (double)total_distance / count : 0.0;
+    if (first.checksum != plot_header_checksum(&first) || first.version > PLOT_VERSION || first.header_size < sizeof(PlotHeader) ||
+        first.layout > PLOT_LAYOUT_COMPACT)
+    {
+        fprintf(stderr, "Error: %s has a corrupt or unsupported plot header (version %u).\n", plot->paths[0], first.version);
+        plot_close(plot);
+        return -1;
+    }
+    if (first.nonce_size != NONCE_SIZE || first.record_size != RECORD_SIZE || first.prefix_bits != PREFIX_SIZE * 8 ||
+        first.fingerprint_bits != FINGERPRINT_BITS || first.entry_size != sizeof(MemoRecord2))
+    {
+        fprintf(stderr, "Error: %s was written with NONCE_SIZE=%u RECORD_SIZE=%u PREFIX_SIZE=%u FINGERPRINT_BITS=%u, "
+                        "this build has NONCE_SIZE=%d RECORD_SIZE=%d PREFIX_SIZE=%d FINGERPRINT_BITS=%d; "
+                        "rebuild with make NONCE_SIZE=%u RECORD_SIZE=%u FINGERPRINT_BITS=%u.\n",
+                plot->paths[0], first.nonce_size, first.record_size, first.prefix_bits / 8, first.fingerprint_bits,
+                NONCE_SIZE, RECORD_SIZE, PREFIX_SIZE, FINGERPRINT_BITS,
+                first.nonce_size, first.record_size, first.fingerprint_bits);
+        plot_close(plot);
+        return -1;
+    }
+    if (first.num_stripes != plot->num_stripes)
+    {
+        fprintf(stderr, "Error: %s is one of %u stripes, %zu were given.\n", plot->paths[0], first.num_stripes, plot->num_stripes);
+        plot_close(plot);
+        return -1;
+    }
 
-        // Print summary of metrics.
-        // printf("Min distance: %llu\n", min_distance);
-        // printf("Max distance: %llu\n", max_distance);
-        // printf("Average distance: %.2f\n", average_distance);
-        /*hash_pass_count_global += hash_pass_count;
-        if (total_records%(1024*1024) == 0)
+    plot->k = first.k;
+    plot->rounds = first.rounds;
+    plot->num_buckets = first.num_buckets;
+    plot->num_records_in_bucket = first.bucket_capacity;
+    plot->compact = first.layout == PLOT_LAYOUT_COMPACT;
+    plot->read_range = plot->compact ? plot_read_compact : plot_read_fixed;
+    plot->sorted = (first.flags & PLOT_FLAG_SORTED) != 0;
+    plot->table1_nonces = (first.flags & PLOT_FLAG_TABLE1_NONCES) != 0;
+    plot->pairing_distance = first.pairing_distance;
+    plot->search = plot->sorted ? search_bucket_sorted : search_bucket_records;
+    plot->id = first.checksum;
+
+    for (size_t s = 0; s < plot->num_stripes; s++)
+    {
+        PlotHeader h;
+        if (s == 0)
+            h = first;
+        else if (read_full_at(plot->fds[s], &h, sizeof(h), 0) != (ssize_t)sizeof(h) || h.magic != PLOT_MAGIC || h.checksum != plot_header_checksum(&h))
         {
-            printf("Hashed passed: %llu %llu %.2f\n", hash_pass_count_global,total_records,hash_pass_count_global*100.0/total_records);
-            }*/
+            fprintf(stderr, "Error: %s has no valid plot header.\n", plot->paths[s]);
+            plot_close(plot);
+            return -1;
+        }
 
-        double elapsed_time_verify = end_time_verify - start_time_verify;
-        double elapsed_time = omp_get_wtime() - start_time;
+        // every stripe must belong to the same plot and sit at its place in the list
+        if (h.stripe_index != s || h.num_stripes != first.num_stripes || h.k != first.k || h.rounds != first.rounds ||
+            h.layout != first.layout || h.bucket_capacity != first.bucket_capacity || h.num_buckets != first.num_buckets ||
+            h.first_bucket != stripe_first_bucket(s, plot->num_stripes, plot->num_buckets))
+        {
+            fprintf(stderr, "Error: stripe %s is stripe %u of another plot or out of order; check the stripe list and its order.\n",
+                    plot->paths[s], h.stripe_index);
+            plot_close(plot);
+            return -1;
+        }
+        plot->first_bucket[s] = h.first_bucket;
+        plot->first_bucket[s + 1] = h.first_bucket + h.stripe_buckets;
 
-        // Calculate throughput (hashes per second)
-        double throughput = (BATCH_SIZE * sizeof(MemoRecord) / elapsed_time_verify) / (1024 * 1024);
-        if (total_records % (1024 * 1024) == 0)
-            printf("[%.2f] Verify %.2f%%: %.2f MB/s\n", elapsed_time, total_records * sizeof(MemoRecord) * 100.0 / filesize, throughput);
+        off_t expected;
+        if (plot->compact)
+        {
+            plot->data_offset[s] = compact_data_offset(h.stripe_buckets);
+            plot->num_records += h.num_records;
+            expected = plot->data_offset[s] + h.num_records * sizeof(MemoRecord2);
+        }
+        else
+        {
+            plot->data_offset[s] = h.header_size;
+            expected = plot->data_offset[s] + h.stripe_buckets * plot->num_records_in_bucket * sizeof(MemoRecord2);
+        }
+        if (sizes[s] != expected)
+        {
+            fprintf(stderr, "Error: stripe %s has %lld bytes, expected %lld; it is truncated.\n", plot->paths[s], (long long)sizes[s], (long long)expected);
+            plot_close(plot);
+            return -1;
+        }
     }
+    return 0;
+}
 
-    // Check for reading errors
-    if (ferror(file))
+// Function to find which stripe holds a bucket
+size_t plot_stripe_of_bucket(const PlotFile *plot, unsigned long long bucketIndex)
+{
+    size_t s = bucketIndex * plot->num_stripes / plot->num_buckets;
+    while (s + 1 < plot->num_stripes && plot->first_bucket[s + 1] <= bucketIndex)
+        s++;
+    while (s > 0 && plot->first_bucket[s] > bucketIndex)
+        s--;
+    return s;
+}
+
+// Function to map every stripe of an open plot read only; the mapping is shared by all threads, and
+// MADV_RANDOM keeps the kernel from reading ahead around the single bucket a lookup touches
+int plot_map(PlotFile *plot)
+{
+    for (size_t s = 0; s < plot->num_stripes; s++)
     {
-        perror("Error reading file");
+        off_t size = lseek(plot->fds[s], 0, SEEK_END);
+        void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, plot->fds[s], 0);
+        if (map == MAP_FAILED)
+        {
+            printf("Error mapping file %s\n", plot->paths[s]);
+            perror("Error mapping file");
+            return -1;
+        }
+        if (madvise(map, size, MADV_RANDOM) != 0)
+            perror("Warning: madvise failed");
+        plot->maps[s] = (const uint8_t *)map;
+        plot->map_sizes[s] = size;
     }
+    return 0;
+}
 
-    // Clean up
-    fclose(file);
-    free(buffer);
+// Function to drop a stripe from the page cache, and from the mapping, so its next read goes to the device;
+// unlike drop_caches this needs no root
+void plot_evict(const PlotFile *plot, size_t s)
+{
+    if (plot->maps[s] != NULL)
+        madvise((void *)plot->maps[s], plot->map_sizes[s], MADV_DONTNEED);
+#ifdef __linux__
+    posix_fadvise(plot->fds[s], 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
 
-    // Print the total number of times the condition was met
-    printf("sorted=%zu not_sorted=%zu zero_nonces=%zu total_records=%zu full_buckets=%zu storage_efficiency=%.2f bucket_efficiency=%.2f\n",
-           count_condition_met, count_condition_not_met, zero_nonce_count, total_records, full_buckets, count_condition_met * 100.0 / total_records, full_buckets * 100.0 / (num_buckets));
+// Function to start a cold search (--cold): no read-ahead that would warm the neighbours of a bucket,
+// and nothing of the plot in the page cache
+void plot_make_cold(const PlotFile *plot)
+{
+    for (size_t s = 0; s < plot->num_stripes; s++)
+    {
+#ifdef __linux__
+        posix_fadvise(plot->fds[s], 0, 0, POSIX_FADV_RANDOM);
+#endif
+        plot_evict(plot, s);
+    }
+}
 
-    return count_condition_met;
+// Function to point at the records of a bucket inside the mapping, without copying; sets *count
+const MemoRecord2 *plot_bucket_view(const PlotFile *plot, unsigned long long bucketIndex, size_t *count)
+{
+    size_t s = plot_stripe_of_bucket(plot, bucketIndex);
+    unsigned long long rel = bucketIndex - plot->first_bucket[s];
+    const MemoRecord2 *records = (const MemoRecord2 *)(plot->maps[s] + plot->data_offset[s]);
+
+    if (plot->compact)
+    {
+        const CompactGroup *g = (const CompactGroup *)(plot->maps[s] + PLOT_HEADER_SIZE) + rel / CSR_GROUP;
+        unsigned long long start = g->base;
+        for (size_t b = 0; b < rel % CSR_GROUP; b++)
+            start += g->counts[b];
+        *count = g->counts[rel % CSR_GROUP];
+        return records + start;
+    }
+    *count = plot->num_records_in_bucket;
+    return records + rel * plot->num_records_in_bucket;
 }
 
-size_t process_memo_records_table2_old(const char *filename, const size_t BATCH_SIZE)
+// Function to read count consecutive buckets starting at bucketIndex into buffer;
+// uses positioned I/O so it can be called from several threads, returns the number of records read, or -1
+// if a read failed (counts is then incomplete). In the fixed layout every bucket fills num_records_in_bucket
+// slots, empty ones zeroed; in the compact layout only the occupied records are read, back to back, and a
+// range of empty buckets reads 0 records. counts (optional) receives the records per bucket.
+ssize_t plot_read_buckets(const PlotFile *plot, unsigned long long bucketIndex, unsigned long long count, MemoRecord2 *buffer, uint32_t *counts)
 {
-    // const size_t BATCH_SIZE = 1000000; // 1 million MemoRecords per batch
-    MemoRecord2 *buffer = NULL;
-    size_t total_records = 0;
-    size_t zero_nonce_count = 0;
-    size_t full_buckets = 0;
-    bool bucket_not_full = false;
-    size_t records_read;
-    FILE *file = NULL;
-    uint8_t prev_hash[HASH_SIZE] = {0};    // Initialize previous hash prefix to zero
-    uint8_t prev_nonce1[NONCE_SIZE] = {0}; // Initialize previous nonce to zero
-    uint8_t prev_nonce2[NONCE_SIZE] = {0}; // Initialize previous nonce to zero
-    size_t count_condition_met = 0;        // Counter for records meeting the condition
-    size_t count_condition_not_met = 0;
+    size_t records_read = 0;
+    while (count > 0)
+    {
+        size_t s = plot_stripe_of_bucket(plot, bucketIndex);
+        unsigned long long in_stripe = min(count, plot->first_bucket[s + 1] - bucketIndex);
 
-    long filesize = get_file_size(filename);
+        ssize_t n = plot->read_range(plot, s, bucketIndex - plot->first_bucket[s], in_stripe, &buffer[records_read], counts);
+        if (n < 0)
+        {
+            perror("Error reading file");
+            return -1;
+        }
+        records_read += n;
 
-    if (filesize != -1)
+        if (counts != NULL)
+            counts += in_stripe;
+        bucketIndex += in_stripe;
+        count -= in_stripe;
+    }
+    return records_read;
+}
+
+// Function to read buckets for a lookup, where a failed read (already reported) is a miss: records read, or 0
+size_t plot_lookup_read(const PlotFile *plot, unsigned long long bucketIndex, unsigned long long count, MemoRecord2 *buffer)
+{
+    ssize_t records_read = plot_read_buckets(plot, bucketIndex, count, buffer, NULL);
+    return records_read > 0 ? (size_t)records_read : 0;
+}
+
+// FNV-1a over everything but the trailing checksum
+uint64_t filter_header_checksum(const FilterHeader *h)
+{
+    const uint8_t *bytes = (const uint8_t *)h;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < offsetof(FilterHeader, checksum); i++)
     {
-        if (!BENCHMARK)
-            printf("Size of '%s' is %ld bytes.\n", filename, filesize);
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
     }
+    return hash;
+}
 
-    printf("num_records_in_bucket=%llu\n", num_records_in_bucket);
-    printf("BATCH_SIZE=%lu\n", BATCH_SIZE);
-    printf("filesize=%ld\n", filesize);
+// Function to mix the leading key_size bytes of a hash into the word that places a key in the filter
+uint64_t filter_key_hash(const uint8_t *key, size_t key_size)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < key_size; i++)
+    {
+        hash = (hash ^ key[i]) * 0x100000001b3ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
 
-    // Open the file for reading in binary mode
-    file = fopen(filename, "rb");
-    if (file == NULL)
+// Function to set (atomically) or test the bits of a key; returns whether they were all set
+bool filter_bits(uint64_t *blocks, uint64_t num_blocks, uint64_t hash, bool set)
+{
+    uint64_t *block = &blocks[(hash % num_blocks) * FILTER_BLOCK_WORDS];
+    // Bit positions are 9-bit slices of further mixed words, independent of the block choice
+    uint64_t bits = 0;
+    bool all = true;
+    for (int i = 0; i < FILTER_HASHES; i++, bits >>= 9)
     {
-        printf("Error opening file %s (#3)\n", filename);
+        if (i % 7 == 0)
+        {
+            bits = (hash + (uint64_t)(i + 1) * 0x9e3779b97f4a7c15ULL);
+            bits = (bits ^ (bits >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            bits = (bits ^ (bits >> 27)) * 0x94d049bb133111ebULL;
+            bits ^= bits >> 31;
+        }
+        uint32_t bit = (uint32_t)(bits % (FILTER_BLOCK_WORDS * 64));
+        uint64_t mask = 1ULL << (bit % 64);
+        uint64_t *word = &block[bit / 64];
+        if (set)
+        {
+#pragma omp atomic
+            *word |= mask;
+        }
+        else if ((*word & mask) == 0)
+        {
+            all = false;
+            break;
+        }
+    }
+    return all;
+}
 
-        perror("Error opening file");
-        return 0;
+// Function to estimate the false positive rate of a blocked Bloom filter: a plain Bloom filter's rate for each
+// number of keys a block can get, weighted by the Poisson odds of a block getting that many
+double filter_expected_fpr(const FilterHeader *h)
+{
+    double block_bits = FILTER_BLOCK_WORDS * 64;
+    double lambda = (double)h->num_keys / h->num_blocks;
+    double fpr = 0.0;
+    double weight = exp(-lambda);
+    for (int j = 0; j < lambda + 10 * sqrt(lambda) + 20; j++)
+    {
+        fpr += weight * pow(1.0 - pow(1.0 - 1.0 / block_bits, (double)h->num_hashes * j), h->num_hashes);
+        weight *= lambda / (j + 1);
     }
+    return fpr;
+}
 
-    // Allocate memory for the batch of MemoRecords
-    buffer = (MemoRecord2 *)malloc(BATCH_SIZE * sizeof(MemoRecord2));
-    if (buffer == NULL)
+// Function to count the occupied records of a range of buckets read by plot_read_buckets()
+unsigned long long filter_count_records(const MemoRecord2 *records, size_t count)
+{
+    unsigned long long n = 0;
+    for (size_t i = 0; i < count; i++)
     {
-        fprintf(stderr, "Error: Unable to allocate memory.\n");
-        fclose(file);
-        return 0;
+        if (is_nonce_nonzero(records[i].nonce1, NONCE_SIZE) || is_nonce_nonzero(records[i].nonce2, NONCE_SIZE))
+            n++;
     }
+    return n;
+}
 
-    // Start walltime measurement
+/**
+ * filter_build:
+ *   - Builds the blocked Bloom filter of a finished plot and writes it to <first stripe>.bf.
+ *   - Every occupied record is hashed again and its first key_size hash bytes inserted.
+ *   - The filter is sized from the number of records; a compact plot has it in its headers,
+ *     a fixed layout plot is read once more to count them.
+ *
+ * @param set          Stripes of the plot.
+ * @param key_size     Leading hash bytes inserted per record; lookups shorter than this bypass the filter.
+ * @param bits_per_key Filter bits per record.
+ * @return 0 on success, -1 on error.
+ */
+int filter_build(const StripeSet *set, size_t key_size, size_t bits_per_key)
+{
+    PlotFile plot;
+    if (plot_open(&plot, set) != 0)
+        return -1;
     double start_time = omp_get_wtime();
-    // double end_time = omp_get_wtime();
 
-    // Read the file in batches
-    while ((records_read = fread(buffer, sizeof(MemoRecord2), BATCH_SIZE, file)) > 0)
-    {
-        double start_time_verify = omp_get_wtime();
-        double end_time_verify = omp_get_wtime();
-        bucket_not_full = false;
-        // uint64_t distance = 0;
-        // uint64_t expected_distance = 1 << (64 - K + 1);
-        // uint64_t min_distance = UINT64_MAX;
-        // uint64_t max_distance = 0;
-        // uint64_t total_distance = 0;
-        uint64_t count = 0;
-        // bool hash_pass = false;
-        // uint64_t hash_pass_count = 0;
+    unsigned long long chunk_buckets = max(1, (1024 * 1024) / max(plot.num_records_in_bucket, 1));
+    unsigned long long num_chunks = (plot.num_buckets + chunk_buckets - 1) / chunk_buckets;
 
-        // Process each MemoRecord in the batch
-        for (size_t i = 0; i < records_read; ++i)
-        {
-            ++total_records;
+    FilterHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = FILTER_MAGIC;
+    h.version = FILTER_VERSION;
+    h.key_size = key_size;
+    h.num_hashes = FILTER_HASHES;
+    h.plot_id = plot.id;
+    h.num_keys = plot.num_records;
 
-            if (is_nonce_nonzero(buffer[i].nonce1, NONCE_SIZE) && is_nonce_nonzero(buffer[i].nonce2, NONCE_SIZE))
+    for (int pass = plot.compact ? 1 : 0; pass < 2; pass++)
+    {
+        uint64_t *blocks = NULL;
+        if (pass == 1)
+        {
+            h.num_blocks = max((h.num_keys * bits_per_key + FILTER_BLOCK_WORDS * 64 - 1) / (FILTER_BLOCK_WORDS * 64), 1);
+            blocks = (uint64_t *)calloc(h.num_blocks * FILTER_BLOCK_WORDS, sizeof(uint64_t));
+            if (blocks == NULL)
             {
-                uint8_t hash_output[HASH_SIZE];
+                fprintf(stderr, "Error: Unable to allocate %llu bytes for the filter.\n", (unsigned long long)h.num_blocks * FILTER_BLOCK_WORDS * 8);
+                plot_close(&plot);
+                return -1;
+            }
+        }
 
-                // Compute Blake3 hash of the nonce
-                blake3_hasher hasher;
-                blake3_hasher_init(&hasher);
-                blake3_hasher_update(&hasher, buffer[i].nonce1, NONCE_SIZE);
-                blake3_hasher_update(&hasher, buffer[i].nonce2, NONCE_SIZE);
-                blake3_hasher_finalize(&hasher, hash_output, HASH_SIZE);
+        unsigned long long num_keys = 0;
+#pragma omp parallel reduction(+ : num_keys)
+        {
+            MemoRecord2 *buffer = (MemoRecord2 *)malloc(chunk_buckets * plot.num_records_in_bucket * sizeof(MemoRecord2));
+            if (buffer == NULL)
+            {
+                fprintf(stderr, "Error: Unable to allocate memory.\n");
+                exit(EXIT_FAILURE);
+            }
 
-                // Compare the first PREFIX_SIZE bytes of the current hash to the previous hash prefix
-                if (memcmp(hash_output, prev_hash, PREFIX_SIZE) >= 0)
+#pragma omp for schedule(dynamic, 1)
+            for (unsigned long long c = 0; c < num_chunks; c++)
+            {
+                unsigned long long first = c * chunk_buckets;
+                ssize_t count = plot_read_buckets(&plot, first, min(chunk_buckets, plot.num_buckets - first), buffer, NULL);
+                if (count < 0)
                 {
-                    // Current hash's first PREFIX_SIZE bytes are equal to or greater than previous
-                    ++count_condition_met;
+                    fprintf(stderr, "Error: Unable to read the plot to build its filter.\n");
+                    exit(EXIT_FAILURE);
                 }
-                else
+                if (pass == 0)
                 {
-                    ++count_condition_not_met;
+                    num_keys += filter_count_records(buffer, count);
+                    continue;
+                }
+                for (size_t i = 0; i < (size_t)count; i++)
+                {
+                    if (!is_nonce_nonzero(buffer[i].nonce1, NONCE_SIZE) && !is_nonce_nonzero(buffer[i].nonce2, NONCE_SIZE))
+                        continue;
+                    uint8_t hash_output[BLAKE3_OUT_LEN];
+                    blake3_hasher hasher;
+                    blake3_hasher_init(&hasher);
+                    blake3_hasher_update(&hasher, buffer[i].nonce1, NONCE_SIZE);
+                    blake3_hasher_update(&hasher, buffer[i].nonce2, NONCE_SIZE);
+                    blake3_hasher_finalize(&hasher, hash_output, key_size);
+                    filter_bits(blocks, h.num_blocks, filter_key_hash(hash_output, key_size), true);
+                    num_keys++;
+                }
+            }
+            free(buffer);
+        }
+        h.num_keys = num_keys;
 
-                    if (DEBUG)
-                    {
-                        // Print previous hash and nonce, and current hash and nonce
-                        printf("Condition not met at record %zu:\n", total_records);
-                        printf("Previous nonce: ");
-                        for (size_t n = 0; n < NONCE_SIZE; ++n)
-                            printf("%02X", prev_nonce1[n]);
-                        printf("\n");
-                        for (size_t n = 0; n < NONCE_SIZE; ++n)
-                            printf("%02X", prev_nonce2[n]);
-                        printf("\n");
-                        printf("Previous hash prefix: ");
-                        for (size_t n = 0; n < PREFIX_SIZE; ++n)
-                            printf("%02X", prev_hash[n]);
-                        printf("\n");
-
-                        printf("Current nonces: ");
-                        for (size_t n = 0; n < NONCE_SIZE; ++n)
-                            printf("%02X", buffer[i].nonce1[n]);
-                        printf("\n");
-                        for (size_t n = 0; n < NONCE_SIZE; ++n)
-                            printf("%02X", buffer[i].nonce2[n]);
-                        printf("\n");
-                        printf("Current hash prefix: ");
-                        for (size_t n = 0; n < PREFIX_SIZE; ++n)
-                            printf("%02X", hash_output[n]);
-                        printf("\n");
-                    }
-                }
-
-                count++;
-
-                // Update the previous hash prefix and nonce
-                memcpy(prev_hash, hash_output, HASH_SIZE);
-                memcpy(prev_nonce1, buffer[i].nonce1, NONCE_SIZE);
-                memcpy(prev_nonce2, buffer[i].nonce2, NONCE_SIZE);
-            }
-            else
+        if (pass == 1)
+        {
+            h.checksum = filter_header_checksum(&h);
+
+            char *path = concat_strings(plot.paths[0], ".bf");
+            uint8_t page[FILTER_HEADER_SIZE] = {0};
+            memcpy(page, &h, sizeof(h));
+            size_t bytes_blocks = h.num_blocks * FILTER_BLOCK_WORDS * sizeof(uint64_t);
+            int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1 || write_full_at(fd, page, FILTER_HEADER_SIZE, 0) != FILTER_HEADER_SIZE ||
+                write_full_at(fd, blocks, bytes_blocks, FILTER_HEADER_SIZE) != (ssize_t)bytes_blocks || fdatasync(fd) != 0)
             {
-                ++zero_nonce_count;
-                bucket_not_full = true;
-                // Optionally, handle zero nonces here
+                printf("Error writing filter %s\n", path);
+                perror("Error writing filter");
+                if (fd != -1)
+                    close(fd);
+                free(path);
+                free(blocks);
+                plot_close(&plot);
+                return -1;
             }
+            close(fd);
+
+            if (!BENCHMARK)
+                printf("FILTER: %s: %llu records, %zu key bytes, %.2f MB, expected false positive rate %.4f%%, built in %.2f seconds\n",
+                       path, (unsigned long long)h.num_keys, key_size, bytes_blocks / (1024.0 * 1024.0), filter_expected_fpr(&h) * 100.0,
+                       omp_get_wtime() - start_time);
+            free(path);
+            free(blocks);
         }
-        if (bucket_not_full == false)
-            full_buckets++;
-        end_time_verify = omp_get_wtime();
+    }
 
-        double elapsed_time_verify = end_time_verify - start_time_verify;
-        double elapsed_time = omp_get_wtime() - start_time;
+    plot_close(&plot);
+    return 0;
+}
 
-        // Calculate throughput (hashes per second)
-        double throughput = (BATCH_SIZE * sizeof(MemoRecord2) / elapsed_time_verify) / (1024 * 1024);
-        if (total_records % (1024 * 1024) == 0)
-            printf("[%.2f] Verify %.2f%%: %.2f MB/s\n", elapsed_time, total_records * sizeof(MemoRecord2) * 100.0 / filesize, throughput);
+// Function to load the filter of an open plot into memory; a missing or stale filter is reported and ignored
+int plot_load_filter(PlotFile *plot)
+{
+    char *path = concat_strings(plot->paths[0], ".bf");
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Warning: no filter %s, searching without it (build it with --filter when plotting)\n", path);
+        free(path);
+        return -1;
     }
 
-    // Check for reading errors
-    if (ferror(file))
+    PlotFilter *filter = (PlotFilter *)calloc(1, sizeof(PlotFilter));
+    FilterHeader *h = &filter->header;
+    int rc = -1;
+    if (read_full_at(fd, h, sizeof(FilterHeader), 0) == (ssize_t)sizeof(FilterHeader) && h->magic == FILTER_MAGIC && h->version == FILTER_VERSION)
     {
-        perror("Error reading file");
+        if (h->checksum != filter_header_checksum(h) || h->plot_id != plot->id || h->num_blocks == 0)
+        {
+            fprintf(stderr, "Warning: filter %s does not belong to this plot, searching without it\n", path);
+        }
+        else
+        {
+            size_t bytes_blocks = h->num_blocks * FILTER_BLOCK_WORDS * sizeof(uint64_t);
+            filter->blocks = (uint64_t *)malloc(bytes_blocks);
+            if (filter->blocks != NULL && read_full_at(fd, filter->blocks, bytes_blocks, FILTER_HEADER_SIZE) == (ssize_t)bytes_blocks)
+                rc = 0;
+            else
+                fprintf(stderr, "Warning: unable to load filter %s, searching without it\n", path);
+        }
+    }
+    else
+    {
+        fprintf(stderr, "Warning: %s is not a filter, searching without it\n", path);
     }
+    close(fd);
+    free(path);
 
-    // Clean up
-    fclose(file);
-    free(buffer);
+    if (rc != 0)
+    {
+        free(filter->blocks);
+        free(filter);
+        return -1;
+    }
+    plot->filter = filter;
+    return 0;
+}
 
-    // Print the total number of times the condition was met
-    printf("sorted=%zu not_sorted=%zu zero_nonces=%zu total_records=%zu full_buckets=%zu storage_efficiency=%.2f bucket_efficiency=%.2f\n",
-           count_condition_met, count_condition_not_met, zero_nonce_count, total_records, full_buckets, count_condition_met * 100.0 / total_records, full_buckets * 100.0 / (num_buckets));
+// Function to ask the filter of a plot whether a key can be in it; false means it certainly is not.
+// Keys shorter than the filter's keys, and plots without a filter, always pass
+bool plot_may_contain(const PlotFile *plot, const uint8_t *key, size_t key_length)
+{
+    PlotFilter *filter = plot->filter;
+    if (filter == NULL || key_length < filter->header.key_size)
+        return true;
 
-    return count_condition_met;
+    bool pass = filter_bits(filter->blocks, filter->header.num_blocks, filter_key_hash(key, filter->header.key_size), false);
+#pragma omp atomic
+    filter->checked++;
+    if (!pass)
+    {
+#pragma omp atomic
+        filter->rejected++;
+    }
+    return pass;
 }
 
-size_t process_memo_records_table2(
-    const char *filename,
-    const size_t BATCH_SIZE)
+// Function to count a key that passed the filter but is not in the plot
+void plot_filter_miss(const PlotFile *plot, size_t key_length)
 {
-    // --- open file & figure out how many records are in it ---
-    FILE *file = fopen(filename, "rb");
-    if (!file)
+    if (plot->filter != NULL && key_length >= plot->filter->header.key_size)
     {
-        perror("Error opening file");
-        return 0;
+#pragma omp atomic
+        plot->filter->false_positives++;
     }
-    fseek(file, 0, SEEK_END);
-    long filesize = ftell(file);
-    if (filesize < 0)
+}
+
+// Function to print the memory a plot's filter takes, and how it did on the lookups so far
+void plot_report_filter(const PlotFile *plot, FILE *out)
+{
+    const PlotFilter *filter = plot->filter;
+    if (filter == NULL)
+        return;
+    const FilterHeader *h = &filter->header;
+    fprintf(out, "FILTER: %.2f MB in memory for %llu records (%.2f bits each), %u key bytes, expected false positive rate %.4f%%\n",
+            h->num_blocks * FILTER_BLOCK_WORDS * 8 / (1024.0 * 1024.0), (unsigned long long)h->num_keys,
+            h->num_keys > 0 ? h->num_blocks * FILTER_BLOCK_WORDS * 64.0 / h->num_keys : 0.0, h->key_size, filter_expected_fpr(h) * 100.0);
+    if (filter->checked > 0)
     {
-        perror("ftell failed");
-        fclose(file);
-        return 0;
+        unsigned long long negatives = filter->rejected + filter->false_positives;
+        fprintf(out, "FILTER: %llu lookups checked, %llu rejected without I/O, observed false positive rate %.4f%%\n",
+                filter->checked, filter->rejected, negatives > 0 ? filter->false_positives * 100.0 / negatives : 0.0);
     }
-    size_t total_recs_in_file = filesize / sizeof(MemoRecord2);
-    size_t num_buckets = (total_recs_in_file + BATCH_SIZE - 1) / BATCH_SIZE;
-    rewind(file);
+}
 
-    // --- allocate one batch buffer ---
-    MemoRecord2 *buffer = malloc(BATCH_SIZE * sizeof(MemoRecord2));
-    if (!buffer)
+uint64_t compute_hash_hamming_distance(const uint8_t *hash_output,
+                                       const uint8_t *prev_hash,
+                                       size_t hash_size)
+{
+    uint64_t distance = 0;
+    for (size_t i = 0; i < hash_size; i++)
     {
-        fprintf(stderr, "Error: Unable to allocate buffer for %zu records\n", BATCH_SIZE);
-        fclose(file);
-        return 0;
+        uint8_t diff = hash_output[i] ^ prev_hash[i];
+        // Count bits set in diff (Brian Kernighan's algorithm)
+        while (diff)
+        {
+            distance++;
+            diff &= (diff - 1);
+        }
     }
+    return distance;
+}
 
-    // --- state & counters ---
-    size_t total_records = 0;
-    size_t zero_nonce_count = 0;
-    size_t full_buckets = 0;
-    size_t count_condition_met = 0;
-    size_t count_condition_not_met = 0;
-
-    uint8_t prev_hash[HASH_SIZE] = {0};
-    uint8_t prev_nonce1[NONCE_SIZE] = {0};
-    uint8_t prev_nonce2[NONCE_SIZE] = {0};
-
-    // --- timing for progress updates ---
-    double start_time = omp_get_wtime();
-    double last_print_time = start_time;
-
-    // --- read & process in one pass, printing progress every second ---
-    for (size_t bucket = 0; bucket < num_buckets; bucket++)
+uint64_t compute_hash_match(const uint8_t *hash1, const uint8_t *hash2, size_t hash_size)
+{
+    uint64_t match = 0;
+    for (size_t i = 0; i < hash_size; i++)
     {
-        bool bucket_not_full = false;
-        size_t records_read = fread(buffer, sizeof(MemoRecord2), BATCH_SIZE, file);
-        if (records_read == 0)
-            break;
-
-        for (size_t i = 0; i < records_read; i++)
+        // XOR gives 0 where bits are the same, so invert to mark matching bits as 1.
+        uint8_t equal = ~(hash1[i] ^ hash2[i]);
+        // Count the bits that are 1 (i.e. bits that match) using Brian Kernighan's algorithm.
+        while (equal)
         {
-            ++total_records;
-
-            if (is_nonce_nonzero(buffer[i].nonce1, NONCE_SIZE) &&
-                is_nonce_nonzero(buffer[i].nonce2, NONCE_SIZE))
-            {
-
-                // compute the hash
-                uint8_t hash_output[HASH_SIZE];
-                blake3_hasher hasher;
-                blake3_hasher_init(&hasher);
-                blake3_hasher_update(&hasher, buffer[i].nonce1, NONCE_SIZE);
-                blake3_hasher_update(&hasher, buffer[i].nonce2, NONCE_SIZE);
-                blake3_hasher_finalize(&hasher, hash_output, HASH_SIZE);
-
-                // compare prefix to previous
-                if (memcmp(hash_output, prev_hash, PREFIX_SIZE) >= 0)
-                {
-                    ++count_condition_met;
-                }
-                else
-                {
-                    ++count_condition_not_met;
-                    if (DEBUG)
-                    {
-                        // your debug prints...
-                    }
-                }
-
-                // update previous
-                memcpy(prev_hash, hash_output, HASH_SIZE);
-                memcpy(prev_nonce1, buffer[i].nonce1, NONCE_SIZE);
-                memcpy(prev_nonce2, buffer[i].nonce2, NONCE_SIZE);
-            }
-            else
-            {
-                ++zero_nonce_count;
-                bucket_not_full = true;
-            }
-
-            // --- progress update every second ---
-            double now = omp_get_wtime();
-            if (now - last_print_time >= 1.0)
-            {
-                last_print_time = now;
-                double elapsed = now - start_time;
-                double pct = (double)total_records * 100.0 / (double)total_recs_in_file;
-                double pct_met = (double)count_condition_met * 100.0 /
-                                 (double)(count_condition_met + count_condition_not_met + zero_nonce_count);
-                double pct_sorted = (double)count_condition_met * 100.0 /
-                                    (double)(count_condition_met + count_condition_not_met);
-                printf("[%.2f] Verify %.2f%%: Sorted %.2f%% : Storage Efficiency %.2f%%\n",
-                       elapsed, pct, pct_sorted, pct_met);
-            }
+            match++;
+            equal &= (equal - 1);
         }
+    }
+    return match;
+}
 
-        if (!bucket_not_full)
+uint64_t compute_hash_match_leading(const uint8_t *hash1, const uint8_t *hash2, size_t hash_size)
+{
+    uint64_t match = 0;
+
+    // Iterate over each byte in the hash
+    for (size_t i = 0; i < hash_size; i++)
+    {
+        // Check each bit starting with the most significant bit
+        for (int bit = 7; bit >= 0; bit--)
         {
-            ++full_buckets;
+            uint8_t mask = 1 << bit;
+            // If the bits match, increase the counter; if not, return immediately.
+            if ((hash1[i] & mask) == (hash2[i] & mask))
+                match++;
+            else
+                return match;
         }
     }
+    return match;
+}
 
-    // ensure final 100% progress line
-    double now = omp_get_wtime();
-    double elapsed = now - start_time;
-    double pct = (double)total_records * 100.0 / (double)total_recs_in_file;
-    double pct_met = (double)count_condition_met * 100.0 /
-                     (double)(count_condition_met + count_condition_not_met + zero_nonce_count);
-    double pct_sorted = (double)count_condition_met * 100.0 /
-                        (double)(count_condition_met + count_condition_not_met);
-
-    // printf("Progress: 100.00%% (%zu/%zu)\n", total_records, total_recs_in_file);
-    printf("[%.2f] Verify %.2f%%: Sorted %.2f%% : Storage Efficiency %.2f%%\n",
-           elapsed, pct, pct_sorted, pct_met);
+uint64_t compute_hash_distance(const uint8_t *hash_output, const uint8_t *prev_hash, size_t hash_size)
+{
+    // Ensure there are at least 8 bytes in the hash
+    if (hash_size < 8)
+    {
+        fprintf(stderr, "Error: hash_size must be at least 8 bytes.\n");
+        return 0;
+    }
 
-    // --- cleanup ---
-    free(buffer);
-    fclose(file);
+    // Convert the first 8 bytes of each hash to a uint64_t
+    uint64_t current = byteArrayToLongLong(hash_output, 8);
+    uint64_t previous = byteArrayToLongLong(prev_hash, 8);
 
-    // --- final summary ---
-    /*
-    double storage_eff  = 100.0 * count_condition_met     / (double)total_records;
-    double bucket_eff   = 100.0 * full_buckets            / (double)num_buckets;
-    printf(
-      "sorted=%zu not_sorted=%zu zero_nonces=%zu total_records=%zu full_buckets=%zu "
-      "storage_efficiency=%.2f bucket_efficiency=%.2f\n",
-      count_condition_met,
-      count_condition_not_met,
-      zero_nonce_count,
-      total_records,
-      full_buckets,
-      storage_eff,
-      bucket_eff
-    );
-    */
+    // Subtract the previous hash value from the current one and return the result
+    return previous - current;
+}
 
-    return count_condition_met;
+// Function to test the table2 pairing predicate on two table1 hashes of HASH_SIZE bytes: they share the
+// bucket prefix and, when there are the 8 bytes compute_hash_distance() needs, the second is at most
+// pairing_distance past the first
+bool hashes_pair(const uint8_t *hash1, const uint8_t *hash2, uint64_t pairing_distance)
+{
+    if (memcmp(hash1, hash2, PREFIX_SIZE) != 0)
+        return false;
+#if HASH_SIZE >= 8
+    return compute_hash_distance(hash1, hash2, HASH_SIZE) <= pairing_distance;
+#else
+    (void)pairing_distance;
+    return true;
+#endif
 }
 
-size_t process_memo_records_debug(const char *filename, const size_t BATCH_SIZE)
+int print_table2_entry(const uint8_t *nonce_output, const uint8_t *prev_nonce, const uint8_t *hash_output, const uint8_t *prev_hash, size_t hash_size)
 {
-    MemoRecord *buffer = NULL;
-    size_t total_records = 0;
-    size_t zero_nonce_count = 0;
-    size_t full_buckets = 0;
-    bool bucket_not_full = false;
-    size_t records_read;
-    FILE *file = NULL;
+    // Ensure there are at least 8 bytes in the hash
+    if (hash_size < 8)
+    {
+        fprintf(stderr, "Error: hash_size must be at least 8 bytes.\n");
+        return -1;
+    }
 
-    // Now maintain two previous hashes and nonces.
-    uint8_t prev_hash[HASH_SIZE] = {0};        // immediate previous hash
-    uint8_t prev_prev_hash[HASH_SIZE] = {0};   // hash from two records back
-    uint8_t prev_nonce[NONCE_SIZE] = {0};      // immediate previous nonce
-    uint8_t prev_prev_nonce[NONCE_SIZE] = {0}; // nonce corresponding to prev_prev_hash
+    // Convert the first 8 bytes of each hash to a uint64_t
+    // uint64_t current = byteArrayToLongLong(hash_output, 8);
+    // uint64_t previous = byteArrayToLongLong(prev_hash, 8);
+    // uint64_t distance = previous - current;
 
-    size_t count_condition_met = 0; // Counter for records meeting the condition
-    size_t count_condition_not_met = 0;
+    // Print debugging information
+    fprintf(stderr, "Debug Info:\n");
 
-    long filesize = get_file_size(filename);
-    if (filesize != -1)
+    // Print the first 8 bytes of hash_output
+    fprintf(stderr, "hash_output (first 8 bytes): ");
+    for (size_t i = 0; i < 8; i++)
     {
-        if (!BENCHMARK)
-            printf("Size of '%s' is %ld bytes.\n", filename, filesize);
+        fprintf(stderr, "%02X ", hash_output[i]);
     }
+    fprintf(stderr, "\n");
 
-    printf("num_records_in_bucket=%llu\n", num_records_in_bucket);
-    printf("BATCH_SIZE=%lu\n", BATCH_SIZE);
-    printf("filesize=%ld\n", filesize);
-
-    file = fopen(filename, "rb");
+    // Print the first 8 bytes of prev_hash
+    fprintf(stderr, "prev_hash (first 8 bytes): ");
+    for (size_t i = 0; i < 8; i++)
+    {
+        fprintf(stderr, "%02X ", prev_hash[i]);
+    }
+    fprintf(stderr, "\n");
+
+    // Print the computed 64-bit values and the difference
+    // fprintf(stderr, "current: %" PRIu64 "\n", current);
+    // fprintf(stderr, "previous: %" PRIu64 "\n", previous);
+    // fprintf(stderr, "current - previous: %" PRIu64 "\n", distance);
+
+    uint8_t hash_table2[hash_size];
+    blake3_hasher hasher;
+    blake3_hasher_init(&hasher);
+    blake3_hasher_update(&hasher, prev_nonce, NONCE_SIZE);
+    blake3_hasher_update(&hasher, nonce_output, NONCE_SIZE);
+
+    blake3_hasher_finalize(&hasher, hash_table2, HASH_SIZE);
+
+    // Print the first 8 bytes of hash_table2
+    fprintf(stderr, "hash_table2 (first 8 bytes): ");
+    for (size_t i = 0; i < 8; i++)
+    {
+        fprintf(stderr, "%02X ", hash_table2[i]);
+    }
+    fprintf(stderr, "\n");
+
+    return 0;
+}
+
+uint64_t compute_hash_distance_debug(const uint8_t *hash_output, const uint8_t *prev_hash, size_t hash_size)
+{
+    // Ensure there are at least 8 bytes in the hash
+    if (hash_size < 8)
+    {
+        fprintf(stderr, "Error: hash_size must be at least 8 bytes.\n");
+        return 0;
+    }
+
+    // Convert the first 8 bytes of each hash to a uint64_t
+    uint64_t current = byteArrayToLongLong(hash_output, 8);
+    uint64_t previous = byteArrayToLongLong(prev_hash, 8);
+    uint64_t distance = previous - current;
+
+    // Print debugging information
+    fprintf(stderr, "Debug Info:\n");
+
+    // Print the first 8 bytes of hash_output
+    fprintf(stderr, "hash_output (first 8 bytes): ");
+    for (size_t i = 0; i < 8; i++)
+    {
+        fprintf(stderr, "%02X ", hash_output[i]);
+    }
+    fprintf(stderr, "\n");
+
+    // Print the first 8 bytes of prev_hash
+    fprintf(stderr, "prev_hash (first 8 bytes): ");
+    for (size_t i = 0; i < 8; i++)
+    {
+        fprintf(stderr, "%02X ", prev_hash[i]);
+    }
+    fprintf(stderr, "\n");
+
+    // Print the computed 64-bit values and the difference
+    fprintf(stderr, "current: %" PRIu64 "\n", current);
+    fprintf(stderr, "previous: %" PRIu64 "\n", previous);
+    fprintf(stderr, "current - previous: %" PRIu64 "\n", distance);
+
+    return distance;
+}
+
+// Returns true if the first 'prefix_bits' of hash1 and hash2 are identical.
+bool compute_hash_similarity(const uint8_t *hash1, const uint8_t *hash2, size_t hash_size, int prefix_bits)
+{
+    // Determine how many full bytes are covered by prefix_bits.
+    int full_bytes = prefix_bits / 8;
+    // And how many extra bits remain.
+    int extra_bits = prefix_bits % 8;
+
+    // Compare all the full bytes.
+    for (size_t i = 0; i < (size_t)full_bytes; i++)
+    {
+        if (hash1[i] != hash2[i])
+            return false;
+    }
+
+    // If there are extra bits, compare only the high bits of the next byte.
+    if (extra_bits > 0 && full_bytes < (int)hash_size)
+    {
+        // Create a mask to extract the top 'extra_bits' bits.
+        uint8_t mask = 0xFF << (8 - extra_bits);
+        if ((hash1[full_bytes] & mask) != (hash2[full_bytes] & mask))
+            return false;
+    }
+
+    return true;
+}
+
+uint64_t hash_pass_count_global = 0;
+
+size_t process_memo_records(const char *filename, const size_t BATCH_SIZE)
+{
+    // const size_t BATCH_SIZE = 1000000; // 1 million MemoRecords per batch
+    MemoRecord *buffer = NULL;
+    size_t total_records = 0;
+    size_t zero_nonce_count = 0;
+    size_t full_buckets = 0;
+    bool bucket_not_full = false;
+    size_t records_read;
+    FILE *file = NULL;
+    uint8_t prev_hash[HASH_SIZE] = {0};   // Initialize previous hash prefix to zero
+    uint8_t prev_nonce[NONCE_SIZE] = {0}; // Initialize previous nonce to zero
+    size_t count_condition_met = 0;       // Counter for records meeting the condition
+    size_t count_condition_not_met = 0;
+
+    long filesize = get_file_size(filename);
+
+    if (filesize != -1)
+    {
+        if (!BENCHMARK)
+            printf("Size of '%s' is %ld bytes.\n", filename, filesize);
+    }
+
+    printf("num_records_in_bucket=%llu\n", num_records_in_bucket);
+    printf("BATCH_SIZE=%lu\n", BATCH_SIZE);
+    printf("filesize=%ld\n", filesize);
+
+    // Open the file for reading in binary mode
+    file = fopen(filename, "rb");
     if (file == NULL)
     {
         printf("Error opening file %s (#3)\n", filename);
+
         perror("Error opening file");
         return 0;
     }
 
+    // Allocate memory for the batch of MemoRecords
     buffer = (MemoRecord *)malloc(BATCH_SIZE * sizeof(MemoRecord));
     if (buffer == NULL)
     {
@@ -1319,29 +2389,35 @@ size_t process_memo_records_debug(const char *filename, const size_t BATCH_SIZE)
         return 0;
     }
 
+    // Start walltime measurement
     double start_time = omp_get_wtime();
     // double end_time = omp_get_wtime();
 
+    // Read the file in batches
     while ((records_read = fread(buffer, sizeof(MemoRecord), BATCH_SIZE, file)) > 0)
     {
         double start_time_verify = omp_get_wtime();
         double end_time_verify = omp_get_wtime();
         bucket_not_full = false;
-        uint64_t distance = 0;
-        uint64_t leading_match = 0;
-        // uint64_t HASH_SPACE = 1 << (K+1);
+        // uint64_t distance = 0;
+        // uint64_t HASH_SPACE = 1 << K;
+        // uint64_t M = 1 << 64;
         // uint64_t M = UINT64_MAX;
-        // uint64_t expected_distance = M / (HASH_SPACE + 1);
-        uint64_t expected_distance = 1ULL << (64 - K);
+        // uint64_t expected_distance = M/(HASH_SPACE+1);
+        // uint64_t expected_distance = 1 << (64 - K + 1);
+        // printf("expected_distance=%llu\n",expected_distance);
         // uint64_t min_distance = UINT64_MAX;
         // uint64_t max_distance = 0;
         // uint64_t total_distance = 0;
         uint64_t count = 0;
-        uint64_t hash_pass_count = 0;
-
+        // bool hash_pass = false;
+        // uint64_t hash_pass_count = 0;
+        // printf("records_read=%ld\n",records_read);
+        //  Process each MemoRecord in the batch
         for (size_t i = 0; i < records_read; ++i)
         {
             ++total_records;
+
             if (is_nonce_nonzero(buffer[i].nonce, NONCE_SIZE))
             {
                 uint8_t hash_output[HASH_SIZE];
@@ -1352,588 +2428,3795 @@ size_t process_memo_records_debug(const char *filename, const size_t BATCH_SIZE)
                 blake3_hasher_update(&hasher, buffer[i].nonce, NONCE_SIZE);
                 blake3_hasher_finalize(&hasher, hash_output, HASH_SIZE);
 
-                if (i >= 1)
+                // Compare the first PREFIX_SIZE bytes of the current hash to the previous hash prefix
+                if (memcmp(hash_output, prev_hash, PREFIX_SIZE) >= 0)
                 {
-                    // Compare the first PREFIX_SIZE bytes of the current hash to the hash from two records back
-                    if (memcmp(hash_output, prev_hash, HASH_SIZE) >= 0)
-                    {
-                        ++count_condition_met;
-                    }
-                    else
-                    {
-                        ++count_condition_not_met;
-                        if (DEBUG)
-                        {
-                            printf("Condition not met at record %zu:\n", total_records);
-                            printf("Previous nonce: ");
-                            for (size_t n = 0; n < NONCE_SIZE; ++n)
-                                printf("%02X", prev_hash[n]);
-                            printf("\n");
-                            printf("Previous hash prefix: ");
-                            for (size_t n = 0; n < HASH_SIZE; ++n)
-                                printf("%02X", prev_hash[n]);
-                            printf("\n");
-                            printf("Current nonce: ");
-                            for (size_t n = 0; n < NONCE_SIZE; ++n)
-                                printf("%02X", buffer[i].nonce[n]);
-                            printf("\n");
-                            printf("Current hash prefix: ");
-                            for (size_t n = 0; n < HASH_SIZE; ++n)
-                                printf("%02X", hash_output[n]);
-                            printf("\n");
-                        }
-                    }
+                    // Current hash's first PREFIX_SIZE bytes are equal to or greater than previous
+                    ++count_condition_met;
                 }
-
-                if (i >= 2)
+                else
                 {
-                    // Compute distance against the two-back hash
-                    distance = compute_hash_distance(prev_prev_hash, hash_output, HASH_SIZE);
-                    // distance = compute_hash_distance(prev_hash, hash_output, HASH_SIZE);
-                    leading_match = compute_hash_match_leading(prev_prev_hash, hash_output, HASH_SIZE);
-                    // leading_match = compute_hash_match_leading(prev_hash, hash_output, HASH_SIZE);
-                    if (total_records % (1024 * 1024) == 0)
+                    ++count_condition_not_met;
+
+                    if (DEBUG)
                     {
-                        // distance = compute_hash_distance_debug(prev_prev_hash, hash_output, HASH_SIZE);
+                        // Print previous hash and nonce, and current hash and nonce
+                        printf("Condition not met at record %zu:\n", total_records);
+                        printf("Previous nonce: ");
+                        for (size_t n = 0; n < NONCE_SIZE; ++n)
+                            printf("%02X", prev_nonce[n]);
+                        printf("\n");
+                        printf("Previous hash prefix: ");
+                        for (size_t n = 0; n < PREFIX_SIZE; ++n)
+                            printf("%02X", prev_hash[n]);
+                        printf("\n");
 
-                        // distance = compute_hash_distance_debug(prev_hash, hash_output, HASH_SIZE);
-                        printf("compute_hash_distance()): distance=%lu expected_distance=%lu match=%s leading_match=%lu\n",
-                               distance, expected_distance, (distance <= expected_distance) ? "true" : "false", leading_match);
+                        printf("Current nonce: ");
+                        for (size_t n = 0; n < NONCE_SIZE; ++n)
+                            printf("%02X", buffer[i].nonce[n]);
+                        printf("\n");
+                        printf("Current hash prefix: ");
+                        for (size_t n = 0; n < PREFIX_SIZE; ++n)
+                            printf("%02X", hash_output[n]);
+                        printf("\n");
                     }
+                }
 
-                    // if (distance <= expected_distance && leading_match >= K) {
-                    if (distance <= expected_distance)
-                    {
-                        hash_pass_count++;
+                /*            // Call the function and capture the Hamming distance.
+                            distance = compute_hash_hamming_distance(hash_output, prev_hash, HASH_SIZE);
+
+                                    // Update min and max values.
+                    if (distance < min_distance) {
+                        min_distance = distance;
                     }
-                    count++;
-                }
-                // Shift previous hashes: the immediate previous becomes two-back,
-                // then update immediate previous with current values.
-                if (i >= 1)
+                    if (distance > max_distance) {
+                        max_distance = distance;
+                    }*/
+
+                // hash_pass = compute_hash_similarity(prev_hash, hash_output, HASH_SIZE, 25);
+                /*distance = compute_hash_distance(prev_hash, hash_output, HASH_SIZE);
+                if (distance <= expected_distance)
                 {
-                    memcpy(prev_prev_hash, prev_hash, HASH_SIZE);
-                    memcpy(prev_prev_nonce, prev_nonce, NONCE_SIZE);
-                }
+                    hash_pass_count++;
+                    }*/
 
-                memcpy(prev_hash, hash_output, HASH_SIZE);
-                memcpy(prev_nonce, buffer[i].nonce, NONCE_SIZE);
-            }
-            else
-            {
-                ++zero_nonce_count;
-                bucket_not_full = true;
+                /*
+                             printf("Record %zu:\n", total_records);
+                             printf("Previous nonce: ");
+                             for (size_t n = 0; n < NONCE_SIZE; ++n)
+                                 printf("%02X", prev_nonce[n]);
+                             printf("\n");
+                             printf("Previous hash prefix: ");
+                             for (size_t n = 0; n < HASH_SIZE; ++n)
+                                 printf("%02X", prev_hash[n]);
+                             printf("\n");
+
+                             printf("Current nonce: ");
+                             for (size_t n = 0; n < NONCE_SIZE; ++n)
+                                 printf("%02X", buffer[i].nonce[n]);
+                             printf("\n");
+                             printf("Current hash prefix: ");
+                             for (size_t n = 0; n < HASH_SIZE; ++n)
+                                 printf("%02X", hash_output[n]);
+                             printf("\n");
+                             */
+
+                // Update running total and count.
+                // total_distance += distance;
+                count++;
+
+                //	printf("count=%llu distance=%llu min_distance=%llu max_distance=%llu total_distance=%llu hash_pass_count=%llu\n",count, distance, min_distance, max_distance, total_distance,hash_pass_count);
+                // printf("count=%llu hash_pass_count=%llu\n",count,hash_pass_count);
+                //  Update the previous hash prefix and nonce
+                memcpy(prev_hash, hash_output, HASH_SIZE);
+                memcpy(prev_nonce, buffer[i].nonce, NONCE_SIZE);
+            }
+            else
+            {
+                ++zero_nonce_count;
+                bucket_not_full = true;
+                // Optionally, handle zero nonces here
             }
         }
         if (bucket_not_full == false)
             full_buckets++;
         end_time_verify = omp_get_wtime();
 
-        hash_pass_count_global += hash_pass_count;
-        if (total_records % (1024 * 1024) == 0)
+        // Calculate average distance.
+        // double average_distance = (count > 0) ? (double)total_distance / count : 0.0;
+
+        // Print summary of metrics.
+        // printf("Min distance: %llu\n", min_distance);
+        // printf("Max distance: %llu\n", max_distance);
+        // printf("Average distance: %.2f\n", average_distance);
+        /*hash_pass_count_global += hash_pass_count;
+        if (total_records%(1024*1024) == 0)
         {
-            printf("Hashed passed: %lu out of %lu (%.2f%%)\n",
-                   hash_pass_count_global, total_records, hash_pass_count_global * 100.0 / total_records);
-        }
+            printf("Hashed passed: %llu %llu %.2f\n", hash_pass_count_global,total_records,hash_pass_count_global*100.0/total_records);
+            }*/
+
         double elapsed_time_verify = end_time_verify - start_time_verify;
         double elapsed_time = omp_get_wtime() - start_time;
+
+        // Calculate throughput (hashes per second)
         double throughput = (BATCH_SIZE * sizeof(MemoRecord) / elapsed_time_verify) / (1024 * 1024);
         if (total_records % (1024 * 1024) == 0)
-            printf("[%.2f] Verify %.2f%%: %.2f MB/s\n", elapsed_time,
-                   total_records * sizeof(MemoRecord) * 100.0 / filesize, throughput);
+            printf("[%.2f] Verify %.2f%%: %.2f MB/s\n", elapsed_time, total_records * sizeof(MemoRecord) * 100.0 / filesize, throughput);
     }
 
+    // Check for reading errors
     if (ferror(file))
     {
         perror("Error reading file");
     }
+
+    // Clean up
     fclose(file);
     free(buffer);
 
+    // Print the total number of times the condition was met
     printf("sorted=%zu not_sorted=%zu zero_nonces=%zu total_records=%zu full_buckets=%zu storage_efficiency=%.2f bucket_efficiency=%.2f\n",
-           count_condition_met, count_condition_not_met, zero_nonce_count, total_records, full_buckets,
-           count_condition_met * 100.0 / total_records, full_buckets * 100.0 / (num_buckets));
+           count_condition_met, count_condition_not_met, zero_nonce_count, total_records, full_buckets, count_condition_met * 100.0 / total_records, full_buckets * 100.0 / (num_buckets));
 
     return count_condition_met;
 }
 
-#define min(a, b) ((a) < (b) ? (a) : (b))
-#define max(a, b) ((a) > (b) ? (a) : (b))
-
-void generate_table2(MemoRecord *sorted_nonces, size_t num_records_in_bucket)
+size_t process_memo_records_table2_old(const char *filename, const size_t BATCH_SIZE)
 {
-    // bucket_not_full = false;
-    // uint64_t distance = 0;
-    // uint64_t leading_match = 0;
-    uint64_t expected_distance = 1ULL << (64 - K);
-    // uint64_t min_distance = UINT64_MAX;
-    // uint64_t max_distance = 0;
-    // uint64_t total_distance = 0;
-    // uint64_t count = 0;
-    uint64_t hash_pass_count = 0;
+    // const size_t BATCH_SIZE = 1000000; // 1 million MemoRecords per batch
+    MemoRecord2 *buffer = NULL;
+    size_t total_records = 0;
+    size_t zero_nonce_count = 0;
+    size_t full_buckets = 0;
+    bool bucket_not_full = false;
+    size_t records_read;
+    FILE *file = NULL;
+    uint8_t prev_hash[HASH_SIZE] = {0};    // Initialize previous hash prefix to zero
+    uint8_t prev_nonce1[NONCE_SIZE] = {0}; // Initialize previous nonce to zero
+    uint8_t prev_nonce2[NONCE_SIZE] = {0}; // Initialize previous nonce to zero
+    size_t count_condition_met = 0;        // Counter for records meeting the condition
+    size_t count_condition_not_met = 0;
 
-    for (size_t i = 0; i < num_records_in_bucket; ++i)
+    long filesize = get_file_size(filename);
+
+    if (filesize != -1)
     {
-        if (is_nonce_nonzero(sorted_nonces[i].nonce, NONCE_SIZE))
+        if (!BENCHMARK)
+            printf("Size of '%s' is %ld bytes.\n", filename, filesize);
+    }
+
+    printf("num_records_in_bucket=%llu\n", num_records_in_bucket);
+    printf("BATCH_SIZE=%lu\n", BATCH_SIZE);
+    printf("filesize=%ld\n", filesize);
+
+    // Open the file for reading in binary mode
+    file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        printf("Error opening file %s (#3)\n", filename);
+
+        perror("Error opening file");
+        return 0;
+    }
+
+    // Allocate memory for the batch of MemoRecords
+    buffer = (MemoRecord2 *)malloc(BATCH_SIZE * sizeof(MemoRecord2));
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        fclose(file);
+        return 0;
+    }
+
+    // Start walltime measurement
+    double start_time = omp_get_wtime();
+    // double end_time = omp_get_wtime();
+
+    // Read the file in batches
+    while ((records_read = fread(buffer, sizeof(MemoRecord2), BATCH_SIZE, file)) > 0)
+    {
+        double start_time_verify = omp_get_wtime();
+        double end_time_verify = omp_get_wtime();
+        bucket_not_full = false;
+        // uint64_t distance = 0;
+        // uint64_t expected_distance = 1 << (64 - K + 1);
+        // uint64_t min_distance = UINT64_MAX;
+        // uint64_t max_distance = 0;
+        // uint64_t total_distance = 0;
+        uint64_t count = 0;
+        // bool hash_pass = false;
+        // uint64_t hash_pass_count = 0;
+
+        // Process each MemoRecord in the batch
+        for (size_t i = 0; i < records_read; ++i)
         {
-            // Compute Blake3 hash for record i
-            uint8_t hash_i[HASH_SIZE];
-            blake3_hasher hasher;
-            blake3_hasher_init(&hasher);
-            blake3_hasher_update(&hasher, sorted_nonces[i].nonce, NONCE_SIZE);
-            blake3_hasher_finalize(&hasher, hash_i, HASH_SIZE);
+            ++total_records;
 
-            // Compare hash_i with all subsequent non-zero nonce records
-            // could change the upper bound here to be b+2 to span multiple buckets
-            for (size_t j = i + 1; j < num_records_in_bucket; ++j)
+            if (is_nonce_nonzero(buffer[i].nonce1, NONCE_SIZE) && is_nonce_nonzero(buffer[i].nonce2, NONCE_SIZE))
             {
-                // Skip records with zero nonce
-                if (!is_nonce_nonzero(sorted_nonces[j].nonce, NONCE_SIZE))
-                {
-                    continue;
-                }
+                uint8_t hash_output[HASH_SIZE];
 
-                // Compute Blake3 hash for record j
-                uint8_t hash_j[HASH_SIZE];
-                // blake3_hasher hasher_j;
+                // Compute Blake3 hash of the nonce
+                blake3_hasher hasher;
                 blake3_hasher_init(&hasher);
-                blake3_hasher_update(&hasher, sorted_nonces[j].nonce, NONCE_SIZE);
-                blake3_hasher_finalize(&hasher, hash_j, HASH_SIZE);
-
-                // Compute the distance between hash_i and hash_j
-                uint64_t distance = compute_hash_distance(hash_i, hash_j, HASH_SIZE);
+                blake3_hasher_update(&hasher, buffer[i].nonce1, NONCE_SIZE);
+                blake3_hasher_update(&hasher, buffer[i].nonce2, NONCE_SIZE);
+                blake3_hasher_finalize(&hasher, hash_output, HASH_SIZE);
 
-                // Because data is sorted, break out of the inner loop once the distance exceeds expected_distance
-                if (distance > expected_distance)
+                // Compare the first PREFIX_SIZE bytes of the current hash to the previous hash prefix
+                if (memcmp(hash_output, prev_hash, PREFIX_SIZE) >= 0)
                 {
-                    break;
+                    // Current hash's first PREFIX_SIZE bytes are equal to or greater than previous
+                    ++count_condition_met;
                 }
+                else
+                {
+                    ++count_condition_not_met;
 
-                // The distance is within the expected threshold; count it.
-                hash_pass_count++;
-
-                MemoRecord2 record;
-                uint8_t hash_table2[HASH_SIZE];
-                generate2Blake3(hash_table2, &record, (unsigned long long)sorted_nonces[i].nonce, (unsigned long long)sorted_nonces[j].nonce);
-
-                // uint8_t hash_table2[HASH_SIZE];
-                // blake3_hasher hasher_j;
-                // blake3_hasher_init(&hasher);
-                // blake3_hasher_update(&hasher, sorted_nonces[i].nonce, NONCE_SIZE);
-                // blake3_hasher_update(&hasher, sorted_nonces[j].nonce, NONCE_SIZE);
-                // lake3_hasher_finalize(&hasher, hash_table2, HASH_SIZE);
+                    if (DEBUG)
+                    {
+                        // Print previous hash and nonce, and current hash and nonce
+                        printf("Condition not met at record %zu:\n", total_records);
+                        printf("Previous nonce: ");
+                        for (size_t n = 0; n < NONCE_SIZE; ++n)
+                            printf("%02X", prev_nonce1[n]);
+                        printf("\n");
+                        for (size_t n = 0; n < NONCE_SIZE; ++n)
+                            printf("%02X", prev_nonce2[n]);
+                        printf("\n");
+                        printf("Previous hash prefix: ");
+                        for (size_t n = 0; n < PREFIX_SIZE; ++n)
+                            printf("%02X", prev_hash[n]);
+                        printf("\n");
 
-                if (MEMORY_WRITE)
-                {
-                    off_t bucketIndex = getBucketIndex(hash_table2, PREFIX_SIZE);
-                    insert_record2(buckets2, &record, bucketIndex);
+                        printf("Current nonces: ");
+                        for (size_t n = 0; n < NONCE_SIZE; ++n)
+                            printf("%02X", buffer[i].nonce1[n]);
+                        printf("\n");
+                        for (size_t n = 0; n < NONCE_SIZE; ++n)
+                            printf("%02X", buffer[i].nonce2[n]);
+                        printf("\n");
+                        printf("Current hash prefix: ");
+                        for (size_t n = 0; n < PREFIX_SIZE; ++n)
+                            printf("%02X", hash_output[n]);
+                        printf("\n");
+                    }
                 }
-                // buckets2_count[bucketIndex]++;
-                // printf("bucketIndex=%ld\n",bucketIndex);
 
-                // print_table2_entry(sorted_nonces[i].nonce, sorted_nonces[j].nonce, hash_i, hash_j, HASH_SIZE);
+                count++;
 
-                // Optional: Print debug information every 1,048,576 records processed.
-                // if (total_records % (1024 * 1024) == 0)
-                //{
-                //	printf("compute_hash_distance(): distance=%llu, expected_distance=%llu, hash_pass_count=%llu\n",
-                //			distance, expected_distance,hash_pass_count);
-                //}
+                // Update the previous hash prefix and nonce
+                memcpy(prev_hash, hash_output, HASH_SIZE);
+                memcpy(prev_nonce1, buffer[i].nonce1, NONCE_SIZE);
+                memcpy(prev_nonce2, buffer[i].nonce2, NONCE_SIZE);
+            }
+            else
+            {
+                ++zero_nonce_count;
+                bucket_not_full = true;
+                // Optionally, handle zero nonces here
             }
-            // Count this nonzero nonce as processed.
-            //	count++;
         }
-        // else
-        //{
-        //	++zero_nonce_count;
-        //	bucket_not_full = true;
-        // }
-    }
-}
+        if (bucket_not_full == false)
+            full_buckets++;
+        end_time_verify = omp_get_wtime();
 
-/**
- * Converts a given string to an array of uint8_t.
+        double elapsed_time_verify = end_time_verify - start_time_verify;
+        double elapsed_time = omp_get_wtime() - start_time;
+
+        // Calculate throughput (hashes per second)
+        double throughput = (BATCH_SIZE * sizeof(MemoRecord2) / elapsed_time_verify) / (1024 * 1024);
+        if (total_records % (1024 * 1024) == 0)
+            printf("[%.2f] Verify %.2f%%: %.2f MB/s\n", elapsed_time, total_records * sizeof(MemoRecord2) * 100.0 / filesize, throughput);
+    }
+
+    // Check for reading errors
+    if (ferror(file))
+    {
+        perror("Error reading file");
+    }
+
+    // Clean up
+    fclose(file);
+    free(buffer);
+
+    // Print the total number of times the condition was met
+    printf("sorted=%zu not_sorted=%zu zero_nonces=%zu total_records=%zu full_buckets=%zu storage_efficiency=%.2f bucket_efficiency=%.2f\n",
+           count_condition_met, count_condition_not_met, zero_nonce_count, total_records, full_buckets, count_condition_met * 100.0 / total_records, full_buckets * 100.0 / (num_buckets));
+
+    return count_condition_met;
+}
+
+// Counters of one chunk of buckets checked by verify_chunk(); the first record of a chunk is not
+// compared with anything, process_memo_records_table2() stitches it to the chunk before.
+typedef struct
+{
+    size_t total_records;
+    size_t zero_nonce_count;
+    size_t full_buckets;
+    size_t sorted;
+    size_t not_sorted;
+    size_t fingerprint_mismatches;
+    bool has_records;
+    uint8_t first_hash[HASH_SIZE];
+    uint8_t last_hash[HASH_SIZE];
+} VerifyChunk;
+
+/**
+ * verify_chunk:
+ *   - Checks the sort order and fill of count buckets read by plot_read_buckets().
+ *   - All records of the chunk are hashed first, one compression each, then compared in a second pass.
+ *
+ * @param plot    Open plot the buckets were read from.
+ * @param records Records of the buckets, as read.
+ * @param counts  Records per bucket, as read.
+ * @param count   Number of buckets.
+ * @param hashes  Scratch space for PAIR_HASH_SIZE bytes per record read.
+ * @param bitmap  Scratch space for nonzero_bytes() over the records read.
+ * @param chunk   Receives the counters of the chunk.
+ */
+void verify_chunk(const PlotFile *plot, const MemoRecord2 *records, const uint32_t *counts, size_t count, uint8_t *hashes, uint64_t *bitmap, VerifyChunk *chunk)
+{
+    memset(chunk, 0, sizeof(*chunk));
+
+    size_t num_records = 0;
+    for (size_t b = 0; b < count; b++)
+        num_records += counts[b];
+    nonzero_bytes((const uint8_t *)records, num_records * sizeof(MemoRecord2), bitmap);
+
+    for (size_t i = 0; i < num_records; i++)
+    {
+        if (!record_occupied(bitmap, i, sizeof(MemoRecord2), NONCE1_MASK, NONCE2_MASK))
+            continue;
+        uint8_t pair[2 * NONCE_SIZE];
+        memcpy(pair, records[i].nonce1, NONCE_SIZE);
+        memcpy(pair + NONCE_SIZE, records[i].nonce2, NONCE_SIZE);
+        blake3_single_block(pair, sizeof(pair), &hashes[i * PAIR_HASH_SIZE], PAIR_HASH_SIZE);
+    }
+
+    const uint8_t *prev_hash = NULL;
+    size_t index = 0;
+    for (size_t b = 0; b < count; b++)
+    {
+        bool bucket_not_full = false;
+
+        // the compact layout stores no empty slots; count them as the fixed layout would
+        if (plot->compact && counts[b] < plot->num_records_in_bucket)
+        {
+            chunk->total_records += plot->num_records_in_bucket - counts[b];
+            chunk->zero_nonce_count += plot->num_records_in_bucket - counts[b];
+            bucket_not_full = true;
+        }
+
+        for (size_t i = 0; i < counts[b]; i++, records++, hashes += PAIR_HASH_SIZE, index++)
+        {
+            ++chunk->total_records;
+            if (!record_occupied(bitmap, index, sizeof(MemoRecord2), NONCE1_MASK, NONCE2_MASK))
+            {
+                ++chunk->zero_nonce_count;
+                bucket_not_full = true;
+                continue;
+            }
+
+            // the stored fingerprint must be the hash bits it was taken from
+            if (!fingerprint_pass(records, fingerprint_filter(hashes, PAIR_HASH_SIZE)))
+                ++chunk->fingerprint_mismatches;
+
+            if (prev_hash == NULL)
+                memcpy(chunk->first_hash, hashes, HASH_SIZE);
+            else if (memcmp(hashes, prev_hash, PREFIX_SIZE) >= 0)
+                ++chunk->sorted;
+            else
+                ++chunk->not_sorted;
+            prev_hash = hashes;
+        }
+
+        if (!bucket_not_full)
+            ++chunk->full_buckets;
+    }
+
+    if (prev_hash != NULL)
+    {
+        chunk->has_records = true;
+        memcpy(chunk->last_hash, prev_hash, HASH_SIZE);
+    }
+}
+
+// Function to print a verify progress line from counters summed so far
+void verify_print_progress(double elapsed, size_t total_records, size_t total_recs_in_file, size_t sorted, size_t not_sorted, size_t zero_nonce_count)
+{
+    double pct = (double)total_records * 100.0 / (double)total_recs_in_file;
+    double pct_met = (double)sorted * 100.0 / (double)(sorted + not_sorted + zero_nonce_count);
+    double pct_sorted = (double)sorted * 100.0 / (double)(sorted + not_sorted);
+    printf("[%.2f] Verify %.2f%%: Sorted %.2f%% : Storage Efficiency %.2f%%\n",
+           elapsed, pct, pct_sorted, pct_met);
+}
+
+/**
+ * process_memo_records_table2:
+ *   - Verifies the sort order and fill of a table2 plot.
+ *   - The plot is split into chunks of whole buckets that threads read with positioned I/O and
+ *     check with verify_chunk(); the first record of each chunk is then compared with the last
+ *     record of the chunk before it.
+ *   - Progress is printed at most once a second, checked once per chunk rather than per record.
+ *
+ * @param set Stripes of the plot.
+ * @return Number of records in sorted order.
+ */
+size_t process_memo_records_table2(const StripeSet *set)
+{
+    // --- open all stripes & figure out how many records are in them ---
+    PlotFile plot;
+    if (plot_open(&plot, set) != 0)
+    {
+        return 0;
+    }
+    size_t num_buckets = plot.num_buckets;
+    size_t total_recs_in_file = num_buckets * plot.num_records_in_bucket;
+    const size_t BATCH_SIZE = plot.num_records_in_bucket;
+    if (BATCH_SIZE == 0)
+    {
+        fprintf(stderr, "Error: table2 holds no records.\n");
+        plot_close(&plot);
+        return 0;
+    }
+
+    // --- chunks of about a million records worth of whole buckets ---
+    size_t chunk_buckets = max(1, (1024 * 1024) / BATCH_SIZE);
+    size_t num_chunks = (num_buckets + chunk_buckets - 1) / chunk_buckets;
+    VerifyChunk *chunks = (VerifyChunk *)calloc(num_chunks, sizeof(VerifyChunk));
+    if (chunks == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for %zu chunks\n", num_chunks);
+        plot_close(&plot);
+        return 0;
+    }
+
+    // --- running totals for progress updates, without the stitched chunk boundaries ---
+    size_t total_records = 0;
+    size_t zero_nonce_count = 0;
+    size_t count_condition_met = 0;
+    size_t count_condition_not_met = 0;
+    size_t read_errors = 0; // chunks that could not be read, and were not verified
+
+    double start_time = omp_get_wtime();
+    double last_print_time = start_time;
+
+#pragma omp parallel
+    {
+        MemoRecord2 *buffer = (MemoRecord2 *)malloc(chunk_buckets * BATCH_SIZE * sizeof(MemoRecord2));
+        uint32_t *counts = (uint32_t *)malloc(chunk_buckets * sizeof(uint32_t));
+        uint8_t *hashes = (uint8_t *)malloc(chunk_buckets * BATCH_SIZE * PAIR_HASH_SIZE);
+        uint64_t *bitmap = (uint64_t *)malloc(((chunk_buckets * BATCH_SIZE * sizeof(MemoRecord2) + 63) / 64 + 1) * sizeof(uint64_t));
+        if (!buffer || !counts || !hashes || !bitmap)
+        {
+            fprintf(stderr, "Error: Unable to allocate buffer for %zu records\n", chunk_buckets * BATCH_SIZE);
+            exit(EXIT_FAILURE);
+        }
+
+#pragma omp for schedule(dynamic, 1)
+        for (size_t c = 0; c < num_chunks; c++)
+        {
+            size_t first = c * chunk_buckets;
+            size_t count = min(chunk_buckets, num_buckets - first);
+            // an empty chunk of a compact plot reads 0 records and is verified; a failed read is not
+            memset(counts, 0, count * sizeof(uint32_t));
+            ssize_t chunk_read = plot_read_buckets(&plot, first, count, buffer, counts);
+            if (chunk_read < 0 || (chunk_read == 0 && !plot.compact))
+            {
+#pragma omp atomic
+                read_errors++;
+                continue;
+            }
+            verify_chunk(&plot, buffer, counts, count, hashes, bitmap, &chunks[c]);
+
+#pragma omp critical(verify_progress)
+            {
+                total_records += chunks[c].total_records;
+                zero_nonce_count += chunks[c].zero_nonce_count;
+                count_condition_met += chunks[c].sorted;
+                count_condition_not_met += chunks[c].not_sorted;
+
+                // --- progress update every second ---
+                double now = omp_get_wtime();
+                if (now - last_print_time >= 1.0)
+                {
+                    last_print_time = now;
+                    verify_print_progress(now - start_time, total_records, total_recs_in_file,
+                                          count_condition_met, count_condition_not_met, zero_nonce_count);
+                }
+            }
+        }
+
+        free(buffer);
+        free(counts);
+        free(hashes);
+        free(bitmap);
+    }
+
+    // --- stitch the chunks: each first record against the last record before it ---
+    size_t full_buckets = 0;
+    size_t fingerprint_mismatches = 0;
+    uint8_t prev_hash[HASH_SIZE] = {0};
+    for (size_t c = 0; c < num_chunks; c++)
+    {
+        full_buckets += chunks[c].full_buckets;
+        fingerprint_mismatches += chunks[c].fingerprint_mismatches;
+        if (!chunks[c].has_records)
+            continue;
+        if (memcmp(chunks[c].first_hash, prev_hash, PREFIX_SIZE) >= 0)
+            ++count_condition_met;
+        else
+            ++count_condition_not_met;
+        memcpy(prev_hash, chunks[c].last_hash, HASH_SIZE);
+    }
+
+    // ensure final 100% progress line
+    verify_print_progress(omp_get_wtime() - start_time, total_records, total_recs_in_file,
+                          count_condition_met, count_condition_not_met, zero_nonce_count);
+    if (FINGERPRINT_BITS > 0)
+        printf("Fingerprints: %zu records do not match their hash\n", fingerprint_mismatches);
+    if (read_errors > 0)
+        fprintf(stderr, "Error: %zu of %zu chunks could not be read and were not verified\n", read_errors, num_chunks);
+    if (DEBUG)
+        printf("sorted=%zu not_sorted=%zu zero_nonces=%zu total_records=%zu full_buckets=%zu\n",
+               count_condition_met, count_condition_not_met, zero_nonce_count, total_records, full_buckets);
+
+    // --- cleanup ---
+    free(chunks);
+    plot_close(&plot);
+
+    return count_condition_met;
+}
+
+/**
+ * plot_occupancy:
+ *   - Counts the occupied slots of every bucket of a plot and prints the histogram of bucket fill:
+ *     how many buckets hold 0, 1, ... num_records_in_bucket records (in up to 32 ranges for large buckets).
+ *   - Chunks of buckets are read over all threads and scanned with nonzero_bytes(); a compact plot's
+ *     bucket index already holds the counts.
+ *
+ * @param set Stripes of the plot.
+ * @return 0 on success, -1 on error.
+ */
+int plot_occupancy(const StripeSet *set)
+{
+    PlotFile plot;
+    if (plot_open(&plot, set) != 0)
+        return -1;
+    size_t slots = plot.num_records_in_bucket;
+    if (slots == 0)
+    {
+        fprintf(stderr, "Error: table2 holds no records.\n");
+        plot_close(&plot);
+        return -1;
+    }
+
+    double start_time = omp_get_wtime();
+    size_t chunk_buckets = max(1, (1024 * 1024) / slots);
+    size_t num_chunks = (plot.num_buckets + chunk_buckets - 1) / chunk_buckets;
+    unsigned long long *histogram = (unsigned long long *)calloc(slots + 1, sizeof(unsigned long long));
+    if (histogram == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        plot_close(&plot);
+        return -1;
+    }
+
+#pragma omp parallel
+    {
+        MemoRecord2 *buffer = (MemoRecord2 *)malloc(chunk_buckets * slots * sizeof(MemoRecord2));
+        uint32_t *counts = (uint32_t *)malloc(chunk_buckets * sizeof(uint32_t));
+        uint64_t *bitmap = (uint64_t *)malloc(((chunk_buckets * slots * sizeof(MemoRecord2) + 63) / 64 + 1) * sizeof(uint64_t));
+        unsigned long long *local = (unsigned long long *)calloc(slots + 1, sizeof(unsigned long long));
+        if (!buffer || !counts || !bitmap || !local)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory.\n");
+            exit(EXIT_FAILURE);
+        }
+
+#pragma omp for schedule(dynamic, 1)
+        for (size_t c = 0; c < num_chunks; c++)
+        {
+            size_t first = c * chunk_buckets;
+            size_t count = min(chunk_buckets, plot.num_buckets - first);
+            memset(counts, 0, count * sizeof(uint32_t));
+            ssize_t records_read = plot_read_buckets(&plot, first, count, buffer, counts);
+            if (records_read < 0)
+                continue;
+            if (plot.compact)
+            {
+                for (size_t b = 0; b < count; b++)
+                    local[min(counts[b], slots)]++;
+                continue;
+            }
+            if ((size_t)records_read != count * slots)
+                continue;
+
+            nonzero_bytes((const uint8_t *)buffer, records_read * sizeof(MemoRecord2), bitmap);
+            for (size_t b = 0, i = 0; b < count; b++)
+            {
+                size_t fill = 0;
+                for (size_t j = 0; j < slots; j++, i++)
+                    fill += record_occupied(bitmap, i, sizeof(MemoRecord2), NONCE1_MASK, NONCE2_MASK);
+                local[fill]++;
+            }
+        }
+
+#pragma omp critical(occupancy_histogram)
+        for (size_t f = 0; f <= slots; f++)
+            histogram[f] += local[f];
+
+        free(buffer);
+        free(counts);
+        free(bitmap);
+        free(local);
+    }
+
+    unsigned long long buckets = 0;
+    unsigned long long records = 0;
+    for (size_t f = 0; f <= slots; f++)
+    {
+        buckets += histogram[f];
+        records += histogram[f] * f;
+    }
+    double elapsed_time = omp_get_wtime() - start_time;
+    printf("OCCUPANCY: %s: %llu of %llu buckets scanned, %llu records in %llu slots, storage efficiency %.2f%%, bucket efficiency %.2f%%, mean fill %.3f, %.2f seconds, %.2f MB/s\n",
+           plot.paths[0], buckets, plot.num_buckets, records, buckets * slots, records * 100.0 / max(buckets * slots, 1),
+           histogram[slots] * 100.0 / max(buckets, 1), (double)records / max(buckets, 1), elapsed_time, plot.filesize / elapsed_time / (1024 * 1024));
+    if (buckets < plot.num_buckets)
+        fprintf(stderr, "Warning: %llu buckets could not be read.\n", plot.num_buckets - buckets);
+
+    // fill levels in ranges of width so there are at most 32 lines
+    size_t width = (slots + 1 + 31) / 32;
+    for (size_t low = 0; low <= slots; low += width)
+    {
+        size_t high = min(low + width - 1, slots);
+        unsigned long long n = 0;
+        for (size_t f = low; f <= high; f++)
+            n += histogram[f];
+        if (width == 1)
+            printf("OCCUPANCY: fill %zu: %llu buckets (%.2f%%)\n", low, n, n * 100.0 / max(buckets, 1));
+        else
+            printf("OCCUPANCY: fill %zu-%zu: %llu buckets (%.2f%%)\n", low, high, n, n * 100.0 / max(buckets, 1));
+    }
+
+    free(histogram);
+    plot_close(&plot);
+    return buckets == plot.num_buckets ? 0 : -1;
+}
+
+#define SAMPLE_Z 1.96 // normal quantile of the two-sided 95% intervals verify_sample() reports
+
+// Counters of the buckets checked by verify_sample_bucket(), summed over the sample
+typedef struct
+{
+    size_t buckets;
+    size_t full_buckets;
+    size_t slots;
+    size_t records;        // occupied slots
+    size_t in_place;       // records in their bucket and in order
+    size_t misplaced;      // hash prefix of another bucket
+    size_t out_of_order;   // sorted plots: pair key below the record before it, or after an empty slot
+    size_t unpaired;       // table1 hashes that do not pair (plots holding table1 nonces)
+    size_t fingerprint_mismatches;
+    size_t read_errors;
+    double storage_sum;    // sums of the per-bucket storage efficiency and its square
+    double storage_sum_sq;
+    double sort_residual_sum_sq; // see verify_sample()
+} SampleStats;
+
+// Function to draw the bucket of sample i of a seed: a splitmix64 step, so every thread draws the same sample
+uint64_t sample_bucket(uint64_t seed, uint64_t i, uint64_t num_buckets)
+{
+    uint64_t z = seed + (i + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return z % num_buckets;
+}
+
+// Function to check one bucket read with plot_read_buckets() into counters of that bucket alone
+void verify_sample_bucket(const PlotFile *plot, uint64_t bucket, const MemoRecord2 *records, size_t count, SampleStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->buckets = 1;
+    stats->slots = plot->num_records_in_bucket;
+
+    uint8_t prev_hash[PAIR_HASH_SIZE] = {0};
+    bool seen_empty = false;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!is_nonce_nonzero(records[i].nonce1, NONCE_SIZE) || !is_nonce_nonzero(records[i].nonce2, NONCE_SIZE))
+        {
+            seen_empty = true;
+            continue;
+        }
+        stats->records++;
+
+        uint8_t pair[2 * NONCE_SIZE];
+        uint8_t hash[PAIR_HASH_SIZE];
+        memcpy(pair, records[i].nonce1, NONCE_SIZE);
+        memcpy(pair + NONCE_SIZE, records[i].nonce2, NONCE_SIZE);
+        blake3_single_block(pair, sizeof(pair), hash, PAIR_HASH_SIZE);
+
+        if (!fingerprint_pass(&records[i], fingerprint_filter(hash, PAIR_HASH_SIZE)))
+            stats->fingerprint_mismatches++;
+        if (plot->table1_nonces)
+        {
+            uint8_t hash1[HASH_SIZE];
+            uint8_t hash2[HASH_SIZE];
+            blake3_single_block(records[i].nonce1, NONCE_SIZE, hash1, HASH_SIZE);
+            blake3_single_block(records[i].nonce2, NONCE_SIZE, hash2, HASH_SIZE);
+            if (!hashes_pair(hash1, hash2, plot->pairing_distance))
+                stats->unpaired++;
+        }
+
+        if ((uint64_t)getBucketIndex(hash, PREFIX_SIZE) != bucket)
+        {
+            stats->misplaced++;
+            continue;
+        }
+        if (plot->sorted && (seen_empty || memcmp(hash, prev_hash, PREFIX_SIZE + PAIR_KEY_SIZE) < 0))
+            stats->out_of_order++;
+        else
+            stats->in_place++;
+        memcpy(prev_hash, hash, PAIR_HASH_SIZE);
+    }
+    stats->full_buckets = stats->records == stats->slots;
+    stats->storage_sum = (double)stats->in_place / stats->slots;
+}
+
+/**
+ * verify_sample:
+ *   - Checks num_samples buckets drawn at random (with replacement) from seed instead of the whole plot:
+ *     every record must hash into its bucket, follow the record before it in a sorted plot, pair
+ *     (plots holding table1 nonces) and match its fingerprint.
+ *   - Buckets are read with positioned I/O over all threads; the sample is the same for any thread count.
+ *   - Storage and sort efficiency come with 95% intervals over the sampled buckets: a mean for the
+ *     storage efficiency, a ratio estimate for the sort efficiency, and for a sample without a single
+ *     record out of place, the rule of three (at most 3/n of n records checked).
+ *
+ * @param set         Stripes of the plot.
+ * @param num_samples Buckets to check.
+ * @param seed        Seed of the sample; the same seed checks the same buckets again.
+ * @return 0 if every sampled record passed, 1 if some did not, -1 on error.
+ */
+int verify_sample(const StripeSet *set, uint64_t num_samples, uint64_t seed)
+{
+    PlotFile plot;
+    if (plot_open(&plot, set) != 0)
+        return -1;
+    if (plot.num_records_in_bucket == 0)
+    {
+        fprintf(stderr, "Error: table2 holds no records.\n");
+        plot_close(&plot);
+        return -1;
+    }
+    if (!plot.table1_nonces)
+        fprintf(stderr, "Warning: %s does not hold table1 nonces; the pairing predicate is not checked.\n", plot.paths[0]);
+
+    double start_time = omp_get_wtime();
+    SampleStats total;
+    memset(&total, 0, sizeof(total));
+    SampleStats *per_bucket = (SampleStats *)malloc(num_samples * sizeof(SampleStats));
+    if (per_bucket == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for %llu samples.\n", (unsigned long long)num_samples);
+        plot_close(&plot);
+        return -1;
+    }
+
+#pragma omp parallel
+    {
+        MemoRecord2 *buffer = (MemoRecord2 *)malloc(plot.num_records_in_bucket * sizeof(MemoRecord2));
+        if (buffer == NULL)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory.\n");
+            exit(EXIT_FAILURE);
+        }
+
+#pragma omp for schedule(dynamic, 64)
+        for (uint64_t i = 0; i < num_samples; i++)
+        {
+            uint64_t bucket = sample_bucket(seed, i, plot.num_buckets);
+            uint32_t count = 0;
+            if (plot_read_buckets(&plot, bucket, 1, buffer, &count) < 0 || (!plot.compact && count != plot.num_records_in_bucket))
+            {
+                memset(&per_bucket[i], 0, sizeof(SampleStats));
+                per_bucket[i].read_errors = 1;
+                continue;
+            }
+            verify_sample_bucket(&plot, bucket, buffer, count, &per_bucket[i]);
+        }
+        free(buffer);
+    }
+
+    for (uint64_t i = 0; i < num_samples; i++)
+    {
+        const SampleStats *b = &per_bucket[i];
+        total.read_errors += b->read_errors;
+        if (b->read_errors)
+            continue;
+        total.buckets++;
+        total.full_buckets += b->full_buckets;
+        total.slots += b->slots;
+        total.records += b->records;
+        total.in_place += b->in_place;
+        total.misplaced += b->misplaced;
+        total.out_of_order += b->out_of_order;
+        total.unpaired += b->unpaired;
+        total.fingerprint_mismatches += b->fingerprint_mismatches;
+        total.storage_sum += b->storage_sum;
+        total.storage_sum_sq += b->storage_sum * b->storage_sum;
+    }
+
+    // sort efficiency R = in_place / records is a ratio of two bucket sums; its variance is that of the
+    // residuals in_place - R * records of the buckets
+    double n = (double)total.buckets;
+    double sort_eff = total.records > 0 ? (double)total.in_place / total.records : 1.0;
+    for (uint64_t i = 0; i < num_samples; i++)
+    {
+        const SampleStats *b = &per_bucket[i];
+        if (b->read_errors)
+            continue;
+        double residual = b->in_place - sort_eff * b->records;
+        total.sort_residual_sum_sq += residual * residual;
+    }
+    free(per_bucket);
+
+    if (total.buckets == 0)
+    {
+        fprintf(stderr, "Error: none of the %llu sampled buckets could be read.\n", (unsigned long long)num_samples);
+        plot_close(&plot);
+        return -1;
+    }
+
+    double storage_eff = total.storage_sum / n;
+    double storage_var = n > 1 ? (total.storage_sum_sq - n * storage_eff * storage_eff) / (n - 1) : 0.0;
+    double storage_margin = SAMPLE_Z * sqrt(max(storage_var, 0.0) / n);
+
+    double mean_records = (double)total.records / n;
+    double sort_low = sort_eff;
+    double sort_high = sort_eff;
+    if (total.in_place == total.records)
+    {
+        sort_low = total.records > 0 ? max(1.0 - 3.0 / total.records, 0.0) : 0.0;
+    }
+    else if (n > 1 && mean_records > 0)
+    {
+        double sort_margin = SAMPLE_Z * sqrt(total.sort_residual_sum_sq / (n - 1) / n) / mean_records;
+        sort_low = max(sort_eff - sort_margin, 0.0);
+        sort_high = min(sort_eff + sort_margin, 1.0);
+    }
+
+    // Wilson interval of the share of full buckets
+    double p = (double)total.full_buckets / n;
+    double z2 = SAMPLE_Z * SAMPLE_Z;
+    double center = (p + z2 / (2 * n)) / (1 + z2 / n);
+    double half = SAMPLE_Z * sqrt(p * (1 - p) / n + z2 / (4 * n * n)) / (1 + z2 / n);
+
+    double elapsed_time = omp_get_wtime() - start_time;
+    size_t failed = total.misplaced + total.out_of_order + total.unpaired + total.fingerprint_mismatches;
+    printf("SAMPLE: %s: %zu of %llu buckets (seed %llu), %zu records in %zu slots, checked in %.2f seconds\n",
+           plot.paths[0], total.buckets, plot.num_buckets, (unsigned long long)seed, total.records, total.slots, elapsed_time);
+    printf("SAMPLE: storage efficiency %.2f%% (95%% interval %.2f%% - %.2f%%)\n",
+           storage_eff * 100.0, max(storage_eff - storage_margin, 0.0) * 100.0, min(storage_eff + storage_margin, 1.0) * 100.0);
+    printf("SAMPLE: sort efficiency %.4f%% (95%% interval %.4f%% - %.4f%%)\n",
+           sort_eff * 100.0, sort_low * 100.0, sort_high * 100.0);
+    printf("SAMPLE: bucket efficiency %.2f%% (95%% interval %.2f%% - %.2f%%)\n",
+           p * 100.0, max(center - half, 0.0) * 100.0, min(center + half, 1.0) * 100.0);
+    printf("SAMPLE: misplaced=%zu out_of_order=%zu unpaired=%zu fingerprint_mismatches=%zu read_errors=%zu%s\n",
+           total.misplaced, total.out_of_order, total.unpaired, total.fingerprint_mismatches, total.read_errors,
+           plot.table1_nonces ? "" : " (pairs not checked)");
+
+    plot_close(&plot);
+    return failed > 0 || total.read_errors > 0 ? 1 : 0;
+}
+
+size_t process_memo_records_debug(const char *filename, const size_t BATCH_SIZE)
+{
+    MemoRecord *buffer = NULL;
+    size_t total_records = 0;
+    size_t zero_nonce_count = 0;
+    size_t full_buckets = 0;
+    bool bucket_not_full = false;
+    size_t records_read;
+    FILE *file = NULL;
+
+    // Now maintain two previous hashes and nonces.
+    uint8_t prev_hash[HASH_SIZE] = {0};        // immediate previous hash
+    uint8_t prev_prev_hash[HASH_SIZE] = {0};   // hash from two records back
+    uint8_t prev_nonce[NONCE_SIZE] = {0};      // immediate previous nonce
+    uint8_t prev_prev_nonce[NONCE_SIZE] = {0}; // nonce corresponding to prev_prev_hash
+
+    size_t count_condition_met = 0; // Counter for records meeting the condition
+    size_t count_condition_not_met = 0;
+
+    long filesize = get_file_size(filename);
+    if (filesize != -1)
+    {
+        if (!BENCHMARK)
+            printf("Size of '%s' is %ld bytes.\n", filename, filesize);
+    }
+
+    printf("num_records_in_bucket=%llu\n", num_records_in_bucket);
+    printf("BATCH_SIZE=%lu\n", BATCH_SIZE);
+    printf("filesize=%ld\n", filesize);
+
+    file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        printf("Error opening file %s (#3)\n", filename);
+        perror("Error opening file");
+        return 0;
+    }
+
+    buffer = (MemoRecord *)malloc(BATCH_SIZE * sizeof(MemoRecord));
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        fclose(file);
+        return 0;
+    }
+
+    double start_time = omp_get_wtime();
+    // double end_time = omp_get_wtime();
+
+    while ((records_read = fread(buffer, sizeof(MemoRecord), BATCH_SIZE, file)) > 0)
+    {
+        double start_time_verify = omp_get_wtime();
+        double end_time_verify = omp_get_wtime();
+        bucket_not_full = false;
+        uint64_t distance = 0;
+        uint64_t leading_match = 0;
+        // uint64_t HASH_SPACE = 1 << (K+1);
+        // uint64_t M = UINT64_MAX;
+        // uint64_t expected_distance = M / (HASH_SPACE + 1);
+        uint64_t expected_distance = 1ULL << (64 - K);
+        // uint64_t min_distance = UINT64_MAX;
+        // uint64_t max_distance = 0;
+        // uint64_t total_distance = 0;
+        uint64_t count = 0;
+        uint64_t hash_pass_count = 0;
+
+        for (size_t i = 0; i < records_read; ++i)
+        {
+            ++total_records;
+            if (is_nonce_nonzero(buffer[i].nonce, NONCE_SIZE))
+            {
+                uint8_t hash_output[HASH_SIZE];
+
+                // Compute Blake3 hash of the nonce
+                blake3_hasher hasher;
+                blake3_hasher_init(&hasher);
+                blake3_hasher_update(&hasher, buffer[i].nonce, NONCE_SIZE);
+                blake3_hasher_finalize(&hasher, hash_output, HASH_SIZE);
+
+                if (i >= 1)
+                {
+                    // Compare the first PREFIX_SIZE bytes of the current hash to the hash from two records back
+                    if (memcmp(hash_output, prev_hash, HASH_SIZE) >= 0)
+                    {
+                        ++count_condition_met;
+                    }
+                    else
+                    {
+                        ++count_condition_not_met;
+                        if (DEBUG)
+                        {
+                            printf("Condition not met at record %zu:\n", total_records);
+                            printf("Previous nonce: ");
+                            for (size_t n = 0; n < NONCE_SIZE; ++n)
+                                printf("%02X", prev_hash[n]);
+                            printf("\n");
+                            printf("Previous hash prefix: ");
+                            for (size_t n = 0; n < HASH_SIZE; ++n)
+                                printf("%02X", prev_hash[n]);
+                            printf("\n");
+                            printf("Current nonce: ");
+                            for (size_t n = 0; n < NONCE_SIZE; ++n)
+                                printf("%02X", buffer[i].nonce[n]);
+                            printf("\n");
+                            printf("Current hash prefix: ");
+                            for (size_t n = 0; n < HASH_SIZE; ++n)
+                                printf("%02X", hash_output[n]);
+                            printf("\n");
+                        }
+                    }
+                }
+
+                if (i >= 2)
+                {
+                    // Compute distance against the two-back hash
+                    distance = compute_hash_distance(prev_prev_hash, hash_output, HASH_SIZE);
+                    // distance = compute_hash_distance(prev_hash, hash_output, HASH_SIZE);
+                    leading_match = compute_hash_match_leading(prev_prev_hash, hash_output, HASH_SIZE);
+                    // leading_match = compute_hash_match_leading(prev_hash, hash_output, HASH_SIZE);
+                    if (total_records % (1024 * 1024) == 0)
+                    {
+                        // distance = compute_hash_distance_debug(prev_prev_hash, hash_output, HASH_SIZE);
+
+                        // distance = compute_hash_distance_debug(prev_hash, hash_output, HASH_SIZE);
+                        printf("compute_hash_distance()): distance=%lu expected_distance=%lu match=%s leading_match=%lu\n",
+                               distance, expected_distance, (distance <= expected_distance) ? "true" : "false", leading_match);
+                    }
+
+                    // if (distance <= expected_distance && leading_match >= K) {
+                    if (distance <= expected_distance)
+                    {
+                        hash_pass_count++;
+                    }
+                    count++;
+                }
+                // Shift previous hashes: the immediate previous becomes two-back,
+                // then update immediate previous with current values.
+                if (i >= 1)
+                {
+                    memcpy(prev_prev_hash, prev_hash, HASH_SIZE);
+                    memcpy(prev_prev_nonce, prev_nonce, NONCE_SIZE);
+                }
+
+                memcpy(prev_hash, hash_output, HASH_SIZE);
+                memcpy(prev_nonce, buffer[i].nonce, NONCE_SIZE);
+            }
+            else
+            {
+                ++zero_nonce_count;
+                bucket_not_full = true;
+            }
+        }
+        if (bucket_not_full == false)
+            full_buckets++;
+        end_time_verify = omp_get_wtime();
+
+        hash_pass_count_global += hash_pass_count;
+        if (total_records % (1024 * 1024) == 0)
+        {
+            printf("Hashed passed: %lu out of %lu (%.2f%%)\n",
+                   hash_pass_count_global, total_records, hash_pass_count_global * 100.0 / total_records);
+        }
+        double elapsed_time_verify = end_time_verify - start_time_verify;
+        double elapsed_time = omp_get_wtime() - start_time;
+        double throughput = (BATCH_SIZE * sizeof(MemoRecord) / elapsed_time_verify) / (1024 * 1024);
+        if (total_records % (1024 * 1024) == 0)
+            printf("[%.2f] Verify %.2f%%: %.2f MB/s\n", elapsed_time,
+                   total_records * sizeof(MemoRecord) * 100.0 / filesize, throughput);
+    }
+
+    if (ferror(file))
+    {
+        perror("Error reading file");
+    }
+    fclose(file);
+    free(buffer);
+
+    printf("sorted=%zu not_sorted=%zu zero_nonces=%zu total_records=%zu full_buckets=%zu storage_efficiency=%.2f bucket_efficiency=%.2f\n",
+           count_condition_met, count_condition_not_met, zero_nonce_count, total_records, full_buckets,
+           count_condition_met * 100.0 / total_records, full_buckets * 100.0 / (num_buckets));
+
+    return count_condition_met;
+}
+
+// Subsystems of plot generation whose memory is accounted against -m
+enum
+{
+    MEM_TABLE1,   // records of buckets
+    MEM_TABLE2,   // records of buckets2, and their sort keys
+    MEM_METADATA, // the Bucket and Bucket2 arrays
+    MEM_SORT,     // MemoAllRecord scratch of the table1 bucket sorts
+    MEM_SHUFFLE,  // read and shuffle buffers of shuffle_table2()
+    MEM_SUBSYSTEMS
+};
+
+const char *MEM_NAMES[MEM_SUBSYSTEMS] = {"table1", "table2", "metadata", "sort", "shuffle"};
+
+#define MEM_MAX_PHASES 16
+
+// Bytes planned, held and at most held by every subsystem, and the resident set size at each phase boundary
+typedef struct
+{
+    unsigned long long budget; // -m in bytes, 0 without -m
+    unsigned long long reserved[MEM_SUBSYSTEMS];
+    unsigned long long current[MEM_SUBSYSTEMS];
+    unsigned long long peak[MEM_SUBSYSTEMS];
+    unsigned long long current_total;
+    unsigned long long peak_total;
+    const char *phases[MEM_MAX_PHASES];
+    unsigned long long phase_rss[MEM_MAX_PHASES]; // largest VmRSS seen at the end of the phase
+    size_t num_phases;
+} MemoryAccount;
+
+MemoryAccount MEMORY = {0};
+
+// Function to give the bytes a round of records_in_bucket records per bucket allocates, the way main() and
+// shuffle_table2() allocate it: bucket metadata, table1, table2 with its sort keys, and the scratch of
+// num_threads concurrent table1 sorts
+unsigned long long memory_round_bytes(unsigned long long records_in_bucket, int num_threads, bool keys)
+{
+    unsigned long long buckets_in_round = 1ULL << (PREFIX_SIZE * 8);
+    unsigned long long record_bytes = sizeof(MemoRecord) + sizeof(MemoRecord2) + (keys ? sizeof(uint32_t) : 0);
+    return buckets_in_round * (sizeof(Bucket) + sizeof(Bucket2) + records_in_bucket * record_bytes) +
+           (unsigned long long)num_threads * records_in_bucket * sizeof(MemoAllRecord);
+}
+
+// Function to give the most records per bucket whose round fits in budget bytes; 0 if not even one does
+unsigned long long memory_plan(unsigned long long budget, int num_threads, bool keys)
+{
+    unsigned long long fixed = memory_round_bytes(0, num_threads, keys);
+    if (budget <= fixed)
+        return 0;
+    return (budget - fixed) / (memory_round_bytes(1, num_threads, keys) - fixed);
+}
+
+// Function to set what a round of the final geometry may hold, per subsystem
+void memory_reserve(unsigned long long budget, int num_threads, bool keys)
+{
+    MEMORY.budget = budget;
+    MEMORY.reserved[MEM_TABLE1] = num_buckets * num_records_in_bucket * sizeof(MemoRecord);
+    MEMORY.reserved[MEM_TABLE2] = num_buckets * num_records_in_bucket * (sizeof(MemoRecord2) + (keys ? sizeof(uint32_t) : 0));
+    MEMORY.reserved[MEM_METADATA] = num_buckets * (sizeof(Bucket) + sizeof(Bucket2));
+    MEMORY.reserved[MEM_SORT] = (unsigned long long)num_threads * num_records_in_bucket * sizeof(MemoAllRecord);
+}
+
+// Function to account bytes allocated (positive) or freed (negative) by a subsystem
+void memory_account(int subsystem, long long bytes)
+{
+    unsigned long long current;
+    unsigned long long total;
+#pragma omp atomic capture
+    {
+        MEMORY.current[subsystem] += bytes;
+        current = MEMORY.current[subsystem];
+    }
+#pragma omp atomic capture
+    {
+        MEMORY.current_total += bytes;
+        total = MEMORY.current_total;
+    }
+#pragma omp critical(memory_peak)
+    {
+        MEMORY.peak[subsystem] = max(MEMORY.peak[subsystem], current);
+        MEMORY.peak_total = max(MEMORY.peak_total, total);
+    }
+}
+
+// Function to read a "Name: N kB" line of /proc/self/status, in bytes; 0 where there is no such file
+unsigned long long memory_status(const char *name)
+{
+    FILE *file = fopen("/proc/self/status", "r");
+    if (file == NULL)
+        return 0;
+    char line[256];
+    size_t length = strlen(name);
+    unsigned long long kb = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (strncmp(line, name, length) == 0 && line[length] == ':')
+        {
+            kb = strtoull(&line[length + 1], NULL, 10);
+            break;
+        }
+    }
+    fclose(file);
+    return kb * 1024;
+}
+
+// Function to close a phase: keeps the largest resident set size seen at its end, over every round
+void memory_phase(const char *name)
+{
+    unsigned long long rss = memory_status("VmRSS");
+    size_t p = 0;
+    while (p < MEMORY.num_phases && strcmp(MEMORY.phases[p], name) != 0)
+        p++;
+    if (p == MEMORY.num_phases)
+    {
+        if (p == MEM_MAX_PHASES)
+            return;
+        MEMORY.phases[MEMORY.num_phases++] = name;
+        MEMORY.phase_rss[p] = 0;
+    }
+    MEMORY.phase_rss[p] = max(MEMORY.phase_rss[p], rss);
+}
+
+// Function to print, or write as the members of a JSON object, the accounting and the resident set sizes
+void memory_report(FILE *file, bool json)
+{
+    const double MB = 1024.0 * 1024;
+    // the buckets are freed before the shuffle allocates
+    unsigned long long reserved_total = 0;
+    for (int s = 0; s < MEM_SHUFFLE; s++)
+        reserved_total += MEMORY.reserved[s];
+    reserved_total = max(reserved_total, MEMORY.reserved[MEM_SHUFFLE]);
+    unsigned long long hwm = memory_status("VmHWM");
+
+    if (json)
+    {
+        fprintf(file, "\"budget\": %llu, \"reserved\": %llu, \"peak\": %llu, \"vm_hwm\": %llu", MEMORY.budget, reserved_total, MEMORY.peak_total, hwm);
+        for (int s = 0; s < MEM_SUBSYSTEMS; s++)
+            fprintf(file, ", \"%s\": {\"reserved\": %llu, \"peak\": %llu}", MEM_NAMES[s], MEMORY.reserved[s], MEMORY.peak[s]);
+        fprintf(file, ", \"phase_rss\": {");
+        for (size_t p = 0; p < MEMORY.num_phases; p++)
+            fprintf(file, "%s\"%s\": %llu", p > 0 ? ", " : "", MEMORY.phases[p], MEMORY.phase_rss[p]);
+        fprintf(file, "}");
+        return;
+    }
+
+    if (MEMORY.budget > 0)
+        fprintf(file, "MEMORY: budget %.2f MB\n", MEMORY.budget / MB);
+    for (int s = 0; s < MEM_SUBSYSTEMS; s++)
+        fprintf(file, "MEMORY: %-8s reserved %10.2f MB peak %10.2f MB\n", MEM_NAMES[s], MEMORY.reserved[s] / MB, MEMORY.peak[s] / MB);
+    fprintf(file, "MEMORY: %-8s reserved %10.2f MB peak %10.2f MB\n", "total", reserved_total / MB, MEMORY.peak_total / MB);
+    for (size_t p = 0; p < MEMORY.num_phases; p++)
+        fprintf(file, "MEMORY: rss after %-9s %10.2f MB\n", MEMORY.phases[p], MEMORY.phase_rss[p] / MB);
+    fprintf(file, "MEMORY: rss peak %20.2f MB\n", hwm / MB);
+}
+
+// Phases of plot generation timed by --metrics, per round and thread
+enum
+{
+    METRIC_HASH,    // table1 hashes
+    METRIC_INSERT,  // table1 bucket inserts
+    METRIC_SORT,    // table1 bucket sorts, and table2 sorts of --sorted
+    METRIC_PAIR,    // table2 pairing, with its bucket inserts
+    METRIC_WRITE,   // table2 writes of a round
+    METRIC_SHUFFLE, // shuffle of the rounds into the final plot
+    METRIC_SYNC,    // flushes, checkpoints and fdatasync
+    METRIC_PHASES
+};
+
+const char *METRIC_NAMES[METRIC_PHASES] = {"hash", "insert", "sort", "pair", "write", "shuffle", "sync"};
+
+#define METRICS_HASH_BATCH 64      // records hashed before they are inserted (see hash_insert_range())
+#define METRICS_CHUNK_BUCKETS 4096 // buckets sorted, then paired, between two timer reads
+
+// Seconds and counters of one thread in one round, a cache line apart from the next thread's
+typedef struct
+{
+    double seconds[METRIC_PHASES];
+    unsigned long long records; // table1 records hashed
+    unsigned long long pairs;   // table2 records paired
+    uint8_t pad[64 - (METRIC_PHASES * sizeof(double) + 2 * sizeof(unsigned long long)) % 64];
+} ThreadMetrics;
+
+// What a round did as a whole
+typedef struct
+{
+    double seconds;               // wall clock
+    unsigned long long stored;    // table1 records stored
+    unsigned long long waste;     // table1 and table2 records that found their bucket full
+} RoundMetrics;
+
+// Instrumentation of a plot generation, allocated by --metrics; NULL when off, so every timer is one branch
+typedef struct
+{
+    const char *path;
+    size_t num_threads;
+    unsigned long long num_rounds; // rounds + 1: the last slot holds what follows the rounds
+    ThreadMetrics *threads;        // num_rounds x num_threads
+    RoundMetrics *rounds;
+    unsigned long long table2_waste; // table2 waste until the last round, which counts it per bucket
+} Metrics;
+
+Metrics *METRICS = NULL;
+unsigned long long METRICS_ROUND = 0; // round the timers add to
+
+// Function to allocate the metrics of num_rounds rounds of up to num_threads threads; exits on failure
+void metrics_open(const char *path, unsigned long long num_rounds, size_t num_threads)
+{
+    METRICS = (Metrics *)calloc(1, sizeof(Metrics));
+    if (METRICS != NULL)
+    {
+        METRICS->path = path;
+        METRICS->num_threads = num_threads;
+        METRICS->num_rounds = num_rounds + 1;
+        METRICS->threads = (ThreadMetrics *)calloc(METRICS->num_rounds * num_threads, sizeof(ThreadMetrics));
+        METRICS->rounds = (RoundMetrics *)calloc(METRICS->num_rounds, sizeof(RoundMetrics));
+    }
+    if (METRICS == NULL || METRICS->threads == NULL || METRICS->rounds == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for metrics.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Function to start a timer; free when metrics are off
+double metrics_start(void)
+{
+    return METRICS != NULL ? omp_get_wtime() : 0.0;
+}
+
+// Function to add the time since start to a phase of the calling thread; returns the time, to start the next phase
+double metrics_stop(int phase, double start)
+{
+    if (METRICS == NULL)
+        return 0.0;
+    double now = omp_get_wtime();
+    size_t t = (size_t)omp_get_thread_num();
+    if (t < METRICS->num_threads)
+        METRICS->threads[METRICS_ROUND * METRICS->num_threads + t].seconds[phase] += now - start;
+    return now;
+}
+
+// Function to add records hashed and pairs made to the calling thread's counters
+void metrics_count(unsigned long long records, unsigned long long pairs)
+{
+    if (METRICS == NULL)
+        return;
+    size_t t = (size_t)omp_get_thread_num();
+    if (t < METRICS->num_threads)
+    {
+        METRICS->threads[METRICS_ROUND * METRICS->num_threads + t].records += records;
+        METRICS->threads[METRICS_ROUND * METRICS->num_threads + t].pairs += pairs;
+    }
+}
+
+// Function to hash nonces [first, last) into table1 buckets for the "for" approach: METRICS_HASH_BATCH
+// records are hashed, then inserted, which keeps the hash loop apart from the cache misses of the inserts
+// and lets --metrics time both phases with four clock reads per batch
+void hash_insert_range(Bucket *buckets, unsigned long long first, unsigned long long last)
+{
+    MemoRecord records[METRICS_HASH_BATCH];
+    uint8_t hashes[METRICS_HASH_BATCH][HASH_SIZE];
+    double seconds_hash = 0.0;
+    double seconds_insert = 0.0;
+    for (unsigned long long i = first; i < last; i += METRICS_HASH_BATCH)
+    {
+        size_t count = min(last - i, (unsigned long long)METRICS_HASH_BATCH);
+        double start = metrics_start();
+        for (size_t j = 0; j < count; j++)
+            generateBlake3(hashes[j], &records[j], i + j);
+        double hashed = metrics_start();
+        if (MEMORY_WRITE)
+        {
+            for (size_t j = 0; j < count; j++)
+                insert_record(buckets, &records[j], getBucketIndex(hashes[j], PREFIX_SIZE));
+        }
+        seconds_hash += hashed - start;
+        seconds_insert += metrics_start() - hashed;
+    }
+
+    size_t t = (size_t)omp_get_thread_num();
+    if (METRICS != NULL && t < METRICS->num_threads)
+    {
+        ThreadMetrics *m = &METRICS->threads[METRICS_ROUND * METRICS->num_threads + t];
+        m->seconds[METRIC_HASH] += seconds_hash;
+        m->seconds[METRIC_INSERT] += seconds_insert;
+        m->records += last - first;
+    }
+}
+
+// Function to close a round: its wall clock time, and the records it stored and wasted, counted from the buckets
+void metrics_round(unsigned long long round, double seconds, const Bucket *buckets, const Bucket2 *buckets2)
+{
+    if (METRICS == NULL)
+        return;
+    RoundMetrics *m = &METRICS->rounds[round];
+    m->seconds = seconds;
+    unsigned long long table2_waste = 0;
+    for (unsigned long long i = 0; i < num_buckets; i++)
+    {
+        m->stored += min(buckets[i].count, num_records_in_bucket);
+        m->waste += buckets[i].count_waste;
+        table2_waste += buckets2[i].count_waste;
+    }
+    // table2 buckets fill over all rounds
+    m->waste += table2_waste - METRICS->table2_waste;
+    METRICS->table2_waste = table2_waste;
+}
+
+// Function to write the phases of a thread, or of a round summed over its threads, as JSON members
+void metrics_write_phases(FILE *file, const ThreadMetrics *m)
+{
+    for (int p = 0; p < METRIC_PHASES; p++)
+        fprintf(file, "\"%s\": %.6f, ", METRIC_NAMES[p], m->seconds[p]);
+    fprintf(file, "\"records\": %llu, \"pairs\": %llu", m->records, m->pairs);
+}
+
+/**
+ * metrics_write:
+ *   - Writes the metrics of a plot generation as one JSON document to the --metrics path.
+ *   - Phase times are thread seconds, summed over the threads that ran them; "totals" and each
+ *     round also hold their sums, a round its wall clock time ("seconds"), and per thread its own.
+ *   - The last round, "finish", is what follows the rounds: the shuffle and the final syncs.
+ *
+ * @return 0 on success, -1 if the file could not be written.
+ */
+int metrics_write(const char *approach, int num_threads, unsigned long long memory_mb, double elapsed_time)
+{
+    FILE *file = fopen(METRICS->path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error opening metrics file %s: %s\n", METRICS->path, strerror(errno));
+        return -1;
+    }
+
+    ThreadMetrics total;
+    memset(&total, 0, sizeof(total));
+    unsigned long long total_stored = 0;
+    unsigned long long total_waste = 0;
+    for (unsigned long long r = 0; r < METRICS->num_rounds; r++)
+    {
+        total_stored += METRICS->rounds[r].stored;
+        total_waste += METRICS->rounds[r].waste;
+        for (size_t t = 0; t < METRICS->num_threads; t++)
+        {
+            const ThreadMetrics *m = &METRICS->threads[r * METRICS->num_threads + t];
+            for (int p = 0; p < METRIC_PHASES; p++)
+                total.seconds[p] += m->seconds[p];
+            total.records += m->records;
+            total.pairs += m->pairs;
+        }
+    }
+
+    fprintf(file, "{\n  \"approach\": \"%s\", \"k\": %d, \"rounds\": %llu, \"threads\": %d, \"memory_mb\": %llu, \"buckets\": %llu, \"records_in_bucket\": %llu, \"seconds\": %.6f,\n",
+            approach, K, METRICS->num_rounds - 1, num_threads, memory_mb, num_buckets, num_records_in_bucket, elapsed_time);
+    fprintf(file, "  \"totals\": {");
+    metrics_write_phases(file, &total);
+    fprintf(file, ", \"stored\": %llu, \"waste\": %llu},\n", total_stored, total_waste);
+    fprintf(file, "  \"memory\": {");
+    memory_report(file, true);
+    fprintf(file, "},\n");
+    fprintf(file, "  \"rounds_detail\": [\n");
+    for (unsigned long long r = 0; r < METRICS->num_rounds; r++)
+    {
+        ThreadMetrics round;
+        memset(&round, 0, sizeof(round));
+        for (size_t t = 0; t < METRICS->num_threads; t++)
+        {
+            const ThreadMetrics *m = &METRICS->threads[r * METRICS->num_threads + t];
+            for (int p = 0; p < METRIC_PHASES; p++)
+                round.seconds[p] += m->seconds[p];
+            round.records += m->records;
+            round.pairs += m->pairs;
+        }
+        if (r + 1 < METRICS->num_rounds)
+            fprintf(file, "    {\"round\": %llu, ", r);
+        else
+            fprintf(file, "    {\"round\": \"finish\", ");
+        fprintf(file, "\"seconds\": %.6f, ", METRICS->rounds[r].seconds);
+        metrics_write_phases(file, &round);
+        fprintf(file, ", \"stored\": %llu, \"waste\": %llu,\n      \"threads\": [\n", METRICS->rounds[r].stored, METRICS->rounds[r].waste);
+        for (size_t t = 0; t < METRICS->num_threads; t++)
+        {
+            fprintf(file, "        {\"thread\": %zu, ", t);
+            metrics_write_phases(file, &METRICS->threads[r * METRICS->num_threads + t]);
+            fprintf(file, "}%s\n", t + 1 < METRICS->num_threads ? "," : "");
+        }
+        fprintf(file, "      ]}%s\n", r + 1 < METRICS->num_rounds ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+
+    if (fclose(file) != 0)
+    {
+        fprintf(stderr, "Error writing metrics file %s: %s\n", METRICS->path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Phases of plot generation counted by --perf
+enum
+{
+    PERF_GENERATE, // table1 hashes and bucket inserts
+    PERF_SORT_PAIR, // table1 sorts, table2 pairing and --sorted sorts
+    PERF_WRITE,    // table2 writes and syncs of the rounds
+    PERF_SHUFFLE,  // shuffle of the rounds into the final plot
+    PERF_PHASES
+};
+
+#define PERF_EVENTS 5
+
+const char *PERF_PHASE_NAMES[PERF_PHASES] = {"generate", "sort_pair", "write", "shuffle"};
+const char *PERF_EVENT_NAMES[PERF_EVENTS] = {"cycles", "instructions", "llc_misses", "dtlb_misses", "branch_misses"};
+
+// Hardware counters of --perf: one group over the process and the threads it starts, user space only
+typedef struct
+{
+    int fds[PERF_EVENTS]; // -1 for an event the kernel or CPU refused
+    uint64_t start[PERF_EVENTS];
+    uint64_t counts[PERF_PHASES][PERF_EVENTS];
+} PerfCounters;
+
+PerfCounters *PERF = NULL;
+
+#ifdef __linux__
+// Function to read a counter, scaled up for the time it was multiplexed out; 0 if it cannot be read
+uint64_t perf_read(int fd)
+{
+    uint64_t values[3]; // value, time enabled, time running
+    if (read(fd, values, sizeof(values)) != sizeof(values) || values[2] == 0)
+        return 0;
+    if (values[2] < values[1])
+        return (uint64_t)((double)values[0] * values[1] / values[2]);
+    return values[0];
+}
+#endif
+
+/**
+ * perf_open:
+ *   - Opens cycles, instructions, last level cache read misses, dTLB read misses and branch misses as one
+ *     perf_event_open() group that inherits into the threads started later, so it must be called before
+ *     the first parallel region.
+ *   - An event the kernel refuses (perf_event_paranoid, a container's seccomp profile, a virtual CPU
+ *     without the counter) is left out and reported as n/a; --perf never fails a run.
+ */
+void perf_open(void)
+{
+    PERF = (PerfCounters *)calloc(1, sizeof(PerfCounters));
+    if (PERF == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    int opened = 0;
+    int error = ENOSYS;
+#ifdef __linux__
+    const uint32_t types[PERF_EVENTS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE};
+    const uint64_t configs[PERF_EVENTS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        PERF_COUNT_HW_BRANCH_MISSES};
+    int leader = -1;
+    for (int e = 0; e < PERF_EVENTS; e++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[e];
+        attr.config = configs[e];
+        attr.disabled = leader == -1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        PERF->fds[e] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+        if (PERF->fds[e] == -1)
+        {
+            error = errno;
+            continue;
+        }
+        if (leader == -1)
+            leader = PERF->fds[e];
+        opened++;
+    }
+    if (leader != -1)
+        ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#else
+    for (int e = 0; e < PERF_EVENTS; e++)
+        PERF->fds[e] = -1;
+#endif
+    if (opened < PERF_EVENTS)
+        fprintf(stderr, "Warning: %d of %d hardware counters are available (%s); the others are reported as n/a.\n",
+                opened, PERF_EVENTS, strerror(error));
+}
+
+// Function to start counting a phase
+void perf_begin(void)
+{
+#ifdef __linux__
+    if (PERF == NULL)
+        return;
+    for (int e = 0; e < PERF_EVENTS; e++)
+    {
+        if (PERF->fds[e] != -1)
+            PERF->start[e] = perf_read(PERF->fds[e]);
+    }
+#endif
+}
+
+// Function to add what the counters counted since perf_begin() to a phase
+void perf_end(int phase)
+{
+#ifdef __linux__
+    if (PERF == NULL)
+        return;
+    for (int e = 0; e < PERF_EVENTS; e++)
+    {
+        if (PERF->fds[e] != -1)
+            PERF->counts[phase][e] += perf_read(PERF->fds[e]) - PERF->start[e];
+    }
+#else
+    (void)phase;
+#endif
+}
+
+// Function to print the counters of every phase, one line each, or as CSV columns (phase by phase, n/a if not counted)
+void perf_report(bool csv)
+{
+    for (int p = 0; p < PERF_PHASES; p++)
+    {
+        if (!csv)
+            printf("PERF: %-9s :", PERF_PHASE_NAMES[p]);
+        for (int e = 0; e < PERF_EVENTS; e++)
+        {
+            if (PERF->fds[e] == -1)
+                printf(csv ? ",n/a" : " %s=n/a", PERF_EVENT_NAMES[e]);
+            else if (csv)
+                printf(",%" PRIu64, PERF->counts[p][e]);
+            else
+                printf(" %s=%" PRIu64, PERF_EVENT_NAMES[e], PERF->counts[p][e]);
+        }
+        if (!csv && PERF->fds[0] != -1 && PERF->fds[1] != -1 && PERF->counts[p][0] > 0)
+            printf(" ipc=%.2f", (double)PERF->counts[p][1] / PERF->counts[p][0]);
+        if (!csv)
+            printf("\n");
+    }
+}
+
+// Function to pair the records of a sorted table1 bucket into table2; returns the number of pairs
+uint64_t generate_table2(MemoRecord *sorted_nonces, size_t num_records_in_bucket)
+{
+    // bucket_not_full = false;
+    // uint64_t distance = 0;
+    // uint64_t leading_match = 0;
+    uint64_t expected_distance = 1ULL << (64 - K);
+    // uint64_t min_distance = UINT64_MAX;
+    // uint64_t max_distance = 0;
+    // uint64_t total_distance = 0;
+    // uint64_t count = 0;
+    uint64_t hash_pass_count = 0;
+
+    for (size_t i = 0; i < num_records_in_bucket; ++i)
+    {
+        if (is_nonce_nonzero(sorted_nonces[i].nonce, NONCE_SIZE))
+        {
+            // Compute Blake3 hash for record i
+            uint8_t hash_i[HASH_SIZE];
+            blake3_hasher hasher;
+            blake3_hasher_init(&hasher);
+            blake3_hasher_update(&hasher, sorted_nonces[i].nonce, NONCE_SIZE);
+            blake3_hasher_finalize(&hasher, hash_i, HASH_SIZE);
+
+            // Compare hash_i with all subsequent non-zero nonce records
+            // could change the upper bound here to be b+2 to span multiple buckets
+            for (size_t j = i + 1; j < num_records_in_bucket; ++j)
+            {
+                // Skip records with zero nonce
+                if (!is_nonce_nonzero(sorted_nonces[j].nonce, NONCE_SIZE))
+                {
+                    continue;
+                }
+
+                // Compute Blake3 hash for record j
+                uint8_t hash_j[HASH_SIZE];
+                // blake3_hasher hasher_j;
+                blake3_hasher_init(&hasher);
+                blake3_hasher_update(&hasher, sorted_nonces[j].nonce, NONCE_SIZE);
+                blake3_hasher_finalize(&hasher, hash_j, HASH_SIZE);
+
+                // Because data is sorted, break out of the inner loop once the distance exceeds expected_distance
+                if (!hashes_pair(hash_i, hash_j, expected_distance))
+                {
+                    break;
+                }
+
+                // The distance is within the expected threshold; count it.
+                hash_pass_count++;
+
+                MemoRecord2 record;
+                uint8_t hash_table2[PAIR_HASH_SIZE];
+                // the nonces themselves, as generateBlake3() stored them, so the record is a verifiable proof
+                unsigned long long nonce_i = 0;
+                unsigned long long nonce_j = 0;
+                memcpy(&nonce_i, sorted_nonces[i].nonce, NONCE_SIZE);
+                memcpy(&nonce_j, sorted_nonces[j].nonce, NONCE_SIZE);
+                generate2Blake3(hash_table2, &record, nonce_i, nonce_j);
+
+                // uint8_t hash_table2[HASH_SIZE];
+                // blake3_hasher hasher_j;
+                // blake3_hasher_init(&hasher);
+                // blake3_hasher_update(&hasher, sorted_nonces[i].nonce, NONCE_SIZE);
+                // blake3_hasher_update(&hasher, sorted_nonces[j].nonce, NONCE_SIZE);
+                // lake3_hasher_finalize(&hasher, hash_table2, HASH_SIZE);
+
+                if (MEMORY_WRITE)
+                {
+                    off_t bucketIndex = getBucketIndex(hash_table2, PREFIX_SIZE);
+                    insert_record2(buckets2, &record, bucketIndex, (uint32_t)byteArrayToLongLong(&hash_table2[PREFIX_SIZE], PAIR_KEY_SIZE));
+                }
+                // buckets2_count[bucketIndex]++;
+                // printf("bucketIndex=%ld\n",bucketIndex);
+
+                // print_table2_entry(sorted_nonces[i].nonce, sorted_nonces[j].nonce, hash_i, hash_j, HASH_SIZE);
+
+                // Optional: Print debug information every 1,048,576 records processed.
+                // if (total_records % (1024 * 1024) == 0)
+                //{
+                //	printf("compute_hash_distance(): distance=%llu, expected_distance=%llu, hash_pass_count=%llu\n",
+                //			distance, expected_distance,hash_pass_count);
+                //}
+            }
+            // Count this nonzero nonce as processed.
+            //	count++;
+        }
+        // else
+        //{
+        //	++zero_nonce_count;
+        //	bucket_not_full = true;
+        // }
+    }
+    return hash_pass_count;
+}
+
+/**
+ * Converts a given string to an array of uint8_t.
+ *
+ * @param SEARCH_STRING The input string to convert.
+ * @return A pointer to the array of uint8_t, or NULL if allocation fails.
+ */
+uint8_t *convert_string_to_uint8_array(const char *SEARCH_STRING)
+{
+    if (SEARCH_STRING == NULL)
+    {
+        return NULL;
+    }
+
+    size_t length = strlen(SEARCH_STRING);
+    uint8_t *array = (uint8_t *)malloc(length * sizeof(uint8_t));
+    if (array == NULL)
+    {
+        // Memory allocation failed
+        return NULL;
+    }
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        array[i] = (uint8_t)SEARCH_STRING[i];
+    }
+
+    return array;
+}
+
+uint8_t *hexStringToByteArray(const char *hexString)
+{
+
+    size_t hexLen = strlen(hexString);
+    uint8_t *byteArray = (uint8_t *)malloc(hexLen * sizeof(uint8_t));
+    // size_t hexLen = strlen(hexString);
+    if (hexLen % 2 != 0)
+    {
+        return NULL; // Error: Invalid hexadecimal string length
+    }
+
+    size_t byteLen = hexLen / 2;
+    size_t byteArraySize = byteLen;
+    if (byteLen > byteArraySize)
+    {
+        return NULL; // Error: Byte array too small
+    }
+
+    for (size_t i = 0; i < byteLen; ++i)
+    {
+        if (sscanf(&hexString[i * 2], "%2hhx", &byteArray[i]) != 1)
+        {
+            return NULL; // Error: Failed to parse hexadecimal string
+        }
+    }
+
+    return byteArray;
+}
+
+const MemoRecord2 *search_memo_record(const PlotFile *plot, off_t bucketIndex, uint8_t *SEARCH_UINT8, size_t SEARCH_LENGTH, MemoRecord2 *buffer)
+{
+    size_t records_read;
+    const MemoRecord2 *foundRecord = NULL;
+    const MemoRecord2 *records = buffer;
+
+    if (DEBUG)
+        printf("SEARCH: bucket %lld in stripe %zu\n", (long long)bucketIndex, plot_stripe_of_bucket(plot, bucketIndex));
+
+    if (!plot_may_contain(plot, SEARCH_UINT8, SEARCH_LENGTH))
+        return NULL;
+
+    // the stripe holding the bucket is resolved by plot_bucket_view() or plot_read_buckets();
+    // a mapped plot is hashed in place
+    if (plot->maps[0] != NULL)
+        records = plot_bucket_view(plot, bucketIndex, &records_read);
+    else
+        records_read = plot_lookup_read(plot, bucketIndex, 1, buffer);
+    if (records_read > 0)
+    {
+        // print bucket contents
+        if (DEBUG)
+        {
+            for (size_t i = 0; i < records_read; ++i)
+            {
+                uint8_t hash_output[BLAKE3_OUT_LEN];
+                blake3_hasher hasher;
+                blake3_hasher_init(&hasher);
+                blake3_hasher_update(&hasher, records[i].nonce1, NONCE_SIZE);
+                blake3_hasher_update(&hasher, records[i].nonce2, NONCE_SIZE);
+                blake3_hasher_finalize(&hasher, hash_output, BLAKE3_OUT_LEN);
+
+                printf("bucket[");
+                for (size_t n = 0; n < PREFIX_SIZE; ++n)
+                    printf("%02X", SEARCH_UINT8[n]);
+                printf("][%zu] = ", i);
+                for (size_t n = 0; n < NONCE_SIZE; ++n)
+                    printf("%02X", records[i].nonce1[n]);
+                printf(" & ");
+                for (size_t n = 0; n < NONCE_SIZE; ++n)
+                    printf("%02X", records[i].nonce2[n]);
+                printf(" => ");
+                for (size_t n = 0; n < BLAKE3_OUT_LEN; ++n)
+                    printf("%02X", hash_output[n]);
+                printf("\n");
+            }
+        }
+
+        // the bucket search of the plot's layout hashes as many bytes as the key has, up to BLAKE3_OUT_LEN
+        foundRecord = plot->search(records, records_read, SEARCH_UINT8, SEARCH_LENGTH);
+    }
+    else if (!plot->compact) // an empty bucket of a compact file has nothing to read
+    {
+        printf("error reading from file..\n");
+    }
+    if (foundRecord == NULL)
+        plot_filter_miss(plot, SEARCH_LENGTH);
+    return foundRecord;
+}
+
+#define QUERY_MAX_BYTES BLAKE3_OUT_LEN
+#define RANGE_FIRST_READ_BYTES (64 * 1024) // a range query's first read; each next one is twice as large,
+#define RANGE_READ_BYTES (8 * 1024 * 1024) // up to this, so a query that stops early reads little
+
+// A prefix query resolved to the buckets it can be in: a prefix of at least PREFIX_SIZE bytes falls in one
+// bucket, a shorter one in the contiguous range of buckets whose index starts with its bits
+typedef struct
+{
+    uint8_t key[QUERY_MAX_BYTES];
+    size_t key_bits;
+    unsigned long long first_bucket;
+    unsigned long long num_buckets;
+} QueryPlan;
+
+// Function to plan a query for the first key_bits bits of key
+void plan_query(const uint8_t *key, size_t key_bits, QueryPlan *plan)
+{
+    size_t prefix_bits = PREFIX_SIZE * 8;
+    key_bits = min(key_bits, (size_t)QUERY_MAX_BYTES * 8);
+    memset(plan->key, 0, sizeof(plan->key));
+    memcpy(plan->key, key, (key_bits + 7) / 8);
+    if (key_bits % 8 != 0)
+        plan->key[key_bits / 8] &= (uint8_t)(0xFF << (8 - key_bits % 8));
+    plan->key_bits = key_bits;
+
+    // the bucket index of the key with its missing bits all zero, and the number of indexes it can end with
+    size_t fixed_bits = min(key_bits, prefix_bits);
+    plan->first_bucket = getBucketIndex(plan->key, PREFIX_SIZE);
+    plan->num_buckets = 1ULL << (prefix_bits - fixed_bits);
+}
+
+// Function to parse a query given as hex digits, each worth 4 bits, optionally followed by /BITS to
+// keep fewer bits (e.g. "a8/5"); returns -1 if it is not a usable prefix
+int parse_query(const char *text, QueryPlan *plan)
+{
+    uint8_t key[QUERY_MAX_BYTES];
+    memset(key, 0, sizeof(key));
+    size_t digits = strcspn(text, "/");
+    if (digits == 0 || digits > QUERY_MAX_BYTES * 2)
+        return -1;
+    for (size_t i = 0; i < digits; i++)
+    {
+        char c = text[i];
+        int v = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+                                               : (c >= 'A' && c <= 'F')   ? c - 'A' + 10
+                                                                          : -1;
+        if (v < 0)
+            return -1;
+        key[i / 2] |= i % 2 == 0 ? v << 4 : v;
+    }
+
+    size_t key_bits = digits * 4;
+    if (text[digits] == '/')
+    {
+        char *end;
+        long bits = strtol(text + digits + 1, &end, 10);
+        if (*end != '\0' || bits < 1 || (size_t)bits > key_bits)
+            return -1;
+        key_bits = bits;
+    }
+    plan_query(key, key_bits, plan);
+    return 0;
+}
+
+// Function to test whether a hash starts with the first key_bits bits of key
+bool hash_has_prefix(const uint8_t *hash, const uint8_t *key, size_t key_bits)
+{
+    if (memcmp(hash, key, key_bits / 8) != 0)
+        return false;
+    if (key_bits % 8 == 0)
+        return true;
+    uint8_t mask = (uint8_t)(0xFF << (8 - key_bits % 8));
+    return (hash[key_bits / 8] & mask) == key[key_bits / 8];
+}
+
+/**
+ * search_range:
+ *   - Answers a planned query by scanning its buckets in order with reads growing to RANGE_READ_BYTES,
+ *     so a short prefix costs a few large sequential reads instead of a read per bucket.
+ *   - Stops at the first limit matches, which come in bucket (hash) order.
+ *
+ * @param plot         Open plot; read with plot_read_buckets() even when mapped.
+ * @param plan         Query planned by plan_query().
+ * @param limit        Matches wanted at most (at least 1).
+ * @param matches      Receives up to limit matching records.
+ * @param records_read Receives the records read (empty slots included), or NULL.
+ * @return Number of matches.
+ */
+size_t search_range(const PlotFile *plot, const QueryPlan *plan, size_t limit, MemoRecord2 *matches, unsigned long long *records_read)
+{
+    if (records_read != NULL)
+        *records_read = 0;
+    if (!plot_may_contain(plot, plan->key, plan->key_bits / 8))
+        return 0;
+
+    unsigned long long bucket_bytes = max(plot->num_records_in_bucket, 1ULL) * sizeof(MemoRecord2);
+    unsigned long long max_buckets = min(max(1ULL, RANGE_READ_BYTES / bucket_bytes), plan->num_buckets);
+    unsigned long long chunk_buckets = min(max(1ULL, RANGE_FIRST_READ_BYTES / bucket_bytes), max_buckets);
+    MemoRecord2 *buffer = (MemoRecord2 *)malloc(max_buckets * bucket_bytes);
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t hash_output[QUERY_MAX_BYTES];
+    size_t hash_length = max((plan->key_bits + 7) / 8, (size_t)1);
+    FingerprintFilter filter = fingerprint_filter(plan->key, plan->key_bits / 8);
+    size_t found = 0;
+    unsigned long long end = plan->first_bucket + plan->num_buckets;
+    for (unsigned long long bucket = plan->first_bucket; bucket < end && found < limit;)
+    {
+        size_t count = plot_lookup_read(plot, bucket, min(chunk_buckets, end - bucket), buffer);
+        bucket += chunk_buckets;
+        chunk_buckets = min(chunk_buckets * 2, max_buckets);
+        if (records_read != NULL)
+            *records_read += count;
+        for (size_t i = 0; i < count && found < limit; i++)
+        {
+            if (!fingerprint_pass(&buffer[i], filter) || !is_nonce_nonzero(buffer[i].nonce1, NONCE_SIZE) || !is_nonce_nonzero(buffer[i].nonce2, NONCE_SIZE))
+                continue;
+
+            blake3_hasher hasher;
+            blake3_hasher_init(&hasher);
+            blake3_hasher_update(&hasher, buffer[i].nonce1, NONCE_SIZE);
+            blake3_hasher_update(&hasher, buffer[i].nonce2, NONCE_SIZE);
+            blake3_hasher_finalize(&hasher, hash_output, hash_length);
+            if (hash_has_prefix(hash_output, plan->key, plan->key_bits))
+                matches[found++] = buffer[i];
+        }
+    }
+    free(buffer);
+
+    if (found == 0)
+        plot_filter_miss(plot, plan->key_bits / 8);
+    return found;
+}
+
+// Function to answer a key shorter than PREFIX_SIZE bytes with its first match over the buckets it spans
+bool search_short_key(const PlotFile *plot, const uint8_t *key, size_t key_length, MemoRecord2 *result)
+{
+    QueryPlan plan;
+    plan_query(key, key_length * 8, &plan);
+    return search_range(plot, &plan, 1, result, NULL) == 1;
+}
+
+/**
+ * search_memo_records:
+ *   - Answers one query (-s): hex digits, optionally /BITS, planned by parse_query().
+ *   - A whole-byte prefix of at least PREFIX_SIZE bytes with --limit 1 is one bucket lookup;
+ *     anything else (a short or odd-length prefix, or more than one match wanted) is a range
+ *     query that prints up to --limit matches in hash order.
+ */
+void search_memo_records(const StripeSet *set, const char *SEARCH_STRING)
+{
+    QueryPlan plan;
+    if (parse_query(SEARCH_STRING, &plan) != 0)
+    {
+        fprintf(stderr, "Error: %s is not a hex prefix (HEX or HEX/BITS).\n", SEARCH_STRING);
+        return;
+    }
+    bool single = plan.key_bits % 8 == 0 && plan.key_bits >= PREFIX_SIZE * 8 && SEARCH_LIMIT == 1;
+
+    PlotFile plot;
+    // Open every stripe of the file for reading, map it once and load its filter if asked to
+    if (plot_open(&plot, set) != 0)
+    {
+        return;
+    }
+    if (SEARCH_MMAP && plot_map(&plot) != 0)
+    {
+        plot_close(&plot);
+        return;
+    }
+    if (FILTER)
+        plot_load_filter(&plot);
+    if (COLD)
+        plot_make_cold(&plot);
+
+    if (!BENCHMARK)
+    {
+        for (size_t s = 0; s < plot.num_stripes; s++)
+            printf("SEARCH: filename=%s\n", plot.paths[s]);
+        printf("SEARCH: filesize=%ld\n", plot.filesize);
+        printf("SEARCH: K=%d rounds=%llu layout=%s%s\n", plot.k, plot.rounds, plot.compact ? "compact" : "fixed", plot.sorted ? " sorted" : "");
+        printf("SEARCH: num_buckets=%llu\n", plot.num_buckets);
+        printf("SEARCH: num_records_in_bucket=%llu\n", plot.num_records_in_bucket);
+        printf("SEARCH: SEARCH_STRING=%s\n", SEARCH_STRING);
+        if (!single)
+            printf("SEARCH: %zu bit prefix, buckets %llu to %llu, limit %zu\n", plan.key_bits, plan.first_bucket,
+                   plan.first_bucket + plan.num_buckets - 1, SEARCH_LIMIT);
+    }
+
+    // Allocate memory for a bucket, or for the matches of a range query
+    size_t capacity = single ? plot.num_records_in_bucket : min(SEARCH_LIMIT, plan.num_buckets * plot.num_records_in_bucket);
+    MemoRecord2 *buffer = (MemoRecord2 *)malloc(max(capacity, (size_t)1) * sizeof(MemoRecord2));
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        plot_close(&plot);
+        return;
+    }
+
+    // Start walltime measurement
+    double start_time = omp_get_wtime();
+
+    const MemoRecord2 *matches = buffer;
+    size_t num_matches = 0;
+    unsigned long long records_read = 0;
+    if (single)
+    {
+        matches = search_memo_record(&plot, plan.first_bucket, plan.key, plan.key_bits / 8, buffer);
+        num_matches = matches != NULL ? 1 : 0;
+    }
+    else
+    {
+        num_matches = search_range(&plot, &plan, capacity, buffer, &records_read);
+    }
+
+    double elapsed_time = (omp_get_wtime() - start_time) * 1000.0;
+
+    for (size_t m = 0; m < num_matches; m++)
+    {
+        printf("NONCE found (");
+        for (int i = 0; i < NONCE_SIZE; i++)
+            printf("%02X", matches[m].nonce1[i]);
+        printf(", ");
+        for (int i = 0; i < NONCE_SIZE; i++)
+            printf("%02X", matches[m].nonce2[i]);
+        printf(") for HASH prefix %s\n", SEARCH_STRING);
+    }
+    if (num_matches == 0)
+        printf("no NONCE found for HASH prefix %s\n", SEARCH_STRING);
+    if (!single)
+        printf("found %zu matches, read %llu records (%.2f MB)\n", num_matches, records_read, records_read * sizeof(MemoRecord2) / (1024.0 * 1024.0));
+    printf("search time %.3f ms\n", elapsed_time);
+    if (!BENCHMARK)
+        plot_report_filter(&plot, stdout);
+
+    // Clean up; the record found may point into the mapping
+    plot_close(&plot);
+    free(buffer);
+}
+
+// Log-linear (HDR style) latency histogram: 32 sub-buckets per power of two of nanoseconds, so any
+// percentile is exact to within 3.2%; one per thread, merged when read
+#define LATENCY_SUB_BITS 5
+#define LATENCY_BUCKETS (64 << LATENCY_SUB_BITS)
+
+typedef struct
+{
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t total;
+    uint64_t max_ns;
+} LatencyHistogram;
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void latency_record(LatencyHistogram *h, uint64_t ns)
+{
+    size_t index = ns;
+    if (ns >= (1ULL << LATENCY_SUB_BITS))
+    {
+        int shift = 63 - __builtin_clzll(ns) - LATENCY_SUB_BITS;
+        index = ((size_t)(shift + 1) << LATENCY_SUB_BITS) + ((ns >> shift) & ((1ULL << LATENCY_SUB_BITS) - 1));
+    }
+    h->counts[index]++;
+    h->total++;
+    if (ns > h->max_ns)
+        h->max_ns = ns;
+}
+
+void latency_merge(LatencyHistogram *into, const LatencyHistogram *from)
+{
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++)
+        into->counts[i] += from->counts[i];
+    into->total += from->total;
+    into->max_ns = max(into->max_ns, from->max_ns);
+}
+
+// Function to return the latency under which a fraction p of the samples fall (upper edge of its bucket)
+uint64_t latency_percentile(const LatencyHistogram *h, double p)
+{
+    if (h->total == 0)
+        return 0;
+    uint64_t rank = (uint64_t)ceil(p * h->total);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if (seen >= max(rank, 1))
+        {
+            if (i < (1 << LATENCY_SUB_BITS))
+                return i;
+            int shift = (i >> LATENCY_SUB_BITS) - 1;
+            uint64_t mantissa = (i & ((1 << LATENCY_SUB_BITS) - 1)) + (1 << LATENCY_SUB_BITS);
+            return min(((mantissa + 1) << shift) - 1, h->max_ns);
+        }
+    }
+    return h->max_ns;
+}
+
+// Function to print the percentiles of a histogram on one line
+void latency_report(const char *name, const LatencyHistogram *h, FILE *out)
+{
+    fprintf(out, "LATENCY: %-6s p50 %.2f us, p90 %.2f us, p99 %.2f us, max %.2f us\n", name, latency_percentile(h, 0.50) / 1000.0,
+            latency_percentile(h, 0.90) / 1000.0, latency_percentile(h, 0.99) / 1000.0, h->max_ns / 1000.0);
+}
+
+// Latencies of the lookups of a batch: whole, and split into getting the bucket (the read; a mapped plot
+// faults its pages in while it is searched, so that lands in hash) and searching it
+typedef struct
+{
+    LatencyHistogram lookup;
+    LatencyHistogram io;
+    LatencyHistogram hash;
+} SearchLatency;
+
+// A query of a batch, in the order its bucket is laid out on disk
+typedef struct
+{
+    uint64_t bucket;
+    uint64_t query;
+} LookupOrder;
+
+int compare_lookup_order(const void *a, const void *b)
+{
+    const LookupOrder *x = (const LookupOrder *)a;
+    const LookupOrder *y = (const LookupOrder *)b;
+    if (x->bucket != y->bucket)
+        return x->bucket < y->bucket ? -1 : 1;
+    return x->query < y->query ? -1 : (x->query > y->query ? 1 : 0);
+}
+
+/**
+ * search_batch:
+ *   - Looks up num_queries keys at once. The queries are sorted by bucket, which is also
+ *     stripe and file offset order, so reads sweep each device in one direction.
+ *   - Whole queries are spread over the threads in contiguous runs of that order; each
+ *     query is answered by one thread with the plot's search kernel.
+ *
+ * @param plot        Open plot, mapped or not.
+ * @param keys        num_queries keys, one every key_stride bytes.
+ * @param key_stride  Bytes between keys; also the key length when key_lengths is NULL.
+ * @param key_lengths Bytes of hash prefix each key must match, or NULL; a length of 0 skips the query,
+ *                    and one under PREFIX_SIZE is answered by search_short_key().
+ * @param num_queries Number of keys.
+ * @param results     Receives the matching record of each query found.
+ * @param found       Receives whether each query was found.
+ * @param latency     Receives the latency of every lookup, or NULL; with COLD the stripe a lookup
+ *                    read is evicted after it, outside the timing.
+ * @return Number of queries found.
+ */
+size_t search_batch(const PlotFile *plot, const uint8_t *keys, size_t key_stride, const uint8_t *key_lengths, size_t num_queries, MemoRecord2 *results, bool *found,
+                    SearchLatency *latency)
+{
+    LookupOrder *order = (LookupOrder *)malloc(num_queries * sizeof(LookupOrder));
+    if (order == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for %zu queries.\n", num_queries);
+        return 0;
+    }
+    for (size_t q = 0; q < num_queries; q++)
+    {
+        size_t key_length = key_lengths != NULL ? key_lengths[q] : key_stride;
+        QueryPlan plan;
+        if (key_length < PREFIX_SIZE)
+            plan_query(&keys[q * key_stride], key_length * 8, &plan);
+        order[q].bucket = key_length < PREFIX_SIZE ? plan.first_bucket : (uint64_t)getBucketIndex(&keys[q * key_stride], PREFIX_SIZE);
+        order[q].query = q;
+    }
+    qsort(order, num_queries, sizeof(LookupOrder), compare_lookup_order);
+
+    size_t found_count = 0;
+#pragma omp parallel reduction(+ : found_count)
+    {
+        SearchLatency *mine = latency != NULL ? (SearchLatency *)calloc(1, sizeof(SearchLatency)) : NULL;
+        MemoRecord2 *buffer = NULL;
+        if (plot->maps[0] == NULL)
+        {
+            buffer = (MemoRecord2 *)malloc(plot->num_records_in_bucket * sizeof(MemoRecord2));
+            if (buffer == NULL)
+            {
+                fprintf(stderr, "Error: Unable to allocate memory.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+#pragma omp for schedule(dynamic, 64)
+        for (size_t i = 0; i < num_queries; i++)
+        {
+            size_t q = order[i].query;
+            size_t key_length = key_lengths != NULL ? key_lengths[q] : key_stride;
+            found[q] = false;
+            if (key_length == 0)
+                continue;
+            // a short key spans a range of buckets, its read and search are not told apart
+            uint64_t start = now_ns();
+            if (key_length < PREFIX_SIZE)
+            {
+                found[q] = search_short_key(plot, &keys[q * key_stride], key_length, &results[q]);
+                found_count += found[q];
+                if (mine != NULL)
+                    latency_record(&mine->lookup, now_ns() - start);
+                for (size_t s = 0; COLD && s < plot->num_stripes; s++)
+                    plot_evict(plot, s);
+                continue;
+            }
+            if (!plot_may_contain(plot, &keys[q * key_stride], key_length))
+            {
+                if (mine != NULL)
+                    latency_record(&mine->lookup, now_ns() - start);
+                continue;
+            }
+
+            const MemoRecord2 *records = buffer;
+            size_t count;
+            if (buffer == NULL)
+                records = plot_bucket_view(plot, order[i].bucket, &count);
+            else
+                count = plot_lookup_read(plot, order[i].bucket, 1, buffer);
+            uint64_t read_done = now_ns();
+
+            const MemoRecord2 *record = plot->search(records, count, &keys[q * key_stride], key_length);
+            if (mine != NULL)
+            {
+                uint64_t done = now_ns();
+                latency_record(&mine->lookup, done - start);
+                latency_record(&mine->io, read_done - start);
+                latency_record(&mine->hash, done - read_done);
+            }
+            if (COLD)
+                plot_evict(plot, plot_stripe_of_bucket(plot, order[i].bucket));
+            found[q] = record != NULL;
+            if (record != NULL)
+            {
+                results[q] = *record;
+                found_count++;
+            }
+            else
+            {
+                plot_filter_miss(plot, key_length);
+            }
+        }
+        free(buffer);
+        if (mine != NULL)
+        {
+#pragma omp critical
+            {
+                latency_merge(&latency->lookup, &mine->lookup);
+                latency_merge(&latency->io, &mine->io);
+                latency_merge(&latency->hash, &mine->hash);
+            }
+            free(mine);
+        }
+    }
+
+    free(order);
+    return found_count;
+}
+
+// Function to look up num_lookups random prefixes of search_size bytes with the batch engine
+void search_memo_records_batch(const StripeSet *set, int num_lookups, int search_size)
+{
+    // Seed the random number generator with the current time
+    srand((unsigned int)time(NULL));
+
+    PlotFile plot;
+
+    // Open every stripe of the file for reading, map it once and load its filter if asked to
+    if (plot_open(&plot, set) != 0)
+    {
+        return;
+    }
+    if (SEARCH_MMAP && plot_map(&plot) != 0)
+    {
+        plot_close(&plot);
+        return;
+    }
+    if (FILTER)
+        plot_load_filter(&plot);
+    if (COLD)
+        plot_make_cold(&plot);
+
+    if (!BENCHMARK)
+    {
+        for (size_t s = 0; s < plot.num_stripes; s++)
+            printf("SEARCH: filename=%s\n", plot.paths[s]);
+        printf("SEARCH: filesize=%ld\n", plot.filesize);
+        printf("SEARCH: K=%d rounds=%llu layout=%s%s\n", plot.k, plot.rounds, plot.compact ? "compact" : "fixed", plot.sorted ? " sorted" : "");
+        printf("SEARCH: num_buckets=%llu\n", plot.num_buckets);
+        printf("SEARCH: num_records_in_bucket=%llu\n", plot.num_records_in_bucket);
+    }
+
+    // Draw all the queries up front, so only the lookups are timed
+    uint8_t *keys = (uint8_t *)malloc((size_t)num_lookups * search_size);
+    MemoRecord2 *results = (MemoRecord2 *)malloc((size_t)num_lookups * sizeof(MemoRecord2));
+    bool *found = (bool *)malloc((size_t)num_lookups * sizeof(bool));
+    if (keys == NULL || results == NULL || found == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        plot_close(&plot);
+        return;
+    }
+    for (size_t i = 0; i < (size_t)num_lookups * search_size; ++i)
+    {
+        keys[i] = rand() % 256;
+    }
+
+    SearchLatency *latency = (SearchLatency *)calloc(1, sizeof(SearchLatency));
+    if (latency == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        plot_close(&plot);
+        return;
+    }
+
+    // Start walltime measurement
+    double start_time = omp_get_wtime();
+
+    int foundRecords = search_batch(&plot, keys, search_size, NULL, num_lookups, results, found, latency);
+    int notFoundRecords = num_lookups - foundRecords;
+
+    double elapsed_time = (omp_get_wtime() - start_time) * 1000.0;
+    double lookups_per_second = num_lookups / (elapsed_time / 1000.0);
+    if (!BENCHMARK)
+        plot_report_filter(&plot, stdout);
+
+    // Clean up
+    plot_close(&plot);
+    free(keys);
+    free(results);
+    free(found);
+
+    // Print the total number of times the condition was met
+    if (!BENCHMARK)
+    {
+        printf("searched for %d lookups of %d bytes long, found %d, not found %d in %.2f seconds, %.4f ms per lookup, %.0f lookups/s%s\n", num_lookups, search_size, foundRecords, notFoundRecords, elapsed_time / 1000.0, elapsed_time / num_lookups, lookups_per_second, COLD ? " (cold)" : "");
+        latency_report("lookup", &latency->lookup, stdout);
+        latency_report("I/O", &latency->io, stdout);
+        latency_report("hash", &latency->hash, stdout);
+    }
+    else
+        printf("%s,%d,%d,%ld,%llu,%llu,%d,%d,%d,%d,%.2f,%.4f,%.0f,%d,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%d\n", plot.paths[0], plot.k, NUM_THREADS, plot.filesize, plot.num_buckets, plot.num_records_in_bucket, num_lookups, search_size, foundRecords, notFoundRecords, elapsed_time / 1000.0, elapsed_time / num_lookups, lookups_per_second, FINGERPRINT_BITS,
+               latency_percentile(&latency->lookup, 0.50) / 1000.0, latency_percentile(&latency->lookup, 0.90) / 1000.0, latency_percentile(&latency->lookup, 0.99) / 1000.0, latency->lookup.max_ns / 1000.0,
+               latency_percentile(&latency->io, 0.50) / 1000.0, latency_percentile(&latency->io, 0.99) / 1000.0, latency_percentile(&latency->hash, 0.50) / 1000.0, latency_percentile(&latency->hash, 0.99) / 1000.0, COLD);
+    free(latency);
+}
+
+// Function to parse len hex digits into bytes; returns the number of bytes, or -1 if the digits are not hex
+int parse_hex_key(const char *hex, size_t len, uint8_t *out, size_t out_size)
+{
+    if (len % 2 != 0 || len / 2 > out_size)
+        return -1;
+    for (size_t i = 0; i < len; i++)
+    {
+        char c = hex[i];
+        int v = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+                                               : (c >= 'A' && c <= 'F')   ? c - 'A' + 10
+                                                                          : -1;
+        if (v < 0)
+            return -1;
+        if (i % 2 == 0)
+            out[i / 2] = v << 4;
+        else
+            out[i / 2] |= v;
+    }
+    return len / 2;
+}
+
+// Function to print the answers to a chunk of queries, in the order they were read
+void print_query_results(const uint8_t *keys, const uint8_t *key_lengths, size_t num_queries, const MemoRecord2 *results, const bool *found)
+{
+    for (size_t q = 0; q < num_queries; q++)
+    {
+        const uint8_t *key = &keys[q * QUERY_MAX_BYTES];
+        for (size_t n = 0; n < key_lengths[q]; n++)
+            printf("%02x", key[n]);
+        if (key_lengths[q] == 0)
+            printf("invalid\n");
+        else if (!found[q])
+            printf(" not-found\n");
+        else
+        {
+            printf(" ");
+            for (size_t n = 0; n < NONCE_SIZE; n++)
+                printf("%02X", results[q].nonce1[n]);
+            printf(" ");
+            for (size_t n = 0; n < NONCE_SIZE; n++)
+                printf("%02X", results[q].nonce2[n]);
+            printf("\n");
+        }
+    }
+    fflush(stdout);
+}
+
+/**
+ * search_memo_records_stream:
+ *   - Reads challenge prefixes from a file, or stdin for "-", and answers them on stdout,
+ *     one line per query in input order: "<prefix> <nonce1> <nonce2>", "<prefix> not-found",
+ *     or "invalid" for a line that is not a usable prefix.
+ *   - A prefix shorter than PREFIX_SIZE bytes gets the first match over the buckets it spans.
+ *   - Hex input has one prefix per line (blank lines and # comments are skipped); binary
+ *     input is a stream of query_bytes byte prefixes.
+ *   - Queries are answered with search_batch() as soon as they are read, in chunks of at
+ *     most in_flight queries, so a pipe gets its answers without waiting for more input.
+ *   - Totals and lookups/s (a CSV line with BENCHMARK) go to stderr, keeping stdout to the answers.
+ */
+void search_memo_records_stream(const StripeSet *set, const char *query_file, bool binary, size_t query_bytes, size_t in_flight)
+{
+    PlotFile plot;
+    if (plot_open(&plot, set) != 0)
+    {
+        return;
+    }
+    if (SEARCH_MMAP && plot_map(&plot) != 0)
+    {
+        plot_close(&plot);
+        return;
+    }
+    if (FILTER)
+        plot_load_filter(&plot);
+    if (COLD)
+        plot_make_cold(&plot);
+
+    int fd = strcmp(query_file, "-") == 0 ? STDIN_FILENO : open(query_file, O_RDONLY);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error opening query file %s: %s\n", query_file, strerror(errno));
+        plot_close(&plot);
+        return;
+    }
+
+    size_t input_size = 1 << 16;
+    char *input = (char *)malloc(input_size);
+    uint8_t *keys = (uint8_t *)malloc(in_flight * QUERY_MAX_BYTES);
+    uint8_t *key_lengths = (uint8_t *)malloc(in_flight);
+    MemoRecord2 *results = (MemoRecord2 *)malloc(in_flight * sizeof(MemoRecord2));
+    bool *found = (bool *)malloc(in_flight * sizeof(bool));
+    if (input == NULL || keys == NULL || key_lengths == NULL || results == NULL || found == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t total_queries = 0;
+    size_t total_found = 0;
+    size_t total_invalid = 0;
+    size_t pending = 0;
+    size_t have = 0;
+    bool eof = false;
+    double start_time = omp_get_wtime();
+
+    while (!eof)
+    {
+        ssize_t n = read(fd, input + have, input_size - have);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Error reading queries");
+            break;
+        }
+        eof = n == 0;
+        have += n;
+
+        // take every complete query out of the input; at end of input a last unterminated line counts too
+        size_t used = 0;
+        while (used < have)
+        {
+            uint8_t *key = &keys[pending * QUERY_MAX_BYTES];
+            if (binary)
+            {
+                if (have - used < query_bytes)
+                    break;
+                memcpy(key, input + used, query_bytes);
+                key_lengths[pending] = query_bytes;
+                used += query_bytes;
+            }
+            else
+            {
+                char *line = input + used;
+                char *newline = (char *)memchr(line, '\n', have - used);
+                if (newline == NULL && !eof)
+                    break;
+                size_t len = newline != NULL ? (size_t)(newline - line) : have - used;
+                used += len + (newline != NULL ? 1 : 0);
+
+                while (len > 0 && (line[len - 1] == '\r' || line[len - 1] == ' ' || line[len - 1] == '\t'))
+                    len--;
+                while (len > 0 && (line[0] == ' ' || line[0] == '\t'))
+                {
+                    line++;
+                    len--;
+                }
+                if (len == 0 || line[0] == '#')
+                    continue;
+
+                int bytes = parse_hex_key(line, len, key, QUERY_MAX_BYTES);
+                key_lengths[pending] = max(bytes, 0);
+            }
+            if (key_lengths[pending] == 0)
+                total_invalid++;
+
+            if (++pending == in_flight)
+            {
+                total_found += search_batch(&plot, keys, QUERY_MAX_BYTES, key_lengths, pending, results, found, NULL);
+                print_query_results(keys, key_lengths, pending, results, found);
+                total_queries += pending;
+                pending = 0;
+            }
+        }
+        memmove(input, input + used, have - used);
+        have -= used;
+
+        if (have == input_size)
+        {
+            fprintf(stderr, "Error: query line longer than %zu bytes.\n", input_size);
+            break;
+        }
+
+        // nothing more is ready; answer what was read instead of waiting to fill the chunk
+        if (pending > 0)
+        {
+            total_found += search_batch(&plot, keys, QUERY_MAX_BYTES, key_lengths, pending, results, found, NULL);
+            print_query_results(keys, key_lengths, pending, results, found);
+            total_queries += pending;
+            pending = 0;
+        }
+    }
+    if (binary && have > 0)
+        fprintf(stderr, "Warning: %zu trailing bytes do not make a whole query.\n", have);
+
+    double elapsed_time = omp_get_wtime() - start_time;
+    if (!BENCHMARK)
+        fprintf(stderr, "answered %zu queries, found %zu, not found %zu, invalid %zu in %.2f seconds, %.0f lookups/s\n",
+                total_queries, total_found, total_queries - total_found - total_invalid, total_invalid, elapsed_time, total_queries / elapsed_time);
+    else
+        fprintf(stderr, "%s,%d,%d,%ld,%llu,%llu,%zu,%s,%zu,%zu,%.2f,%.4f,%.0f\n", plot.paths[0], plot.k, NUM_THREADS, plot.filesize, plot.num_buckets, plot.num_records_in_bucket,
+                total_queries, binary ? "binary" : "hex", total_found, total_queries - total_found, elapsed_time, elapsed_time * 1000.0 / total_queries, total_queries / elapsed_time);
+    if (!BENCHMARK)
+        plot_report_filter(&plot, stderr);
+
+    if (fd != STDIN_FILENO)
+        close(fd);
+    plot_close(&plot);
+    free(input);
+    free(keys);
+    free(key_lengths);
+    free(results);
+    free(found);
+}
+
+#define PROOF_VALID 0
+#define PROOF_WRONG_PREFIX 1 // the pair's hash does not start with the challenge
+#define PROOF_NOT_PAIRED 2   // the two table1 hashes do not satisfy the pairing predicate
+#define PROOF_MALFORMED 3    // an empty nonce, or the same nonce twice
+
+// A proof to check: the challenge it answers and the table2 record given for it
+typedef struct
+{
+    uint8_t key[QUERY_MAX_BYTES];
+    uint8_t key_length;
+    uint8_t nonce1[NONCE_SIZE];
+    uint8_t nonce2[NONCE_SIZE];
+} Proof;
+
+// Function to check one proof with three single block hashes: the pair hash must start with the challenge,
+// and the table1 hashes of its nonces must pair; returns a PROOF_ status
+int verify_proof(const Proof *proof, uint64_t pairing_distance)
+{
+    if (!is_nonce_nonzero(proof->nonce1, NONCE_SIZE) || !is_nonce_nonzero(proof->nonce2, NONCE_SIZE) ||
+        memcmp(proof->nonce1, proof->nonce2, NONCE_SIZE) == 0)
+        return PROOF_MALFORMED;
+
+    // nonce1 || nonce2 as generate2Blake3() hashes it
+    uint8_t pair[2 * NONCE_SIZE];
+    uint8_t hash[QUERY_MAX_BYTES];
+    memcpy(pair, proof->nonce1, NONCE_SIZE);
+    memcpy(pair + NONCE_SIZE, proof->nonce2, NONCE_SIZE);
+    blake3_single_block(pair, sizeof(pair), hash, max((size_t)proof->key_length, (size_t)1));
+    if (memcmp(hash, proof->key, proof->key_length) != 0)
+        return PROOF_WRONG_PREFIX;
+
+    uint8_t hash1[HASH_SIZE];
+    uint8_t hash2[HASH_SIZE];
+    blake3_single_block(proof->nonce1, NONCE_SIZE, hash1, HASH_SIZE);
+    blake3_single_block(proof->nonce2, NONCE_SIZE, hash2, HASH_SIZE);
+    return hashes_pair(hash1, hash2, pairing_distance) ? PROOF_VALID : PROOF_NOT_PAIRED;
+}
+
+/**
+ * verify_proofs:
+ *   - Checks a batch of proofs over all threads with verify_proof(); every proof costs three
+ *     compressions and no I/O, so a frontend can check the answers of plotters it does not trust.
  *
- * @param SEARCH_STRING The input string to convert.
- * @return A pointer to the array of uint8_t, or NULL if allocation fails.
+ * @param proofs           Proofs to check.
+ * @param count            Number of proofs.
+ * @param pairing_distance Pairing distance of the plots they come from, 2^(64-K) (see PlotHeader).
+ * @param status           Receives the PROOF_ status of each proof.
+ * @return Number of valid proofs.
  */
-uint8_t *convert_string_to_uint8_array(const char *SEARCH_STRING)
+size_t verify_proofs(const Proof *proofs, size_t count, uint64_t pairing_distance, uint8_t *status)
 {
-    if (SEARCH_STRING == NULL)
+    size_t valid = 0;
+#pragma omp parallel for schedule(static) reduction(+ : valid)
+    for (size_t i = 0; i < count; i++)
+    {
+        status[i] = verify_proof(&proofs[i], pairing_distance);
+        valid += status[i] == PROOF_VALID;
+    }
+    return valid;
+}
+
+/**
+ * verify_proofs_file:
+ *   - Reads proofs from a file, or stdin for "-", in the format --queries answers in:
+ *     "<challenge> <nonce1> <nonce2>" in hex; not-found, invalid, blank and # lines are skipped.
+ *   - Verifies them with verify_proofs() and prints every proof that fails with the reason;
+ *     totals and proofs/s go to stderr.
+ *
+ * @return Number of proofs that failed, or -1 if the input could not be read.
+ */
+long verify_proofs_file(const char *proof_file, uint64_t pairing_distance)
+{
+    FILE *file = strcmp(proof_file, "-") == 0 ? stdin : fopen(proof_file, "r");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error opening proof file %s: %s\n", proof_file, strerror(errno));
+        return -1;
+    }
+
+    Proof *proofs = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t malformed_lines = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    while (getline(&line, &line_size, file) != -1)
+    {
+        char *saveptr = NULL;
+        char *fields[3];
+        size_t n = 0;
+        for (char *token = strtok_r(line, " \t\r\n", &saveptr); token != NULL && n < 3; token = strtok_r(NULL, " \t\r\n", &saveptr))
+            fields[n++] = token;
+        if (n == 0 || fields[0][0] == '#' || strcmp(fields[0], "invalid") == 0 || (n == 2 && strcmp(fields[1], "not-found") == 0))
+            continue;
+
+        if (count == capacity)
+        {
+            capacity = capacity == 0 ? 1 << 16 : capacity * 2;
+            Proof *grown = (Proof *)realloc(proofs, capacity * sizeof(Proof));
+            if (grown == NULL)
+            {
+                fprintf(stderr, "Error: Unable to allocate memory.\n");
+                exit(EXIT_FAILURE);
+            }
+            proofs = grown;
+        }
+        Proof *proof = &proofs[count];
+        int key_length = n == 3 ? parse_hex_key(fields[0], strlen(fields[0]), proof->key, QUERY_MAX_BYTES) : -1;
+        if (key_length < 1 || parse_hex_key(fields[1], strlen(fields[1]), proof->nonce1, NONCE_SIZE) != NONCE_SIZE ||
+            parse_hex_key(fields[2], strlen(fields[2]), proof->nonce2, NONCE_SIZE) != NONCE_SIZE)
+        {
+            malformed_lines++;
+            continue;
+        }
+        proof->key_length = key_length;
+        count++;
+    }
+    free(line);
+    if (file != stdin)
+        fclose(file);
+
+    uint8_t *status = (uint8_t *)malloc(max(count, (size_t)1));
+    if (status == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    double start_time = omp_get_wtime();
+    size_t valid = verify_proofs(proofs, count, pairing_distance, status);
+    double elapsed_time = omp_get_wtime() - start_time;
+
+    static const char *reasons[] = {"valid", "wrong-prefix", "not-paired", "malformed"};
+    size_t failed[4] = {0};
+    for (size_t i = 0; i < count; i++)
+    {
+        failed[status[i]]++;
+        if (status[i] == PROOF_VALID)
+            continue;
+        for (size_t b = 0; b < proofs[i].key_length; b++)
+            printf("%02x", proofs[i].key[b]);
+        printf(" ");
+        for (size_t b = 0; b < NONCE_SIZE; b++)
+            printf("%02X", proofs[i].nonce1[b]);
+        printf(" ");
+        for (size_t b = 0; b < NONCE_SIZE; b++)
+            printf("%02X", proofs[i].nonce2[b]);
+        printf(" %s\n", reasons[status[i]]);
+    }
+    fflush(stdout);
+
+    if (!BENCHMARK)
+        fprintf(stderr, "VERIFY: %zu proofs, %zu valid, %zu wrong prefix, %zu not paired, %zu malformed (and %zu unreadable lines) in %.3f seconds, %.2f M proofs/s\n",
+                count, valid, failed[PROOF_WRONG_PREFIX], failed[PROOF_NOT_PAIRED], failed[PROOF_MALFORMED], malformed_lines, elapsed_time,
+                count / max(elapsed_time, 1e-9) / 1e6);
+    else
+        fprintf(stderr, "%s,%d,%zu,%zu,%zu,%zu,%zu,%.6f,%.0f\n", proof_file, NUM_THREADS, count, valid, failed[PROOF_WRONG_PREFIX], failed[PROOF_NOT_PAIRED],
+                failed[PROOF_MALFORMED], elapsed_time, count / max(elapsed_time, 1e-9));
+
+    free(proofs);
+    free(status);
+    return (long)(count - valid + malformed_lines);
+}
+
+// Function to look up one key in each plot in turn; buffer is used when a plot is not mapped.
+// Returns the index of the plot that holds it, or -1
+int lookup_one(const PlotFile *plots, size_t num_plots, const uint8_t *key, size_t key_length, MemoRecord2 *buffer, MemoRecord2 *result)
+{
+    off_t bucketIndex = getBucketIndex(key, PREFIX_SIZE);
+    for (size_t p = 0; p < num_plots; p++)
+    {
+        if (key_length < PREFIX_SIZE)
+        {
+            if (search_short_key(&plots[p], key, key_length, result))
+                return p;
+            continue;
+        }
+        if (!plot_may_contain(&plots[p], key, key_length))
+            continue;
+
+        const MemoRecord2 *records = buffer;
+        size_t count;
+        if (plots[p].maps[0] != NULL)
+            records = plot_bucket_view(&plots[p], bucketIndex, &count);
+        else
+            count = plot_lookup_read(&plots[p], bucketIndex, 1, buffer);
+
+        const MemoRecord2 *record = plots[p].search(records, count, key, key_length);
+        if (record != NULL)
+        {
+            *result = *record;
+            return p;
+        }
+        plot_filter_miss(&plots[p], key_length);
+    }
+    return -1;
+}
+
+// Function to read exactly len bytes from a socket; returns false if it closed first
+bool read_full(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = read(fd, (uint8_t *)buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+// Function to write exactly len bytes to a socket; returns false if it failed first
+bool write_full(int fd, const void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = write(fd, (const uint8_t *)buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+// Wire format of --serve, fixed size structs in host byte order (clients run on the same machine).
+// A connection carries any number of requests back to back; each gets one reply, in order.
+#define SERVE_OP_LOOKUP 1 // reply: ServeResponse
+#define SERVE_OP_STATS 2  // reply: ServeStats
+
+#define SERVE_NOT_FOUND 0
+#define SERVE_FOUND 1
+#define SERVE_INVALID 2
+
+typedef struct
+{
+    uint8_t op;
+    uint8_t key_length; // bytes of key to match, 1 to QUERY_MAX_BYTES
+    uint16_t reserved;
+    uint32_t id; // echoed in the reply
+    uint8_t key[QUERY_MAX_BYTES];
+} ServeRequest;
+
+typedef struct
+{
+    uint32_t id;
+    uint8_t status;
+    uint8_t plot; // index of the plot that holds the record
+    uint16_t reserved;
+    MemoRecord2 record;
+} ServeResponse;
+
+typedef struct
+{
+    uint64_t lookups;
+    uint64_t found;
+    uint64_t invalid;
+    uint64_t p50_ns; // time from a request being read to its reply being ready
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+} ServeStats;
+
+#define SERVE_QUEUE 64    // accepted connections waiting for a worker
+#define SERVE_PIPELINE 64 // requests read and answered together on a connection
+
+volatile sig_atomic_t serve_stop = 0;
+
+void serve_signal(int sig)
+{
+    (void)sig;
+    serve_stop = 1;
+}
+
+typedef struct
+{
+    const PlotFile *plots;
+    size_t num_plots;
+    size_t num_workers;
+    LatencyHistogram *histograms; // one per worker
+    uint64_t *found;              // one per worker
+    uint64_t *invalid;            // one per worker
+    int *active;                  // connection each worker serves, -1 if none
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    int queue[SERVE_QUEUE];
+    size_t head;
+    size_t queued;
+} Server;
+
+// Function to add up the counters of all workers; they keep counting meanwhile, which only blurs the snapshot
+void server_stats(Server *server, ServeStats *stats)
+{
+    LatencyHistogram *merged = (LatencyHistogram *)calloc(1, sizeof(LatencyHistogram));
+    memset(stats, 0, sizeof(ServeStats));
+    if (merged == NULL)
+        return;
+    for (size_t w = 0; w < server->num_workers; w++)
+    {
+        latency_merge(merged, &server->histograms[w]);
+        stats->found += server->found[w];
+        stats->invalid += server->invalid[w];
+    }
+    stats->lookups = merged->total;
+    stats->p50_ns = latency_percentile(merged, 0.50);
+    stats->p90_ns = latency_percentile(merged, 0.90);
+    stats->p99_ns = latency_percentile(merged, 0.99);
+    stats->p999_ns = latency_percentile(merged, 0.999);
+    stats->max_ns = merged->max_ns;
+    free(merged);
+}
+
+// Function to answer the requests of one connection until the client hangs up or the server stops
+void serve_connection(Server *server, size_t w, int fd, MemoRecord2 *buffer)
+{
+    ServeRequest requests[SERVE_PIPELINE];
+    uint8_t replies[SERVE_PIPELINE * max(sizeof(ServeResponse), sizeof(ServeStats))];
+    size_t have = 0;
+
+    while (!serve_stop)
+    {
+        ssize_t n = read(fd, (uint8_t *)requests + have, sizeof(requests) - have);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        have += n;
+
+        size_t num_requests = have / sizeof(ServeRequest);
+        size_t reply_bytes = 0;
+        for (size_t i = 0; i < num_requests; i++)
+        {
+            const ServeRequest *request = &requests[i];
+            if (request->op == SERVE_OP_STATS)
+            {
+                ServeStats stats;
+                server_stats(server, &stats);
+                memcpy(replies + reply_bytes, &stats, sizeof(stats));
+                reply_bytes += sizeof(stats);
+                continue;
+            }
+
+            uint64_t start = now_ns();
+            ServeResponse response;
+            memset(&response, 0, sizeof(response));
+            response.id = request->id;
+            if (request->op != SERVE_OP_LOOKUP || request->key_length < 1 || request->key_length > QUERY_MAX_BYTES)
+            {
+                response.status = SERVE_INVALID;
+                server->invalid[w]++;
+            }
+            else
+            {
+                int p = lookup_one(server->plots, server->num_plots, request->key, request->key_length, buffer, &response.record);
+                response.status = p >= 0 ? SERVE_FOUND : SERVE_NOT_FOUND;
+                response.plot = p >= 0 ? p : 0;
+                if (p >= 0)
+                    server->found[w]++;
+            }
+            memcpy(replies + reply_bytes, &response, sizeof(response));
+            reply_bytes += sizeof(response);
+            latency_record(&server->histograms[w], now_ns() - start);
+        }
+
+        if (!write_full(fd, replies, reply_bytes))
+            break;
+        memmove(requests, (uint8_t *)requests + num_requests * sizeof(ServeRequest), have - num_requests * sizeof(ServeRequest));
+        have -= num_requests * sizeof(ServeRequest);
+    }
+    close(fd);
+}
+
+typedef struct
+{
+    Server *server;
+    size_t w;
+} ServeWorker;
+
+// Worker of the pool: takes accepted connections off the queue and serves them one at a time
+void *serve_worker(void *arg)
+{
+    Server *server = ((ServeWorker *)arg)->server;
+    size_t w = ((ServeWorker *)arg)->w;
+
+    unsigned long long capacity = 0;
+    for (size_t p = 0; p < server->num_plots; p++)
+        capacity = max(capacity, server->plots[p].num_records_in_bucket);
+    MemoRecord2 *buffer = (MemoRecord2 *)malloc(max(capacity, 1) * sizeof(MemoRecord2));
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (true)
+    {
+        pthread_mutex_lock(&server->lock);
+        while (server->queued == 0 && !serve_stop)
+            pthread_cond_wait(&server->ready, &server->lock);
+        if (server->queued == 0)
+        {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+        int fd = server->queue[server->head];
+        server->head = (server->head + 1) % SERVE_QUEUE;
+        server->queued--;
+        server->active[w] = fd;
+        pthread_mutex_unlock(&server->lock);
+
+        serve_connection(server, w, fd, buffer);
+
+        pthread_mutex_lock(&server->lock);
+        server->active[w] = -1;
+        pthread_mutex_unlock(&server->lock);
+    }
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * serve_plots:
+ *   - Keeps the given plots open (mapped with --mmap) and answers lookups on a Unix socket
+ *     until SIGINT or SIGTERM; see ServeRequest for the wire format.
+ *   - A pool of num_workers threads serves the accepted connections, one connection per
+ *     worker at a time, so the pool size bounds the concurrent clients being served.
+ *   - Each worker keeps its own counters and latency histogram; a STATS request or the
+ *     shutdown report merges them into p50/p90/p99/p999.
+ */
+int serve_plots(const StripeSet *sets, size_t num_plots, const char *socket_path, size_t num_workers)
+{
+    PlotFile *plots = (PlotFile *)calloc(num_plots, sizeof(PlotFile));
+    if (plots == NULL)
+        return EXIT_FAILURE;
+    for (size_t p = 0; p < num_plots; p++)
+    {
+        if (plot_open(&plots[p], &sets[p]) != 0 || (SEARCH_MMAP && plot_map(&plots[p]) != 0))
+            return EXIT_FAILURE;
+        if (FILTER && plot_load_filter(&plots[p]) == 0)
+            plot_report_filter(&plots[p], stdout);
+    }
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Error: socket path %s is too long.\n", socket_path);
+        return EXIT_FAILURE;
+    }
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, SERVE_QUEUE) != 0)
     {
-        return NULL;
+        printf("Error listening on %s\n", socket_path);
+        perror("Error listening on socket");
+        return EXIT_FAILURE;
     }
 
-    size_t length = strlen(SEARCH_STRING);
-    uint8_t *array = (uint8_t *)malloc(length * sizeof(uint8_t));
-    if (array == NULL)
+    Server server;
+    memset(&server, 0, sizeof(server));
+    server.plots = plots;
+    server.num_plots = num_plots;
+    server.num_workers = num_workers;
+    server.histograms = (LatencyHistogram *)calloc(num_workers, sizeof(LatencyHistogram));
+    server.found = (uint64_t *)calloc(num_workers, sizeof(uint64_t));
+    server.invalid = (uint64_t *)calloc(num_workers, sizeof(uint64_t));
+    server.active = (int *)malloc(num_workers * sizeof(int));
+    pthread_t *threads = (pthread_t *)malloc(num_workers * sizeof(pthread_t));
+    ServeWorker *args = (ServeWorker *)malloc(num_workers * sizeof(ServeWorker));
+    if (server.histograms == NULL || server.found == NULL || server.invalid == NULL || server.active == NULL || threads == NULL || args == NULL)
     {
-        // Memory allocation failed
-        return NULL;
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        return EXIT_FAILURE;
     }
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.ready, NULL);
 
-    for (size_t i = 0; i < length; ++i)
+    signal(SIGINT, serve_signal);
+    signal(SIGTERM, serve_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (size_t w = 0; w < num_workers; w++)
     {
-        array[i] = (uint8_t)SEARCH_STRING[i];
+        server.active[w] = -1;
+        args[w].server = &server;
+        args[w].w = w;
+        pthread_create(&threads[w], NULL, serve_worker, &args[w]);
     }
 
-    return array;
+    if (!BENCHMARK)
+        printf("SERVE: %zu plot(s) on %s with %zu workers%s\n", num_plots, socket_path, num_workers, SEARCH_MMAP ? ", mapped" : "");
+    fflush(stdout);
+
+    while (!serve_stop)
+    {
+        // wake up now and then to notice a stop request
+        struct pollfd pfd = {listen_fd, POLLIN, 0};
+        if (poll(&pfd, 1, 200) <= 0)
+            continue;
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1)
+            continue;
+
+        pthread_mutex_lock(&server.lock);
+        if (server.queued == SERVE_QUEUE)
+        {
+            pthread_mutex_unlock(&server.lock);
+            close(fd);
+            continue;
+        }
+        server.queue[(server.head + server.queued) % SERVE_QUEUE] = fd;
+        server.queued++;
+        pthread_cond_signal(&server.ready);
+        pthread_mutex_unlock(&server.lock);
+    }
+
+    // unblock the workers: idle ones wait on the condition, busy ones in read()
+    pthread_mutex_lock(&server.lock);
+    pthread_cond_broadcast(&server.ready);
+    for (size_t w = 0; w < num_workers; w++)
+    {
+        if (server.active[w] != -1)
+            shutdown(server.active[w], SHUT_RDWR);
+    }
+    while (server.queued > 0)
+    {
+        close(server.queue[server.head]);
+        server.head = (server.head + 1) % SERVE_QUEUE;
+        server.queued--;
+    }
+    pthread_mutex_unlock(&server.lock);
+    for (size_t w = 0; w < num_workers; w++)
+        pthread_join(threads[w], NULL);
+
+    close(listen_fd);
+    unlink(socket_path);
+
+    ServeStats stats;
+    server_stats(&server, &stats);
+    printf("SERVE: %llu lookups, found %llu, invalid %llu, p50 %.2f us, p90 %.2f us, p99 %.2f us, p999 %.2f us, max %.2f us\n",
+           (unsigned long long)stats.lookups, (unsigned long long)stats.found, (unsigned long long)stats.invalid,
+           stats.p50_ns / 1000.0, stats.p90_ns / 1000.0, stats.p99_ns / 1000.0, stats.p999_ns / 1000.0, stats.max_ns / 1000.0);
+
+    for (size_t p = 0; p < num_plots; p++)
+        plot_close(&plots[p]);
+    free(plots);
+    free(server.histograms);
+    free(server.found);
+    free(server.invalid);
+    free(server.active);
+    free(threads);
+    free(args);
+    return 0;
 }
 
-uint8_t *hexStringToByteArray(const char *hexString)
+int serve_connect(const char *socket_path)
 {
-
-    size_t hexLen = strlen(hexString);
-    uint8_t *byteArray = (uint8_t *)malloc(hexLen * sizeof(uint8_t));
-    // size_t hexLen = strlen(hexString);
-    if (hexLen % 2 != 0)
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
     {
-        return NULL; // Error: Invalid hexadecimal string length
+        fprintf(stderr, "Error connecting to %s: %s\n", socket_path, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    size_t byteLen = hexLen / 2;
-    size_t byteArraySize = byteLen;
-    if (byteLen > byteArraySize)
+/**
+ * serve_client:
+ *   - Stand-in for a farming frontend: every thread opens its own connection to a --serve
+ *     socket and sends num_lookups / threads random prefixes of search_size bytes, keeping up
+ *     to depth requests in flight.
+ *   - Reports lookups/s and round trip percentiles seen by the clients, then asks the
+ *     server for its own counters.
+ */
+void serve_client(const char *socket_path, int num_lookups, int search_size, int depth)
+{
+    if (search_size < 1 || search_size > QUERY_MAX_BYTES)
     {
-        return NULL; // Error: Byte array too small
+        fprintf(stderr, "Error: lookups must be 1 to %d bytes long.\n", QUERY_MAX_BYTES);
+        return;
     }
+    depth = max(1, min(depth, 1 << 16));
 
-    for (size_t i = 0; i < byteLen; ++i)
+    int num_threads = omp_get_max_threads();
+    LatencyHistogram *histograms = (LatencyHistogram *)calloc(num_threads, sizeof(LatencyHistogram));
+    if (histograms == NULL)
+        return;
+    size_t found_records = 0;
+    size_t answered = 0;
+    double start_time = omp_get_wtime();
+
+#pragma omp parallel reduction(+ : found_records, answered)
     {
-        if (sscanf(&hexString[i * 2], "%2hhx", &byteArray[i]) != 1)
+        int t = omp_get_thread_num();
+        int fd = serve_connect(socket_path);
+        ServeRequest *requests = (ServeRequest *)calloc(depth, sizeof(ServeRequest));
+        ServeResponse *responses = (ServeResponse *)malloc(depth * sizeof(ServeResponse));
+        uint64_t *sent = (uint64_t *)malloc(depth * sizeof(uint64_t));
+        unsigned int seed = (unsigned int)time(NULL) ^ (t * 0x9e3779b9u);
+        int mine = num_lookups / num_threads + (t < num_lookups % num_threads ? 1 : 0);
+
+        for (int done = 0; fd != -1 && requests != NULL && responses != NULL && sent != NULL && done < mine;)
         {
-            return NULL; // Error: Failed to parse hexadecimal string
+            int window = min(depth, mine - done);
+            for (int i = 0; i < window; i++)
+            {
+                requests[i].op = SERVE_OP_LOOKUP;
+                requests[i].key_length = search_size;
+                requests[i].id = done + i;
+                for (int n = 0; n < search_size; n++)
+                    requests[i].key[n] = rand_r(&seed) % 256;
+                sent[i] = now_ns();
+            }
+            if (!write_full(fd, requests, window * sizeof(ServeRequest)) || !read_full(fd, responses, window * sizeof(ServeResponse)))
+            {
+                fprintf(stderr, "Error: connection to %s lost.\n", socket_path);
+                break;
+            }
+            uint64_t now = now_ns();
+            for (int i = 0; i < window; i++)
+            {
+                latency_record(&histograms[t], now - sent[responses[i].id - done]);
+                if (responses[i].status == SERVE_FOUND)
+                    found_records++;
+            }
+            answered += window;
+            done += window;
         }
+        if (fd != -1)
+            close(fd);
+        free(requests);
+        free(responses);
+        free(sent);
+    }
+    double elapsed_time = omp_get_wtime() - start_time;
+
+    for (int t = 1; t < num_threads; t++)
+        latency_merge(&histograms[0], &histograms[t]);
+    printf("CLIENT: %zu lookups of %d bytes, found %zu, in %.2f seconds, %.0f lookups/s, round trip p50 %.2f us, p99 %.2f us, p999 %.2f us\n",
+           answered, search_size, found_records, elapsed_time, answered / elapsed_time,
+           latency_percentile(&histograms[0], 0.50) / 1000.0, latency_percentile(&histograms[0], 0.99) / 1000.0, latency_percentile(&histograms[0], 0.999) / 1000.0);
+    free(histograms);
+
+    int fd = serve_connect(socket_path);
+    ServeRequest request;
+    ServeStats stats;
+    memset(&request, 0, sizeof(request));
+    request.op = SERVE_OP_STATS;
+    if (fd != -1 && write_full(fd, &request, sizeof(request)) && read_full(fd, &stats, sizeof(stats)))
+    {
+        printf("SERVER: %llu lookups, found %llu, invalid %llu, p50 %.2f us, p90 %.2f us, p99 %.2f us, p999 %.2f us, max %.2f us\n",
+               (unsigned long long)stats.lookups, (unsigned long long)stats.found, (unsigned long long)stats.invalid,
+               stats.p50_ns / 1000.0, stats.p90_ns / 1000.0, stats.p99_ns / 1000.0, stats.p999_ns / 1000.0, stats.max_ns / 1000.0);
     }
+    if (fd != -1)
+        close(fd);
+}
 
-    return byteArray;
+#define FARM_MAX_DEVICES 256
+
+// A device holding stripes of the farm, with the lookups it served
+typedef struct
+{
+    dev_t dev;
+    const char *path;         // first stripe found on it, to name it
+    size_t num_stripes;       // stripes of the farm's plots it holds
+    LatencyHistogram latency; // one bucket lookup (read and search) each
+    uint64_t finish_ns;       // when it answered its share of the current challenge
+    uint64_t slowest;         // challenges it was the last device to answer
+} FarmDevice;
+
+// The plots of a farm, open, with the device of every stripe
+typedef struct
+{
+    PlotFile *plots;
+    size_t num_plots;
+    size_t skipped;                   // plots listed but left out
+    size_t *device;                   // device of stripe s of plot p at [p * MAX_STRIPES + s]
+    unsigned long long max_bucket;    // largest bucket capacity, to size the read buffers
+    FarmDevice devices[FARM_MAX_DEVICES];
+    size_t num_devices;
+} Farm;
+
+// A challenge answered by one plot of the farm
+typedef struct
+{
+    size_t challenge;
+    size_t plot;
+    MemoRecord2 record;
+} FarmHit;
+
+int compare_stripe_sets(const void *a, const void *b)
+{
+    return strcmp(((const StripeSet *)a)->paths[0], ((const StripeSet *)b)->paths[0]);
 }
 
-MemoRecord2 *search_memo_record(FILE *file, off_t bucketIndex, uint8_t *SEARCH_UINT8, size_t SEARCH_LENGTH, unsigned long long num_records_in_bucket_search, MemoRecord2 *buffer)
+int compare_farm_hits(const void *a, const void *b)
 {
-    const int HASH_SIZE_SEARCH = 8;
-    size_t records_read;
-    // Define the offset you want to seek to
-    MemoRecord2 *foundRecord = NULL;
+    const FarmHit *x = (const FarmHit *)a;
+    const FarmHit *y = (const FarmHit *)b;
+    if (x->challenge != y->challenge)
+        return x->challenge < y->challenge ? -1 : 1;
+    return x->plot < y->plot ? -1 : x->plot > y->plot;
+}
 
-    long offset = bucketIndex * num_records_in_bucket_search * sizeof(MemoRecord2); // For example, seek to byte 1024 from the beginning
-    if (DEBUG)
-        printf("SEARCH: seek to %zu offset\n", offset);
+// Function to list the plots of a farm: the *.xx files of a directory, in name order, or the lines of a
+// manifest, each a plot given as to -j (a stripe list); blank lines and # comments are skipped
+int farm_list(const char *source, StripeSet **sets, size_t *count)
+{
+    *sets = NULL;
+    *count = 0;
+    size_t capacity = 0;
 
-    // Seek to the specified offset
-    if (fseek(file, offset, SEEK_SET) != 0)
+    struct stat st;
+    if (stat(source, &st) != 0)
     {
-        perror("Error seeking in file");
-        fclose(file);
-        return NULL;
+        printf("Error opening farm %s\n", source);
+        perror("Error opening farm");
+        return -1;
     }
 
-    records_read = fread(buffer, sizeof(MemoRecord2), num_records_in_bucket_search, file);
-    if (records_read > 0)
+    DIR *dir = NULL;
+    FILE *manifest = NULL;
+    if (S_ISDIR(st.st_mode))
+        dir = opendir(source);
+    else
+        manifest = fopen(source, "r");
+    if (dir == NULL && manifest == NULL)
     {
-        int found = 0; // Shared flag to indicate termination
+        printf("Error opening farm %s\n", source);
+        perror("Error opening farm");
+        return -1;
+    }
 
-#pragma omp parallel shared(found)
+    char *line = NULL;
+    size_t line_size = 0;
+    for (;;)
+    {
+        char *entry = NULL;
+        if (dir != NULL)
         {
-#pragma omp for
-            for (size_t i = 0; i < records_read; ++i)
+            struct dirent *d = readdir(dir);
+            if (d == NULL)
+                break;
+            size_t len = strlen(d->d_name);
+            if (len <= 3 || strcmp(d->d_name + len - 3, ".xx") != 0)
+                continue;
+            char *prefix = concat_strings(source, source[strlen(source) - 1] == '/' ? "" : "/");
+            entry = concat_strings(prefix, d->d_name);
+            free(prefix);
+            if (stat(entry, &st) != 0 || !S_ISREG(st.st_mode))
             {
-                // Check for cancellation
-#pragma omp cancellation point for
-                if (!found && is_nonce_nonzero(buffer[i].nonce1, NONCE_SIZE) && is_nonce_nonzero(buffer[i].nonce2, NONCE_SIZE))
-                {
-                    uint8_t hash_output[HASH_SIZE_SEARCH];
-
-                    // Compute Blake3 hash of the nonce
-                    blake3_hasher hasher;
-                    blake3_hasher_init(&hasher);
-                    blake3_hasher_update(&hasher, buffer[i].nonce1, NONCE_SIZE);
-                    blake3_hasher_update(&hasher, buffer[i].nonce2, NONCE_SIZE);
-                    blake3_hasher_finalize(&hasher, hash_output, HASH_SIZE_SEARCH);
-
-                    // print bucket contents
-                    if (DEBUG)
-                    {
-                        printf("bucket[");
-
-                        // printf("Search hash prefix (UINT8): ");
-                        for (size_t n = 0; n < PREFIX_SIZE; ++n)
-                            printf("%02X", SEARCH_UINT8[n]);
-                        printf("][%zu] = ", i);
-
-                        // printf("Current nonce: ");
-                        for (size_t n = 0; n < NONCE_SIZE; ++n)
-                            printf("%02X", buffer[i].nonce1[n]);
-                        printf(" & ");
-                        for (size_t n = 0; n < NONCE_SIZE; ++n)
-                            printf("%02X", buffer[i].nonce2[n]);
-                        printf(" => ");
-                        // printf("Current hash prefix: ");
-                        for (size_t n = 0; n < HASH_SIZE_SEARCH; ++n)
-                            printf("%02X", hash_output[n]);
-                        printf("\n");
-                    }
+                free(entry);
+                continue;
+            }
+        }
+        else
+        {
+            if (getline(&line, &line_size, manifest) == -1)
+                break;
+            entry = line + strspn(line, " \t");
+            entry[strcspn(entry, "\r\n")] = '\0';
+            for (size_t len = strlen(entry); len > 0 && (entry[len - 1] == ' ' || entry[len - 1] == '\t'); len--)
+                entry[len - 1] = '\0';
+            if (entry[0] == '\0' || entry[0] == '#')
+                continue;
+        }
 
-                    // printf("hash_output: ");
-                    // for (size_t n = 0; n < HASH_SIZE_SEARCH; ++n)
-                    //     printf("%02X", hash_output[n]);
-                    // printf("\n");
-                    // printf("SEARCH_UINT8: ");
-                    // for (size_t n = 0; n < SEARCH_LENGTH; ++n)
-                    //     printf("%02X", SEARCH_UINT8[n]);
-                    // printf("\n");
-                    // printf("search_length: %2.ld\n", SEARCH_LENGTH);
-
-                    // Compare the first PREFIX_SIZE bytes of the current hash to the previous hash prefix
-                    if (memcmp(hash_output, SEARCH_UINT8, SEARCH_LENGTH) == 0)
-                    {
-                        // Current hash's first PREFIX_SIZE bytes are equal to or greater than previous
-                        //++count_condition_met;
-                        // fRecord = buffer[i];
-                        // foundRecord = true;
-                        // return byteArrayToLongLong(buffer[i].nonce,NONCE_SIZE);
-                        // Signal cancellation
-
-                        foundRecord = &buffer[i];
-#pragma omp atomic write
-                        found = 1;
-
-#pragma omp cancel for
-                    }
-                    else
-                    {
-                        //++count_condition_not_met;
-
-                        /*
-                                            if (!DEBUG)
-                                            {
-                                            // Print previous hash and nonce, and current hash and nonce
-                                            //printf("Condition not met at record %zu:\n", total_records);
-                                            //printf("Search string %s\n",SEARCH_STRING);
-
-                                            printf("Search hash prefix (UINT8): ");
-                                            for (size_t n = 0; n < PREFIX_SIZE; ++n)
-                                                printf("%02X", SEARCH_UINT8[n]);
-                                            printf("\n");
-
-                                            printf("Current nonce: ");
-                                            for (size_t n = 0; n < NONCE_SIZE; ++n)
-                                                printf("%02X", buffer[i].nonce[n]);
-                                            printf("\n");
-                                            printf("Current hash prefix: ");
-                                            for (size_t n = 0; n < HASH_SIZE_SEARCH; ++n)
-                                                printf("%02X", hash_output[n]);
-                                            printf("\n");
-                                            }
-                                            */
-                    }
-                }
+        if (*count == capacity)
+        {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            StripeSet *grown = (StripeSet *)realloc(*sets, capacity * sizeof(StripeSet));
+            if (grown == NULL)
+            {
+                fprintf(stderr, "Error: Unable to allocate memory.\n");
+                return -1;
             }
+            *sets = grown;
+        }
+        StripeSet *set = &(*sets)[*count];
+        if (dir != NULL)
+        {
+            set->count = 1;
+            set->paths[0] = entry;
         }
+        else if (parse_stripe_list(entry, "memo.xx", set) != 0)
+        {
+            fprintf(stderr, "Error: bad line in farm manifest %s.\n", source);
+            free(line);
+            fclose(manifest);
+            return -1;
+        }
+        (*count)++;
+    }
+
+    if (dir != NULL)
+    {
+        closedir(dir);
+        qsort(*sets, *count, sizeof(StripeSet), compare_stripe_sets);
     }
     else
     {
-        printf("error reading from file..\n");
+        free(line);
+        fclose(manifest);
     }
-    return foundRecord;
+    if (*count == 0)
+    {
+        fprintf(stderr, "Error: no plots found in %s.\n", source);
+        return -1;
+    }
+    return 0;
 }
 
-// not sure if the search of more than PREFIX_LENGTH works
-void search_memo_records(const char *filename, const char *SEARCH_STRING)
+/**
+ * farm_open:
+ *   - Opens every plot listed for a farm, maps it and loads its filter if asked to.
+ *   - plot_open() checks each header against this build; a plot that fails it, or one listed
+ *     twice (same header checksum), is left out with a message and the rest are searched.
+ *   - Every stripe is assigned to the device (st_dev) it is on, so that each device gets
+ *     one worker and never more than one outstanding read.
+ *
+ * @return 0 if at least one plot is open, -1 otherwise.
+ */
+int farm_open(Farm *farm, const StripeSet *sets, size_t count)
 {
-    uint8_t *SEARCH_UINT8 = hexStringToByteArray(SEARCH_STRING);
-    size_t SEARCH_LENGTH = strlen(SEARCH_STRING) / 2;
-    off_t bucketIndex = getBucketIndex(SEARCH_UINT8, PREFIX_SIZE);
-    // uint8_t *SEARCH_UINT8 = convert_string_to_uint8_array(SEARCH_STRING);
-    // num_records_in_bucket
-    MemoRecord2 *buffer = NULL;
-    // size_t total_records = 0;
-    // size_t zero_nonce_count = 0;
-
-    FILE *file = NULL;
-    // uint8_t prev_hash[PREFIX_SIZE] = {0}; // Initialize previous hash prefix to zero
-    // uint8_t prev_nonce[NONCE_SIZE] = {0}; // Initialize previous nonce to zero
-    // size_t count_condition_met = 0;       // Counter for records meeting the condition
-    // size_t count_condition_not_met = 0;
-    bool foundRecord = false;
-    // MemoRecord fRecord;
-    MemoRecord2 *fRecord = NULL;
-
-    long filesize = get_file_size(filename);
-
-    if (filesize != -1)
+    memset(farm, 0, sizeof(Farm));
+    farm->plots = (PlotFile *)calloc(count, sizeof(PlotFile));
+    farm->device = (size_t *)malloc(count * MAX_STRIPES * sizeof(size_t));
+    if (farm->plots == NULL || farm->device == NULL)
     {
-        if (!BENCHMARK)
-            printf("Size of '%s' is %ld bytes.\n", filename, filesize);
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        return -1;
     }
 
-    unsigned long long num_buckets_search = 1ULL << (PREFIX_SIZE * 8);
-    unsigned long long num_records_in_bucket_search = filesize / num_buckets_search / sizeof(MemoRecord2);
-    if (!BENCHMARK)
+    for (size_t i = 0; i < count; i++)
     {
-        printf("SEARCH: filename=%s\n", filename);
-        printf("SEARCH: filesize=%zu\n", filesize);
-        printf("SEARCH: num_buckets=%llu\n", num_buckets_search);
-        printf("SEARCH: num_records_in_bucket=%llu\n", num_records_in_bucket_search);
-        printf("SEARCH: SEARCH_STRING=%s\n", SEARCH_STRING);
+        PlotFile *plot = &farm->plots[farm->num_plots];
+        if (plot_open(plot, &sets[i]) != 0)
+        {
+            farm->skipped++;
+            continue;
+        }
+
+        bool duplicate = false;
+        for (size_t q = 0; q < farm->num_plots && !plot->legacy; q++)
+        {
+            if (!farm->plots[q].legacy && farm->plots[q].id == plot->id)
+            {
+                fprintf(stderr, "Warning: %s is the same plot as %s, skipped.\n", plot->paths[0], farm->plots[q].paths[0]);
+                duplicate = true;
+                break;
+            }
+        }
+        if (duplicate || (SEARCH_MMAP && plot_map(plot) != 0))
+        {
+            plot_close(plot);
+            farm->skipped++;
+            continue;
+        }
+        if (FILTER)
+            plot_load_filter(plot);
+
+        size_t *device = &farm->device[farm->num_plots * MAX_STRIPES];
+        for (size_t s = 0; s < plot->num_stripes; s++)
+        {
+            struct stat st;
+            if (fstat(plot->fds[s], &st) != 0)
+            {
+                perror("Error getting file status");
+                return -1;
+            }
+            size_t d = 0;
+            while (d < farm->num_devices && farm->devices[d].dev != st.st_dev)
+                d++;
+            if (d == FARM_MAX_DEVICES)
+            {
+                fprintf(stderr, "Error: a farm can span at most %d devices.\n", FARM_MAX_DEVICES);
+                return -1;
+            }
+            if (d == farm->num_devices)
+            {
+                farm->devices[d].dev = st.st_dev;
+                farm->devices[d].path = plot->paths[s];
+                farm->num_devices++;
+            }
+            farm->devices[d].num_stripes++;
+            device[s] = d;
+        }
+        farm->max_bucket = max(farm->max_bucket, plot->num_records_in_bucket);
+        farm->num_plots++;
     }
 
-    // Open the file for reading in binary mode
-    file = fopen(filename, "rb");
-    if (file == NULL)
+    if (farm->num_plots == 0)
     {
-        printf("Error opening file %s (#3)\n", filename);
-
-        perror("Error opening file");
-        return;
+        fprintf(stderr, "Error: none of the %zu plots of the farm could be opened.\n", count);
+        return -1;
     }
+    return 0;
+}
 
-    // Allocate memory for the batch of MemoRecords
-    buffer = (MemoRecord2 *)malloc(num_records_in_bucket_search * sizeof(MemoRecord2));
-    if (buffer == NULL)
+void farm_close(Farm *farm)
+{
+    for (size_t p = 0; p < farm->num_plots; p++)
+        plot_close(&farm->plots[p]);
+    free(farm->plots);
+    free(farm->device);
+}
+
+/**
+ * farm_search:
+ *   - Answers challenges one after the other, the way a farmer does: each is fanned out to
+ *     all devices at once, and is answered when the last device is done with it.
+ *   - A device's worker looks the challenge up in every plot whose bucket sits on that device,
+ *     one read at a time, timing each lookup.
+ *   - Every plot that holds the key gives a hit; the device that answered last is charged
+ *     with the challenge, which is how a slow disk shows up.
+ *
+ * @param keys               Challenges, key_stride bytes apart.
+ * @param key_length         Bytes of each challenge.
+ * @param challenge_latency  Receives the time from fan-out to the last answer of each challenge.
+ * @param hits               Receives all hits, by challenge then plot; the caller frees it.
+ * @return The number of hits.
+ */
+size_t farm_search(Farm *farm, const uint8_t *keys, size_t key_stride, size_t key_length, size_t num_challenges,
+                   LatencyHistogram *challenge_latency, FarmHit **hits)
+{
+    size_t num_devices = farm->num_devices;
+    FarmHit **device_hits = (FarmHit **)calloc(num_devices, sizeof(FarmHit *));
+    size_t *device_counts = (size_t *)calloc(num_devices, sizeof(size_t));
+    size_t *device_capacity = (size_t *)calloc(num_devices, sizeof(size_t));
+    if (device_hits == NULL || device_counts == NULL || device_capacity == NULL)
     {
         fprintf(stderr, "Error: Unable to allocate memory.\n");
-        fclose(file);
-        return;
+        exit(EXIT_FAILURE);
     }
+    uint64_t start = 0;
 
-    // Start walltime measurement
-    double start_time = omp_get_wtime();
-    // double end_time = omp_get_wtime();
+#pragma omp parallel num_threads(num_devices)
+    {
+        size_t t = omp_get_thread_num();
+        size_t num_workers = omp_get_num_threads();
+        MemoRecord2 *buffer = (MemoRecord2 *)malloc(farm->max_bucket * sizeof(MemoRecord2));
+        if (buffer == NULL)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory.\n");
+            exit(EXIT_FAILURE);
+        }
 
-    fRecord = search_memo_record(file, bucketIndex, SEARCH_UINT8, SEARCH_LENGTH, num_records_in_bucket_search, buffer);
-    if (fRecord != NULL)
-        foundRecord = true;
-    else
-        foundRecord = false;
+        for (size_t c = 0; c < num_challenges; c++)
+        {
+#pragma omp single
+            start = now_ns();
+
+            // a short challenge spans a range of buckets and goes to the device of the first one
+            const uint8_t *key = &keys[c * key_stride];
+            QueryPlan plan;
+            plan_query(key, key_length * 8, &plan);
+            unsigned long long bucketIndex = plan.first_bucket;
+            bool short_key = key_length < PREFIX_SIZE;
+            // fewer threads than devices: a thread serves several devices, still one read at a time each
+            for (size_t d = t; d < num_devices; d += num_workers)
+            {
+                FarmDevice *device = &farm->devices[d];
+                for (size_t p = 0; p < farm->num_plots; p++)
+                {
+                    const PlotFile *plot = &farm->plots[p];
+                    if (farm->device[p * MAX_STRIPES + plot_stripe_of_bucket(plot, bucketIndex)] != d || (!short_key && !plot_may_contain(plot, key, key_length)))
+                        continue;
 
-    double elapsed_time = (omp_get_wtime() - start_time) * 1000.0;
+                    uint64_t lookup_start = now_ns();
+                    MemoRecord2 first_match;
+                    const MemoRecord2 *record = &first_match;
+                    if (short_key)
+                    {
+                        if (search_range(plot, &plan, 1, &first_match, NULL) == 0)
+                            record = NULL;
+                    }
+                    else
+                    {
+                        const MemoRecord2 *records = buffer;
+                        size_t count;
+                        if (plot->maps[0] != NULL)
+                            records = plot_bucket_view(plot, bucketIndex, &count);
+                        else
+                            count = plot_lookup_read(plot, bucketIndex, 1, buffer);
+                        record = plot->search(records, count, key, key_length);
+                        if (record == NULL)
+                            plot_filter_miss(plot, key_length);
+                    }
+                    latency_record(&device->latency, now_ns() - lookup_start);
+                    if (record == NULL)
+                        continue;
+                    if (device_counts[d] == device_capacity[d])
+                    {
+                        device_capacity[d] = device_capacity[d] == 0 ? 64 : device_capacity[d] * 2;
+                        device_hits[d] = (FarmHit *)realloc(device_hits[d], device_capacity[d] * sizeof(FarmHit));
+                        if (device_hits[d] == NULL)
+                        {
+                            fprintf(stderr, "Error: Unable to allocate memory.\n");
+                            exit(EXIT_FAILURE);
+                        }
+                    }
+                    FarmHit *hit = &device_hits[d][device_counts[d]++];
+                    hit->challenge = c;
+                    hit->plot = p;
+                    hit->record = *record;
+                }
+                device->finish_ns = now_ns();
+            }
 
-    // Check for reading errors
-    if (ferror(file))
-    {
-        perror("Error reading file");
+#pragma omp barrier
+#pragma omp single
+            {
+                size_t slowest = 0;
+                for (size_t d = 1; d < num_devices; d++)
+                {
+                    if (farm->devices[d].finish_ns > farm->devices[slowest].finish_ns)
+                        slowest = d;
+                }
+                farm->devices[slowest].slowest++;
+                latency_record(challenge_latency, farm->devices[slowest].finish_ns - start);
+            }
+        }
+        free(buffer);
     }
 
-    // Clean up
-    fclose(file);
-    free(buffer);
-
-    // Print the total number of times the condition was met
-    if (foundRecord == true)
+    size_t num_hits = 0;
+    for (size_t d = 0; d < num_devices; d++)
+        num_hits += device_counts[d];
+    *hits = (FarmHit *)malloc(max(num_hits, 1) * sizeof(FarmHit));
+    if (*hits == NULL)
     {
-        printf("NONCE found (");
-        for (int i = 0; i < NONCE_SIZE; i++)
-            printf("%02X", fRecord->nonce1[i]);
-        printf(", ");
-        for (int i = 0; i < NONCE_SIZE; i++)
-            printf("%02X", fRecord->nonce2[i]);
-        printf(") for HASH prefix %s\n", SEARCH_STRING);
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        exit(EXIT_FAILURE);
     }
-    else
-        printf("no NONCE found for HASH prefix %s\n", SEARCH_STRING);
-    printf("search time %.2f ms\n", elapsed_time);
-
-    // return NULL;
+    size_t n = 0;
+    for (size_t d = 0; d < num_devices; d++)
+    {
+        if (device_counts[d] > 0)
+            memcpy(&(*hits)[n], device_hits[d], device_counts[d] * sizeof(FarmHit));
+        n += device_counts[d];
+        free(device_hits[d]);
+    }
+    qsort(*hits, num_hits, sizeof(FarmHit), compare_farm_hits);
+    free(device_hits);
+    free(device_counts);
+    free(device_capacity);
+    return num_hits;
 }
 
-// not sure if the search of more than PREFIX_LENGTH works
-void search_memo_records_batch(const char *filename, int num_lookups, int search_size)
+/**
+ * search_farm:
+ *   - Searches all the plots of a farm (--farm DIR or manifest) for one challenge (-s), printing
+ *     every plot that holds it, or for num_lookups random challenges of search_size bytes (-p).
+ *   - Reports the challenge response time, and per device its lookup latency and how often it
+ *     was the one the response waited for.
+ */
+void search_farm(const char *source, const char *SEARCH_STRING, int num_lookups, int search_size)
 {
-    // Seed the random number generator with the current time
-    srand((unsigned int)time(NULL));
-
-    // uint8_t *SEARCH_UINT8 = hexStringToByteArray("000000");
-    size_t SEARCH_LENGTH = search_size;
-    // uint8_t *SEARCH_UINT8 = convert_string_to_uint8_array(SEARCH_STRING);
-    // num_records_in_bucket
-    MemoRecord2 *buffer = NULL;
-    // size_t total_records = 0;
-    // size_t zero_nonce_count = 0;
-
-    FILE *file = NULL;
-    // uint8_t prev_hash[PREFIX_SIZE] = {0}; // Initialize previous hash prefix to zero
-    // uint8_t prev_nonce[NONCE_SIZE] = {0}; // Initialize previous nonce to zero
-    // size_t count_condition_met = 0;       // Counter for records meeting the condition
-    // size_t count_condition_not_met = 0;
-    int foundRecords = 0;
-    int notFoundRecords = 0;
-    MemoRecord2 *fRecord = NULL;
-
-    long filesize = get_file_size(filename);
+    StripeSet *sets;
+    size_t num_sets;
+    Farm farm;
+    if (farm_list(source, &sets, &num_sets) != 0 || farm_open(&farm, sets, num_sets) != 0)
+        return;
 
-    if (filesize != -1)
+    size_t num_challenges = SEARCH_STRING != NULL ? 1 : (size_t)num_lookups;
+    size_t key_length = SEARCH_STRING != NULL ? strlen(SEARCH_STRING) / 2 : (size_t)search_size;
+    if (key_length < 1 || key_length > QUERY_MAX_BYTES)
     {
-        if (!BENCHMARK)
-            printf("Size of '%s' is %ld bytes.\n", filename, filesize);
+        fprintf(stderr, "Error: challenges must be 1 to %d bytes long.\n", QUERY_MAX_BYTES);
+        farm_close(&farm);
+        return;
+    }
+    uint8_t *keys;
+    if (SEARCH_STRING != NULL)
+    {
+        keys = hexStringToByteArray(SEARCH_STRING);
     }
-
-    unsigned long long num_buckets_search = 1ULL << (PREFIX_SIZE * 8);
-    unsigned long long num_records_in_bucket_search = filesize / num_buckets_search / sizeof(MemoRecord2);
-    if (!BENCHMARK)
+    else
     {
-        printf("SEARCH: filename=%s\n", filename);
-        printf("SEARCH: filesize=%zu\n", filesize);
-        printf("SEARCH: num_buckets=%llu\n", num_buckets_search);
-        printf("SEARCH: num_records_in_bucket=%llu\n", num_records_in_bucket_search);
+        srand((unsigned int)time(NULL));
+        keys = (uint8_t *)malloc(num_challenges * key_length);
+        for (size_t i = 0; keys != NULL && i < num_challenges * key_length; ++i)
+            keys[i] = rand() % 256;
     }
-
-    // Open the file for reading in binary mode
-    file = fopen(filename, "rb");
-    if (file == NULL)
+    if (keys == NULL)
     {
-        printf("Error opening file %s (#3)\n", filename);
-
-        perror("Error opening file");
+        fprintf(stderr, SEARCH_STRING != NULL ? "Error: the challenge is not a hex string.\n" : "Error: Unable to allocate memory.\n");
+        farm_close(&farm);
         return;
     }
 
-    // Allocate memory for the batch of MemoRecords
-    buffer = (MemoRecord2 *)malloc(num_records_in_bucket_search * sizeof(MemoRecord2));
-    if (buffer == NULL)
+    if (!BENCHMARK)
     {
-        fprintf(stderr, "Error: Unable to allocate memory.\n");
-        fclose(file);
-        return;
+        int k_min = farm.plots[0].k, k_max = farm.plots[0].k;
+        long filesize = 0;
+        for (size_t p = 0; p < farm.num_plots; p++)
+        {
+            k_min = min(k_min, farm.plots[p].k);
+            k_max = max(k_max, farm.plots[p].k);
+            filesize += farm.plots[p].filesize;
+        }
+        printf("FARM: %s: %zu plots (%zu skipped), K=%d..%d, %.2f GB on %zu devices\n", source, farm.num_plots, farm.skipped,
+               k_min, k_max, filesize / (1024.0 * 1024.0 * 1024.0), farm.num_devices);
+        for (size_t d = 0; d < farm.num_devices; d++)
+            printf("FARM: device %u:%u holds %zu stripes, first %s\n", major(farm.devices[d].dev), minor(farm.devices[d].dev),
+                   farm.devices[d].num_stripes, farm.devices[d].path);
     }
 
-    // Start walltime measurement
+    LatencyHistogram challenge_latency;
+    memset(&challenge_latency, 0, sizeof(challenge_latency));
+    FarmHit *hits;
     double start_time = omp_get_wtime();
+    size_t num_hits = farm_search(&farm, keys, key_length, key_length, num_challenges, &challenge_latency, &hits);
+    double elapsed_time = omp_get_wtime() - start_time;
 
-    uint8_t SEARCH_UINT8[search_size];
+    size_t answered = 0;
+    for (size_t h = 0; h < num_hits; h++)
+    {
+        if (h == 0 || hits[h].challenge != hits[h - 1].challenge)
+            answered++;
+    }
 
-    for (int i = 0; i < num_lookups; i++)
+    if (SEARCH_STRING != NULL)
     {
-        for (size_t i = 0; i < (size_t)search_size; ++i)
+        for (size_t h = 0; h < num_hits; h++)
         {
-            SEARCH_UINT8[i] = rand() % 256;
+            printf("NONCE found (");
+            for (int i = 0; i < NONCE_SIZE; i++)
+                printf("%02X", hits[h].record.nonce1[i]);
+            printf(", ");
+            for (int i = 0; i < NONCE_SIZE; i++)
+                printf("%02X", hits[h].record.nonce2[i]);
+            printf(") for HASH prefix %s in %s\n", SEARCH_STRING, farm.plots[hits[h].plot].paths[0]);
         }
-
-        fRecord = search_memo_record(file, getBucketIndex(SEARCH_UINT8, PREFIX_SIZE), SEARCH_UINT8, SEARCH_LENGTH, num_records_in_bucket_search, buffer);
-
-        if (fRecord != NULL)
-            foundRecords++;
-        else
-            notFoundRecords++;
+        if (num_hits == 0)
+            printf("no NONCE found for HASH prefix %s\n", SEARCH_STRING);
+        printf("search time %.3f ms\n", elapsed_time * 1000.0);
     }
-
-    double elapsed_time = (omp_get_wtime() - start_time) * 1000.0;
-
-    // Check for reading errors
-    if (ferror(file))
+    else if (!BENCHMARK)
     {
-        perror("Error reading file");
+        printf("FARM: %zu challenges of %zu bytes, %zu hits, %zu challenges answered, in %.2f seconds, %.0f challenges/s\n",
+               num_challenges, key_length, num_hits, answered, elapsed_time, num_challenges / elapsed_time);
     }
 
-    // Clean up
-    fclose(file);
-    free(buffer);
-
-    // Print the total number of times the condition was met
     if (!BENCHMARK)
-        printf("searched for %d lookups of %d bytes long, found %d, not found %d in %.2f seconds, %.2f ms per lookup\n", num_lookups, search_size, foundRecords, notFoundRecords, elapsed_time / 1000.0, elapsed_time / num_lookups);
+    {
+        printf("FARM: challenge response p50 %.2f us, p99 %.2f us, max %.2f us\n", latency_percentile(&challenge_latency, 0.50) / 1000.0,
+               latency_percentile(&challenge_latency, 0.99) / 1000.0, challenge_latency.max_ns / 1000.0);
+        for (size_t d = 0; d < farm.num_devices; d++)
+        {
+            const FarmDevice *device = &farm.devices[d];
+            printf("FARM: device %u:%u: %llu lookups, p50 %.2f us, p99 %.2f us, max %.2f us, answered last for %llu of %zu challenges\n",
+                   major(device->dev), minor(device->dev), (unsigned long long)device->latency.total,
+                   latency_percentile(&device->latency, 0.50) / 1000.0, latency_percentile(&device->latency, 0.99) / 1000.0,
+                   device->latency.max_ns / 1000.0, (unsigned long long)device->slowest, num_challenges);
+        }
+        if (FILTER)
+        {
+            unsigned long long checked = 0, rejected = 0;
+            for (size_t p = 0; p < farm.num_plots; p++)
+            {
+                if (farm.plots[p].filter != NULL)
+                {
+                    checked += farm.plots[p].filter->checked;
+                    rejected += farm.plots[p].filter->rejected;
+                }
+            }
+            printf("FILTER: %llu plot lookups checked, %llu rejected without I/O\n", checked, rejected);
+        }
+    }
     else
-        printf("%s,%d,%d,%zu,%llu,%llu,%d,%d,%d,%d,%.2f,%.2f\n", filename, K, NUM_THREADS, filesize, num_buckets_search, num_records_in_bucket_search, num_lookups, search_size, foundRecords, notFoundRecords, elapsed_time / 1000.0, elapsed_time / num_lookups);
+    {
+        printf("%s,%zu,%zu,%zu,%zu,%zu,%zu,%.2f,%.0f,%.2f,%.2f,%.2f\n", source, farm.num_plots, farm.num_devices, num_challenges, key_length,
+               num_hits, answered, elapsed_time, num_challenges / elapsed_time, latency_percentile(&challenge_latency, 0.50) / 1000.0,
+               latency_percentile(&challenge_latency, 0.99) / 1000.0, challenge_latency.max_ns / 1000.0);
+    }
+
+    farm_close(&farm);
+    for (size_t i = 0; i < num_sets; i++)
+    {
+        for (size_t s = 0; s < sets[i].count; s++)
+            free(sets[i].paths[s]);
+    }
+    free(sets);
+    free(hits);
+    free(keys);
 }
 
 uint64_t largest_power_of_two_less_than(uint64_t number)
@@ -1986,6 +6269,115 @@ void remove_file(const char *fileName)
     }
 }
 
+/**
+ * copy_file_fast:
+ *   - Copies the whole source file into destination using the cheapest mechanism available:
+ *     a FICLONE reflink (no data copied at all), then copy_file_range() in large chunks
+ *     (in-kernel, may be offloaded by the filesystem), then sendfile(), and finally a
+ *     large-buffer pread()/pwrite() loop for filesystems that support none of these.
+ *
+ * @param source      File descriptor open for reading.
+ * @param destination File descriptor open for writing, empty.
+ * @return Number of bytes copied, or -1 on error.
+ */
+long long copy_file_fast(int source, int destination)
+{
+    struct stat st;
+    if (fstat(source, &st) != 0)
+    {
+        perror("Error getting source file size");
+        return -1;
+    }
+    off_t total = st.st_size;
+    off_t copied = 0;
+    const size_t chunk_size = 1024 * 1024 * 64;
+
+#ifdef __linux__
+#ifdef FICLONE
+    if (ioctl(destination, FICLONE, source) == 0)
+    {
+        if (!BENCHMARK)
+            printf("copy method: reflink\n");
+        return total;
+    }
+#endif
+
+    // copy_file_range() advances both file offsets; fall through to sendfile() if the kernel refuses up front
+    while (copied < total)
+    {
+        ssize_t n = copy_file_range(source, NULL, destination, NULL, min((off_t)chunk_size, total - copied), 0);
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && copied == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+                break;
+            perror("Error in copy_file_range");
+            return -1;
+        }
+        copied += n;
+    }
+    if (copied == total)
+    {
+        if (!BENCHMARK)
+            printf("copy method: copy_file_range\n");
+        return total;
+    }
+
+    while (copied < total)
+    {
+        off_t offset = copied;
+        ssize_t n = sendfile(destination, source, &offset, min((off_t)chunk_size, total - copied));
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && copied == 0 && (errno == EINVAL || errno == ENOSYS))
+                break;
+            perror("Error in sendfile");
+            return -1;
+        }
+        copied += n;
+    }
+    if (copied == total)
+    {
+        if (!BENCHMARK)
+            printf("copy method: sendfile\n");
+        return total;
+    }
+#endif
+
+    uint8_t *buffer = (uint8_t *)malloc(chunk_size);
+    if (buffer == NULL)
+    {
+        perror("Failed to allocate memory");
+        return -1;
+    }
+
+    while (copied < total)
+    {
+        ssize_t bytes = read_full_at(source, buffer, min((off_t)chunk_size, total - copied), copied);
+        if (bytes <= 0)
+        {
+            perror("Error reading from source file");
+            free(buffer);
+            return -1;
+        }
+        if (write_full_at(destination, buffer, bytes, copied) != bytes)
+        {
+            perror("Error writing to destination file");
+            free(buffer);
+            return -1;
+        }
+        copied += bytes;
+    }
+    free(buffer);
+
+    if (!BENCHMARK)
+        printf("copy method: pread/pwrite\n");
+    return total;
+}
+
 int move_file_overwrite(const char *source_path, const char *destination_path)
 {
     if (DEBUG)
@@ -2014,99 +6406,440 @@ int move_file_overwrite(const char *source_path, const char *destination_path)
         return -1;
     }
 
-    // Continue with copying as in the original move_file function
-    FILE *source = fopen(source_path, "rb");
-    if (source == NULL)
+    int source = open(source_path, O_RDONLY);
+    if (source == -1)
     {
         perror("Error opening source file for reading");
         return -1;
     }
 
-    FILE *destination = fopen(destination_path, "wb");
-    if (destination == NULL)
+    int destination = open(destination_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (destination == -1)
     {
         perror("Error opening destination file for writing");
-        fclose(source);
+        close(source);
         return -1;
     }
 
     if (!BENCHMARK)
         printf("deep copy started...\n");
-    size_t buffer_size = 1024 * 1024 * 8; // 1 MB
-    uint8_t *buffer = (uint8_t *)calloc(buffer_size, 1);
+    double start_time = omp_get_wtime();
 
-    if (buffer == NULL)
+    long long copied = copy_file_fast(source, destination);
+    if (copied < 0)
     {
-        perror("Failed to allocate memory");
-        return EXIT_FAILURE;
+        close(source);
+        close(destination);
+        return -1;
     }
 
-    // char buffer[1024*1024];
-    size_t bytes;
-
-    while ((bytes = fread(buffer, 1, sizeof(buffer), source)) > 0)
+    if (fsync(destination) != 0)
     {
-        size_t bytes_written = fwrite(buffer, 1, bytes, destination);
-        if (bytes_written != bytes)
-        {
-            perror("Error writing to destination file");
-            fclose(source);
-            fclose(destination);
-            return -1;
-        }
+        perror("Failed to fsync buffer");
+        close(source);
+        close(destination);
+        return EXIT_FAILURE;
     }
 
-    if (ferror(source))
+    close(source);
+    close(destination);
+
+    if (remove(source_path) != 0)
     {
-        perror("Error reading from source file");
-        fclose(source);
-        fclose(destination);
+        perror("Error deleting source file after moving");
         return -1;
     }
 
-    if (fflush(source) != 0)
+    if (!BENCHMARK)
     {
-        perror("Failed to flush buffer");
-        fclose(source);
-        return EXIT_FAILURE;
+        double elapsed_time = omp_get_wtime() - start_time;
+        printf("deep copy finished: %lld bytes in %.2f seconds, %.2f MB/s\n", copied, elapsed_time, copied / (elapsed_time * 1024 * 1024));
     }
+    if (DEBUG)
+        printf("move_file_overwrite() finished!\n");
+    return 0; // Success
+}
+
+#define JOURNAL_MAGIC 0x4c4e524a58544c56ULL // "VLTXJRNL"
+#define JOURNAL_VERSION 2
 
-    if (fsync(fileno(source)) != 0)
+// Checkpoint of a plot generation run, rewritten atomically whenever more work is durable on disk
+typedef struct
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t nonce_size;
+    uint32_t record_size;
+    uint32_t prefix_size;
+    int32_t k;
+    uint32_t full_buckets;
+    uint32_t num_temp_stripes;
+    uint32_t num_dest_stripes;
+    uint64_t rounds;
+    uint64_t num_buckets;
+    uint64_t num_records_in_bucket;
+    uint64_t rounds_done;               // rounds [0, rounds_done) are durable in the temporary stripes
+    uint64_t shuffle_done[MAX_STRIPES]; // buckets of each final stripe durable in final layout
+    uint64_t checksum;
+} Journal;
+
+char *journal_path = NULL;
+Journal journal;
+
+// FNV-1a over everything but the trailing checksum
+uint64_t journal_checksum(const Journal *j)
+{
+    const uint8_t *bytes = (const uint8_t *)j;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < offsetof(Journal, checksum); i++)
     {
-        perror("Failed to fsync buffer");
-        fclose(source);
-        return EXIT_FAILURE;
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
     }
+    return hash;
+}
+
+// Function to describe the current run in a fresh journal
+void journal_init(Journal *j, size_t num_temp_stripes, size_t num_dest_stripes)
+{
+    memset(j, 0, sizeof(Journal));
+    j->magic = JOURNAL_MAGIC;
+    j->version = JOURNAL_VERSION;
+    j->nonce_size = NONCE_SIZE;
+    j->record_size = RECORD_SIZE;
+    j->prefix_size = PREFIX_SIZE;
+    j->k = K;
+    j->full_buckets = FULL_BUCKETS;
+    j->num_temp_stripes = num_temp_stripes;
+    j->num_dest_stripes = num_dest_stripes;
+    j->rounds = rounds;
+    j->num_buckets = num_buckets;
+    j->num_records_in_bucket = num_records_in_bucket;
+}
 
-    fclose(source);
+// Function to replace the journal on disk atomically: write a temporary copy, sync it, rename it over
+int journal_commit(Journal *j)
+{
+    if (journal_path == NULL)
+        return 0;
 
-    if (fflush(destination) != 0)
+    j->checksum = journal_checksum(j);
+    char *tmp_path = concat_strings(journal_path, ".tmp");
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
     {
-        perror("Failed to flush buffer");
-        fclose(destination);
-        return EXIT_FAILURE;
+        perror("Error opening journal");
+        free(tmp_path);
+        return -1;
+    }
+    if (write_full_at(fd, j, sizeof(Journal), 0) != (ssize_t)sizeof(Journal) || fdatasync(fd) != 0)
+    {
+        perror("Error writing journal");
+        close(fd);
+        free(tmp_path);
+        return -1;
     }
+    close(fd);
 
-    if (fsync(fileno(destination)) != 0)
+    if (rename(tmp_path, journal_path) != 0)
     {
-        perror("Failed to fsync buffer");
-        fclose(destination);
-        return EXIT_FAILURE;
+        perror("Error renaming journal");
+        free(tmp_path);
+        return -1;
     }
+    free(tmp_path);
+    return 0;
+}
 
-    fclose(destination);
+// Function to load a journal and check that it belongs to a run with exactly the current parameters;
+// returns 1 if a matching journal was loaded, 0 if there is none, -1 if it cannot be used
+int journal_load(Journal *j, size_t num_temp_stripes, size_t num_dest_stripes)
+{
+    Journal expected;
+    journal_init(&expected, num_temp_stripes, num_dest_stripes);
 
-    if (remove(source_path) != 0)
+    int fd = open(journal_path, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    ssize_t bytes_read = read_full_at(fd, j, sizeof(Journal), 0);
+    close(fd);
+
+    if (bytes_read != (ssize_t)sizeof(Journal) || j->magic != JOURNAL_MAGIC || j->checksum != journal_checksum(j))
     {
-        perror("Error deleting source file after moving");
+        fprintf(stderr, "Error: journal %s is corrupt.\n", journal_path);
+        return -1;
+    }
+    if (j->version != expected.version || j->nonce_size != expected.nonce_size || j->record_size != expected.record_size ||
+        j->prefix_size != expected.prefix_size || j->k != expected.k || j->full_buckets != expected.full_buckets ||
+        j->num_temp_stripes != expected.num_temp_stripes || j->num_dest_stripes != expected.num_dest_stripes ||
+        j->rounds != expected.rounds || j->num_buckets != expected.num_buckets || j->num_records_in_bucket != expected.num_records_in_bucket)
+    {
+        fprintf(stderr, "Error: journal %s was written with different parameters (K=%d rounds=%llu records per bucket=%llu NONCE_SIZE=%u).\n",
+                journal_path, j->k, (unsigned long long)j->rounds, (unsigned long long)j->num_records_in_bucket, j->nonce_size);
         return -1;
     }
+    return 1;
+}
 
-    if (!BENCHMARK)
-        printf("deep copy finished!\n");
+// Function to wait for the last written round to reach the disk and record that rounds_done rounds are durable
+void round_checkpoint(int fd, off_t offset, off_t len, unsigned long long rounds_done)
+{
+    sync_range_finish(fd, offset, len);
+    if (journal_path == NULL)
+        return;
+    // the data is already on disk, this only commits the metadata of the preallocated range
+    if (fdatasync(fd) != 0)
+        perror("Warning: fdatasync failed");
+    journal.rounds_done = rounds_done;
+    journal_commit(&journal);
+}
+
+// Function to record that the first done buckets of final stripe d are durable
+void shuffle_checkpoint(int fd, size_t d, unsigned long long done)
+{
+    if (journal_path == NULL)
+        return;
+    if (fdatasync(fd) != 0)
+        perror("Warning: fdatasync failed");
+#pragma omp critical(journal)
+    {
+        journal.shuffle_done[d] = done;
+        journal_commit(&journal);
+    }
+}
+
+// Function to count the occupied records of a temporary bucket, which sit at its front
+size_t bucket_occupied(const MemoRecord2 *records, size_t capacity)
+{
+    size_t n = 0;
+    while (n < capacity && (is_nonce_nonzero(records[n].nonce1, NONCE_SIZE) || is_nonce_nonzero(records[n].nonce2, NONCE_SIZE)))
+        n++;
+    return n;
+}
+
+/**
+ * shuffle_table2:
+ *   - Merges the per-round table2 segments into the final bucket-major table2 layout,
+ *     where bucket i holds the bucket i records of every round back to back.
+ *   - Round r lives in temporary stripe r % num_temp, at segment r / num_temp of that stripe
+ *     (segments start after a header-sized gap, so a single round can become the final file).
+ *   - Final bucket ranges are split over the destination stripes; each destination stripe
+ *     gets its own worker, and each worker reads with one reader per temporary stripe, so
+ *     that every device has one I/O worker.
+ *   - Each worker resumes after journal.shuffle_done[d] buckets, and checkpoints its progress
+ *     whenever a batch is durable.
+ *   - With COMPACT, empty slots are dropped and each final stripe is written in CSR layout
+ *     (index groups followed by the occupied records).
+ *   - With SORTED_BUCKETS, the records a final bucket gathers from every round are sorted by
+ *     pair key (rehashing them), occupied records first.
+ *
+ * @param fds_temp     File descriptors of the temporary stripes.
+ * @param num_temp     Number of temporary stripes.
+ * @param fds_dest     File descriptors of the final stripes.
+ * @param num_dest     Number of final stripes.
+ * @param memory_bytes Memory budget shared by all workers' read and shuffle buffers.
+ * @param start_time   Walltime origin for progress messages.
+ * @return Time spent in the shuffle, in seconds.
+ */
+double shuffle_table2(const int *fds_temp, size_t num_temp, const int *fds_dest, size_t num_dest, unsigned long long memory_bytes, double start_time)
+{
+    double start_time_shuffle = omp_get_wtime();
+    size_t bucket_bytes = num_records_in_bucket * sizeof(MemoRecord2);
+    off_t round_bytes = num_buckets * bucket_bytes;
+
+    // half of each worker's share holds what was read, the other half the shuffled copy
+    unsigned long long num_buckets_to_read = memory_bytes / num_dest / (bucket_bytes * rounds) / 2;
+    if (num_buckets_to_read == 0)
+        num_buckets_to_read = 1;
+    // no worker reads more than its stripe
+    num_buckets_to_read = min(num_buckets_to_read, (num_buckets + num_dest - 1) / num_dest);
+    // compact batches cover whole index groups, so every checkpoint falls on a group boundary;
+    // rounded down, so that they stay within memory_bytes
+    if (COMPACT)
+        num_buckets_to_read = max(num_buckets_to_read / CSR_GROUP, 1ULL) * CSR_GROUP;
     if (DEBUG)
-        printf("move_file_overwrite() finished!\n");
-    return 0; // Success
+        printf("will read %llu buckets at one time per final stripe, %llu bytes\n", num_buckets_to_read, num_buckets_to_read * bucket_bytes * rounds);
+
+    long long shuffle_bytes = 2 * num_buckets_to_read * bucket_bytes * rounds + (SORTED_BUCKETS && rounds > 1 ? num_buckets_to_read * sizeof(uint32_t) : 0);
+    MEMORY.reserved[MEM_SHUFFLE] = num_dest * shuffle_bytes;
+
+    unsigned long long buckets_done = 0;
+    for (size_t d = 0; d < num_dest; d++)
+    {
+        buckets_done += journal.shuffle_done[d];
+    }
+    int max_levels = omp_get_max_active_levels();
+    omp_set_max_active_levels(2);
+
+#pragma omp parallel for schedule(static, 1) num_threads(num_dest)
+    for (size_t d = 0; d < num_dest; d++)
+    {
+        unsigned long long first = stripe_first_bucket(d, num_dest, num_buckets);
+        unsigned long long last = stripe_first_bucket(d + 1, num_dest, num_buckets);
+        size_t records_per_batch = num_records_in_bucket * num_buckets_to_read;
+
+        MemoRecord2 *buffer = (MemoRecord2 *)malloc(records_per_batch * rounds * sizeof(MemoRecord2));
+        MemoRecord2 *bufferShuffled = (MemoRecord2 *)malloc(records_per_batch * rounds * sizeof(MemoRecord2));
+        uint32_t *sorted_counts = NULL;
+        if (SORTED_BUCKETS && rounds > 1)
+            sorted_counts = (uint32_t *)malloc(num_buckets_to_read * sizeof(uint32_t));
+        if (buffer == NULL || bufferShuffled == NULL || (SORTED_BUCKETS && rounds > 1 && sorted_counts == NULL))
+        {
+            fprintf(stderr, "Error allocating memory for shuffle buffers.\n");
+            exit(EXIT_FAILURE);
+        }
+        memory_account(MEM_SHUFFLE, shuffle_bytes);
+
+        CompactWriter compact;
+        if (COMPACT && compact_writer_open(&compact, fds_dest[d], d, num_dest, journal.shuffle_done[d]) != 0)
+        {
+            exit(EXIT_FAILURE);
+        }
+
+        off_t offset_prev = 0;
+        size_t bytes_prev = 0;
+
+        for (unsigned long long i = first + journal.shuffle_done[d]; i < last; i += num_buckets_to_read)
+        {
+            double start_time_io2 = omp_get_wtime();
+            unsigned long long batch_buckets = min(num_buckets_to_read, last - i);
+            size_t batch_bytes = batch_buckets * bucket_bytes;
+
+            // one reader per temporary stripe, each walking the rounds stored on its device
+#pragma omp parallel for schedule(static, 1) num_threads(min(num_temp, rounds))
+            for (size_t t = 0; t < min(num_temp, rounds); t++)
+            {
+                for (unsigned long long r = t; r < rounds; r += num_temp)
+                {
+                    off_t offset_src = PLOT_HEADER_SIZE + (r / num_temp) * round_bytes + i * bucket_bytes;
+                    if (DEBUG)
+                        printf("read data: stripe=%zu round=%llu offset_src=%lld bytes=%zu\n", t, r, (long long)offset_src, batch_bytes);
+
+                    ssize_t bytes_read = read_full_at(fds_temp[t], &buffer[r * batch_buckets * num_records_in_bucket], batch_bytes, offset_src);
+                    if (bytes_read != (ssize_t)batch_bytes)
+                    {
+                        fprintf(stderr, "Error reading file, bytes read %zd instead of %zu\n", bytes_read, batch_bytes);
+                        exit(EXIT_FAILURE);
+                    }
+                }
+            }
+
+            off_t offset_dest = PLOT_HEADER_SIZE + (i - first) * bucket_bytes * rounds;
+            size_t bytes_dest = batch_bytes * rounds;
+            if (sorted_counts != NULL)
+            {
+                // gather each final bucket from every round into its slots and sort it
+#pragma omp parallel for schedule(dynamic, 64)
+                for (unsigned long long s = 0; s < batch_buckets; s++)
+                {
+                    MemoRecord2 *dst = &bufferShuffled[s * rounds * num_records_in_bucket];
+                    size_t count = 0;
+                    for (unsigned long long r = 0; r < rounds; r++)
+                    {
+                        const MemoRecord2 *src = &buffer[(r * batch_buckets + s) * num_records_in_bucket];
+                        size_t n = bucket_occupied(src, num_records_in_bucket);
+                        memcpy(&dst[count], src, n * sizeof(MemoRecord2));
+                        count += n;
+                    }
+                    sort_bucket_records2(dst, NULL, count);
+                    memset(&dst[count], 0, (rounds * num_records_in_bucket - count) * sizeof(MemoRecord2));
+                    sorted_counts[s] = count;
+                }
+
+                if (COMPACT)
+                {
+                    offset_dest = compact.data_offset + compact.num_records * sizeof(MemoRecord2);
+                    size_t packed = 0;
+                    for (unsigned long long s = 0; s < batch_buckets; s++)
+                    {
+                        memmove(&bufferShuffled[packed], &bufferShuffled[s * rounds * num_records_in_bucket], sorted_counts[s] * sizeof(MemoRecord2));
+                        compact_writer_append(&compact, sorted_counts[s]);
+                        packed += sorted_counts[s];
+                    }
+                    bytes_dest = packed * sizeof(MemoRecord2);
+                }
+            }
+            else if (COMPACT)
+            {
+                // keep only the occupied slots of each round's bucket, which sit at its front
+                offset_dest = compact.data_offset + compact.num_records * sizeof(MemoRecord2);
+                size_t packed = 0;
+                for (unsigned long long s = 0; s < batch_buckets; s++)
+                {
+                    size_t count = 0;
+                    for (unsigned long long r = 0; r < rounds; r++)
+                    {
+                        const MemoRecord2 *src = &buffer[(r * batch_buckets + s) * num_records_in_bucket];
+                        size_t n = bucket_occupied(src, num_records_in_bucket);
+                        memcpy(&bufferShuffled[packed + count], src, n * sizeof(MemoRecord2));
+                        count += n;
+                    }
+                    compact_writer_append(&compact, count);
+                    packed += count;
+                }
+                bytes_dest = packed * sizeof(MemoRecord2);
+            }
+            else
+            {
+                for (unsigned long long s = 0; s < batch_buckets; s++)
+                {
+                    for (unsigned long long r = 0; r < rounds; r++)
+                    {
+                        off_t index_src = (r * batch_buckets + s) * num_records_in_bucket;
+                        off_t index_dest = (s * rounds + r) * num_records_in_bucket;
+                        memcpy(&bufferShuffled[index_dest], &buffer[index_src], bucket_bytes);
+                    }
+                }
+            }
+
+            if (write_full_at(fds_dest[d], bufferShuffled, bytes_dest, offset_dest) != (ssize_t)bytes_dest ||
+                (COMPACT && compact_writer_write_index(&compact, i - first, i - first + batch_buckets) != 0))
+            {
+                perror("Error writing bucket to file");
+                exit(EXIT_FAILURE);
+            }
+
+            // keep one batch in flight: start writing this one back, wait for the previous one and checkpoint it
+            sync_range_start(fds_dest[d], offset_dest, bytes_dest);
+            if (bytes_prev > 0)
+            {
+                sync_range_finish(fds_dest[d], offset_prev, bytes_prev);
+                shuffle_checkpoint(fds_dest[d], d, i - first);
+            }
+            offset_prev = offset_dest;
+            bytes_prev = bytes_dest;
+
+            unsigned long long done;
+#pragma omp atomic capture
+            {
+                buckets_done += batch_buckets;
+                done = buckets_done;
+            }
+
+            double elapsed_time_io2 = omp_get_wtime() - start_time_io2;
+            double throughput_io2 = bytes_dest / (elapsed_time_io2 * 1024 * 1024);
+            if (!BENCHMARK)
+                printf("[%.2f] Shuffle %.2f%%: %.2f MB/s\n", omp_get_wtime() - start_time, done * 100.0 / num_buckets, throughput_io2);
+        }
+
+        if ((COMPACT && compact_writer_close(&compact) != 0) ||
+            (!COMPACT && plot_write_header(fds_dest[d], d, num_dest, PLOT_LAYOUT_FIXED, 0) != 0))
+        {
+            exit(EXIT_FAILURE);
+        }
+        if (bytes_prev > 0)
+        {
+            sync_range_finish(fds_dest[d], offset_prev, bytes_prev);
+            shuffle_checkpoint(fds_dest[d], d, last - first);
+        }
+
+        free(buffer);
+        free(bufferShuffled);
+        free(sorted_counts);
+        memory_account(MEM_SHUFFLE, -shuffle_bytes);
+    }
+
+    omp_set_max_active_levels(max_levels);
+    return omp_get_wtime() - start_time_shuffle;
 }
 
 long long fib(int n);
@@ -2265,6 +6998,608 @@ void generateHashes(unsigned long long start, unsigned long long end)
 #pragma omp taskwait // Wait for both tasks to complete
 }
 
+// Stages of plot generation timed by --microbench
+enum
+{
+    MICROBENCH_HASH,       // Blake3 through the hasher, as generateBlake3() hashes every nonce
+    MICROBENCH_HASH_BLOCK, // Blake3 as one compression, as the verifiers hash
+    MICROBENCH_PARTITION,  // table1 bucket inserts of nonces whose bucket is known
+    MICROBENCH_SORT,       // table1 bucket sorts
+    MICROBENCH_PAIR,       // table2 pairing, with its bucket inserts
+    MICROBENCH_WRITE,      // buckets2 to disk, made durable
+    MICROBENCH_STAGES
+};
+
+const char *MICROBENCH_STAGE_NAMES[MICROBENCH_STAGES] = {"hash", "hash_block", "partition", "sort", "pair", "write"};
+
+// Synthetic input of --microbench: one round of table1 buckets of the -K/-m geometry, filled from nonces [0, num_records)
+typedef struct
+{
+    unsigned long long num_records;   // nonces hashed, num_buckets * num_records_in_bucket
+    uint32_t *bucket_of;              // bucket index of every nonce, the partition input
+    MemoRecord *unsorted;             // bucket image as hashing leaves it, the sort input
+    MemoRecord *sorted;               // the same image sorted, the pair input
+    MemoRecord *slab;                 // records of buckets, restored from an image before each run
+    MemoRecord2 *slab2;               // records of buckets2, the write input
+    volatile uint8_t sink;            // keeps the hash loops from being optimized away
+} MicrobenchInput;
+
+// Function to point buckets and buckets2 at the slabs of input and empty them
+void microbench_reset(MicrobenchInput *input)
+{
+    for (unsigned long long i = 0; i < num_buckets; i++)
+    {
+        buckets[i].records = &input->slab[i * num_records_in_bucket];
+        buckets[i].count = 0;
+        buckets[i].count_waste = 0;
+        buckets[i].full = false;
+        buckets2[i].records = &input->slab2[i * num_records_in_bucket];
+        buckets2[i].count = 0;
+        buckets2[i].count_waste = 0;
+        buckets2[i].full = false;
+    }
+    full_buckets_global = 0;
+}
+
+// Function to time one stage with the current number of threads; returns the seconds it took, and the bytes it moved in *bytes
+double microbench_stage(MicrobenchInput *input, int stage, const char *path, unsigned long long *bytes)
+{
+    unsigned long long n = input->num_records;
+    size_t table2_bytes = num_buckets * num_records_in_bucket * sizeof(MemoRecord2);
+    *bytes = n * NONCE_SIZE;
+
+    // restore the input of the stage, untimed
+    microbench_reset(input);
+    if (stage == MICROBENCH_SORT)
+        memcpy(input->slab, input->unsorted, n * sizeof(MemoRecord));
+    else if (stage == MICROBENCH_PAIR)
+        memcpy(input->slab, input->sorted, n * sizeof(MemoRecord));
+
+    int fd = -1;
+    if (stage == MICROBENCH_WRITE)
+    {
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1)
+        {
+            fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+            return -1.0;
+        }
+        preallocate_file(fd, table2_bytes);
+        *bytes = table2_bytes;
+    }
+
+    uint8_t sink = 0;
+    double start = omp_get_wtime();
+    switch (stage)
+    {
+    case MICROBENCH_HASH:
+#pragma omp parallel for schedule(static) reduction(^ : sink)
+        for (unsigned long long i = 0; i < n; i++)
+        {
+            MemoRecord record;
+            uint8_t hash[HASH_SIZE];
+            generateBlake3(hash, &record, i);
+            sink ^= hash[0];
+        }
+        break;
+    case MICROBENCH_HASH_BLOCK:
+#pragma omp parallel for schedule(static) reduction(^ : sink)
+        for (unsigned long long i = 0; i < n; i++)
+        {
+            uint8_t hash[HASH_SIZE];
+            blake3_single_block((const uint8_t *)&i, NONCE_SIZE, hash, HASH_SIZE);
+            sink ^= hash[0];
+        }
+        break;
+    case MICROBENCH_PARTITION:
+#pragma omp parallel for schedule(static)
+        for (unsigned long long i = 0; i < n; i++)
+        {
+            MemoRecord record;
+            memcpy(record.nonce, &i, NONCE_SIZE);
+            insert_record(buckets, &record, input->bucket_of[i]);
+        }
+        break;
+    case MICROBENCH_SORT:
+#pragma omp parallel for schedule(static)
+        for (unsigned long long c = 0; c < num_buckets; c += METRICS_CHUNK_BUCKETS)
+        {
+            for (unsigned long long i = c; i < min(c + METRICS_CHUNK_BUCKETS, num_buckets); i++)
+                sort_bucket_records_inplace(buckets[i].records, num_records_in_bucket);
+        }
+        break;
+    case MICROBENCH_PAIR:
+#pragma omp parallel for schedule(static)
+        for (unsigned long long c = 0; c < num_buckets; c += METRICS_CHUNK_BUCKETS)
+        {
+            for (unsigned long long i = c; i < min(c + METRICS_CHUNK_BUCKETS, num_buckets); i++)
+                generate_table2(buckets[i].records, num_records_in_bucket);
+        }
+        break;
+    case MICROBENCH_WRITE: // one piece per thread
+    {
+        bool failed = false;
+#pragma omp parallel reduction(|| : failed)
+        {
+            size_t t = (size_t)omp_get_thread_num();
+            size_t threads = (size_t)omp_get_num_threads();
+            size_t from = table2_bytes / threads * t;
+            size_t to = t + 1 == threads ? table2_bytes : table2_bytes / threads * (t + 1);
+            if (write_full_at(fd, (const uint8_t *)input->slab2 + from, to - from, from) != (ssize_t)(to - from))
+                failed = true;
+        }
+        if (failed || fdatasync(fd) != 0)
+        {
+            fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+            close(fd);
+            return -1.0;
+        }
+        break;
+    }
+    }
+    double seconds = omp_get_wtime() - start;
+    input->sink ^= sink;
+    if (fd != -1)
+        close(fd);
+    return seconds;
+}
+
+/**
+ * run_microbench:
+ *   - Times the stages of plot generation one at a time on the same synthetic input, so the
+ *     stage that stops scaling first shows up on its own: hash (Blake3 through the hasher, as
+ *     generation does), hash_block (Blake3 as a single compression), partition (bucket insertion
+ *     of precomputed bucket indexes), sort (sort_bucket_records_inplace()), pair (generate_table2()
+ *     into buckets2) and write (buckets2 to path with one positioned write per thread, and fdatasync).
+ *   - The input is one round of the -K/-m geometry, built once from nonces [0, num_records); sort
+ *     and pair start from copies of the unsorted and sorted bucket images on every run.
+ *   - Prints records/s and bytes/s of every stage at every thread count, with the speedup over the
+ *     first thread count; bytes are the table1 records a stage consumes, or the table2 bytes written.
+ *
+ * @param stages          Comma separated stages, or "all".
+ * @param thread_counts   Thread counts to run every stage with.
+ * @param num_counts      Number of thread counts.
+ * @param memory_mb       -m: the round holds at most this much of table1.
+ * @param path            File the write stage writes to and removes, or NULL to skip it.
+ * @return 0 on success, -1 on error.
+ */
+int run_microbench(const char *stages, const int *thread_counts, size_t num_counts, unsigned long long memory_mb, const char *path)
+{
+    bool run[MICROBENCH_STAGES] = {false};
+    char *text = strdup(stages);
+    char *saveptr = NULL;
+    for (char *name = strtok_r(text, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr))
+    {
+        int s = 0;
+        while (s < MICROBENCH_STAGES && strcmp(name, MICROBENCH_STAGE_NAMES[s]) != 0)
+            s++;
+        if (strcmp(name, "all") == 0)
+        {
+            for (s = 0; s < MICROBENCH_STAGES; s++)
+                run[s] = true;
+        }
+        else if (s < MICROBENCH_STAGES)
+        {
+            run[s] = true;
+        }
+        else
+        {
+            fprintf(stderr, "Error: unknown stage %s (hash, hash_block, partition, sort, pair, write, all).\n", name);
+            free(text);
+            return -1;
+        }
+    }
+    free(text);
+    if (run[MICROBENCH_WRITE] && path == NULL)
+    {
+        fprintf(stderr, "Warning: the write stage needs -f FILE; skipping it.\n");
+        run[MICROBENCH_WRITE] = false;
+    }
+
+    // the geometry main() gives a round of -K/-m
+    unsigned long long file_bytes = (1ULL << K) * NONCE_SIZE;
+    unsigned long long memory_bytes = memory_mb * 1024 * 1024;
+    if (memory_bytes == 0 || memory_bytes > file_bytes)
+        memory_bytes = file_bytes;
+    unsigned long long num_rounds = (file_bytes + memory_bytes - 1) / memory_bytes;
+    num_buckets = 1ULL << (PREFIX_SIZE * 8);
+    num_records_in_bucket = max(file_bytes / num_rounds / NONCE_SIZE / num_buckets, 1ULL);
+
+    MicrobenchInput input = {0};
+    input.num_records = num_buckets * num_records_in_bucket;
+    unsigned long long n = input.num_records;
+    input.bucket_of = (uint32_t *)malloc(n * sizeof(uint32_t));
+    input.unsorted = (MemoRecord *)malloc(n * sizeof(MemoRecord));
+    input.sorted = (MemoRecord *)malloc(n * sizeof(MemoRecord));
+    input.slab = (MemoRecord *)calloc(n, sizeof(MemoRecord));
+    input.slab2 = (MemoRecord2 *)calloc(n, sizeof(MemoRecord2));
+    buckets = (Bucket *)calloc(num_buckets, sizeof(Bucket));
+    buckets2 = (Bucket2 *)calloc(num_buckets, sizeof(Bucket2));
+    if (input.bucket_of == NULL || input.unsorted == NULL || input.sorted == NULL || input.slab == NULL ||
+        input.slab2 == NULL || buckets == NULL || buckets2 == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for the microbenchmark input.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // build the input once, with every thread: the bucket of every nonce, the bucket image, sorted, and buckets2
+    if (!BENCHMARK)
+        printf("MICROBENCH: K=%d buckets=%llu records_in_bucket=%llu records=%llu (%.2f MB)\n", K, num_buckets,
+               num_records_in_bucket, n, n * NONCE_SIZE / (1024.0 * 1024));
+    microbench_reset(&input);
+#pragma omp parallel for schedule(static)
+    for (unsigned long long i = 0; i < n; i++)
+    {
+        MemoRecord record;
+        uint8_t hash[HASH_SIZE];
+        generateBlake3(hash, &record, i);
+        input.bucket_of[i] = (uint32_t)getBucketIndex(hash, PREFIX_SIZE);
+        insert_record(buckets, &record, input.bucket_of[i]);
+    }
+    memcpy(input.unsorted, input.slab, n * sizeof(MemoRecord));
+#pragma omp parallel for schedule(static)
+    for (unsigned long long i = 0; i < num_buckets; i++)
+        sort_bucket_records_inplace(buckets[i].records, num_records_in_bucket);
+    memcpy(input.sorted, input.slab, n * sizeof(MemoRecord));
+    unsigned long long pairs = 0;
+#pragma omp parallel for schedule(static) reduction(+ : pairs)
+    for (unsigned long long i = 0; i < num_buckets; i++)
+        pairs += generate_table2(buckets[i].records, num_records_in_bucket);
+
+    if (BENCHMARK)
+        printf("STAGE,NUM_THREADS,RECORDS,BYTES,TIME,RECORDS/S,BYTES/S,SPEEDUP\n");
+    int result = 0;
+    for (int s = 0; s < MICROBENCH_STAGES && result == 0; s++)
+    {
+        if (!run[s])
+            continue;
+        double first_rate = 0.0;
+        for (size_t c = 0; c < num_counts; c++)
+        {
+            omp_set_num_threads(thread_counts[c]);
+            unsigned long long bytes = 0;
+            double seconds = microbench_stage(&input, s, path, &bytes);
+            if (seconds < 0)
+            {
+                result = -1;
+                break;
+            }
+            double rate = n / seconds;
+            if (c == 0)
+                first_rate = rate;
+            if (BENCHMARK)
+                printf("%s,%d,%llu,%llu,%.6f,%.0f,%.0f,%.2f\n", MICROBENCH_STAGE_NAMES[s], thread_counts[c], n,
+                       bytes, seconds, rate, bytes / seconds, rate / first_rate);
+            else
+                printf("MICROBENCH: %-10s threads=%-3d %8.3f s %10.2f MR/s %10.2f MB/s speedup=%.2f\n", MICROBENCH_STAGE_NAMES[s],
+                       thread_counts[c], seconds, rate / 1e6, bytes / seconds / (1024 * 1024), rate / first_rate);
+        }
+    }
+    if (run[MICROBENCH_WRITE])
+        remove(path);
+    if (!BENCHMARK)
+        printf("MICROBENCH: pairs=%llu\n", pairs);
+
+    free(input.bucket_of);
+    free(input.unsorted);
+    free(input.sorted);
+    free(input.slab);
+    free(input.slab2);
+    free(buckets);
+    free(buckets2);
+    buckets = NULL;
+    buckets2 = NULL;
+    return result;
+}
+
+#define BENCH_COLUMNS 15    // columns of the -x true CSV line
+#define BENCH_KEYS 5        // swept options
+#define BENCH_MAX_VALUES 64 // values per swept option
+#define BENCH_MAX_REPEAT 1000
+
+const char *BENCH_HEADER = "APPROACH,K,NONCE_SIZE(B),NUM_THREADS,MEMORY_SIZE(MB),FILE_SIZE(GB),BATCH_SIZE,THROUGHPUT(MH/S),THROUGHPUT(MB/S),HASH_TIME,IO_TIME,SHUFFLE_TIME,OTHER_TIME,TOTAL_TIME,STORAGE_EFFICIENCY";
+const char *BENCH_KEY_NAMES[BENCH_KEYS] = {"approach", "threads", "batch", "K", "memory"};
+const char *BENCH_KEY_OPTIONS[BENCH_KEYS] = {"-a", "-t", "-b", "-K", "-m"};
+
+// A --bench sweep: the values of each swept option (none keeps the option given on the command line)
+typedef struct
+{
+    char *values[BENCH_KEYS][BENCH_MAX_VALUES];
+    size_t counts[BENCH_KEYS];
+    int repeat;
+} BenchSpec;
+
+// Function to parse "key=v1,v2 key=v3 ..." into spec; keys are those of BENCH_KEY_NAMES and repeat; returns 0 or -1
+int bench_parse(char *text, BenchSpec *spec)
+{
+    memset(spec, 0, sizeof(*spec));
+    spec->repeat = 3;
+    char *saveptr = NULL;
+    for (char *item = strtok_r(text, " ", &saveptr); item != NULL; item = strtok_r(NULL, " ", &saveptr))
+    {
+        char *list = strchr(item, '=');
+        if (list == NULL)
+        {
+            fprintf(stderr, "Error: bench item %s is not key=values.\n", item);
+            return -1;
+        }
+        *list++ = '\0';
+        if (strcmp(item, "repeat") == 0)
+        {
+            spec->repeat = atoi(list);
+            if (spec->repeat < 1 || spec->repeat > BENCH_MAX_REPEAT)
+            {
+                fprintf(stderr, "Error: repeat must be between 1 and %d.\n", BENCH_MAX_REPEAT);
+                return -1;
+            }
+            continue;
+        }
+        int key = 0;
+        while (key < BENCH_KEYS && strcmp(item, BENCH_KEY_NAMES[key]) != 0)
+            key++;
+        if (key == BENCH_KEYS)
+        {
+            fprintf(stderr, "Error: unknown bench key %s (approach, threads, batch, K, memory, repeat).\n", item);
+            return -1;
+        }
+        char *value_saveptr = NULL;
+        for (char *value = strtok_r(list, ",", &value_saveptr); value != NULL; value = strtok_r(NULL, ",", &value_saveptr))
+        {
+            if (spec->counts[key] == BENCH_MAX_VALUES)
+            {
+                fprintf(stderr, "Error: at most %d values per bench key.\n", BENCH_MAX_VALUES);
+                return -1;
+            }
+            spec->values[key][spec->counts[key]++] = value;
+        }
+    }
+    return 0;
+}
+
+// Function to run one generation as a child of this binary and parse its -x true CSV line into
+// approach and values[1..BENCH_COLUMNS-1]; returns 0, or -1 if it failed or printed no such line
+int bench_run(const char *exe, char *const *args, char *approach, size_t approach_size, double *values)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        perror("Error creating pipe");
+        return -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("Error forking");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execv(exe, args);
+        perror("Error running benchmark");
+        _exit(127);
+    }
+    close(fds[1]);
+
+    size_t size = 0;
+    size_t capacity = 4096;
+    char *output = (char *)malloc(capacity);
+    ssize_t n;
+    while (output != NULL && (n = read(fds[0], output + size, capacity - size - 1)) > 0)
+    {
+        size += n;
+        if (capacity - size == 1)
+        {
+            capacity *= 2;
+            output = (char *)realloc(output, capacity);
+        }
+    }
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (output == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    output[size] = '\0';
+
+    // the CSV line is the last line with a full row of columns
+    int result = -1;
+    char *saveptr = NULL;
+    for (char *line = strtok_r(output, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr))
+    {
+        char *fields[BENCH_COLUMNS];
+        size_t count = 0;
+        char *field_saveptr = NULL;
+        for (char *field = strtok_r(line, ",", &field_saveptr); field != NULL && count < BENCH_COLUMNS; field = strtok_r(NULL, ",", &field_saveptr))
+            fields[count++] = field;
+        if (count != BENCH_COLUMNS)
+            continue;
+        snprintf(approach, approach_size, "%s", fields[0]);
+        for (size_t c = 1; c < BENCH_COLUMNS; c++)
+            values[c] = strtod(fields[c], NULL);
+        result = 0;
+    }
+    free(output);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    return result;
+}
+
+// Comparison function for qsort(), ordering doubles
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Function to compute the median of sorted values and its distribution free 95% interval, the order statistics
+// n/2 -+ 0.98 sqrt(n) (the whole range for fewer than 6 values)
+double bench_median(const double *sorted, size_t n, double *low, double *high)
+{
+    double half = 0.98 * sqrt((double)n);
+    long lo = (long)floor(n / 2.0 - half);
+    long hi = (long)ceil(n / 2.0 + half);
+    *low = sorted[max(lo, 0L)];
+    *high = sorted[min(hi, (long)n - 1)];
+    return n % 2 == 1 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2.0;
+}
+
+/**
+ * run_bench:
+ *   - Sweeps approach, threads, batch size, K and memory: every combination of the values in spec is
+ *     generated repeat times by a child of this binary, with the options of this command line
+ *     (without --bench) and -x true, so every run starts from a clean process.
+ *   - Each point is written as one row of the data/vaultx-*.csv schema holding the median of every
+ *     column, to csv_path (appended to, with the header if the file is new) or stdout; the 95%
+ *     intervals of the throughput and total time medians go to stderr.
+ *
+ * @param spec_text Sweep, e.g. "approach=for,task threads=1,4 K=25,26 memory=2048 repeat=5".
+ * @param argc      Arguments of this run, --bench and --bench-csv included; they are left out of the children.
+ * @param argv
+ * @param csv_path  File the rows are appended to, or NULL for stdout.
+ * @return 0 if every run succeeded, 1 if some failed, -1 on error.
+ */
+int run_bench(const char *spec_text, int argc, char *argv[], const char *csv_path)
+{
+    char *text = strdup(spec_text);
+    BenchSpec spec;
+    if (text == NULL || bench_parse(text, &spec) != 0)
+    {
+        free(text);
+        return -1;
+    }
+
+    char exe[PATH_MAX];
+    ssize_t exe_length = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (exe_length > 0)
+        exe[exe_length] = '\0';
+    else
+        snprintf(exe, sizeof(exe), "%s", argv[0]);
+
+    // the children get this command line without the bench options, then the point's options, which win
+    char **args = (char **)malloc((argc + 2 * BENCH_KEYS + 3) * sizeof(char *));
+    if (args == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    int num_args = 0;
+    args[num_args++] = exe;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--bench") == 0 || strcmp(argv[i], "--bench-csv") == 0)
+            i++;
+        else if (strncmp(argv[i], "--bench=", 8) != 0 && strncmp(argv[i], "--bench-csv=", 12) != 0)
+            args[num_args++] = argv[i];
+    }
+    int first_point_arg = num_args;
+
+    FILE *csv = stdout;
+    if (csv_path != NULL)
+    {
+        csv = fopen(csv_path, "a");
+        if (csv == NULL)
+        {
+            fprintf(stderr, "Error opening %s: %s\n", csv_path, strerror(errno));
+            free(args);
+            free(text);
+            return -1;
+        }
+    }
+    if (csv == stdout || ftell(csv) == 0)
+        fprintf(csv, "%s\n", BENCH_HEADER);
+
+    double *runs = (double *)malloc((size_t)spec.repeat * BENCH_COLUMNS * sizeof(double));
+    double *column = (double *)malloc((size_t)spec.repeat * sizeof(double));
+    if (runs == NULL || column == NULL)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // walk every combination like an odometer, the last key fastest
+    size_t index[BENCH_KEYS] = {0};
+    int failed = 0;
+    for (bool done = false; !done;)
+    {
+        num_args = first_point_arg;
+        char point[256] = "";
+        for (int k = 0; k < BENCH_KEYS; k++)
+        {
+            if (spec.counts[k] == 0)
+                continue;
+            args[num_args++] = (char *)BENCH_KEY_OPTIONS[k];
+            args[num_args++] = spec.values[k][index[k]];
+            snprintf(point + strlen(point), sizeof(point) - strlen(point), "%s%s=%s", point[0] ? " " : "", BENCH_KEY_NAMES[k], spec.values[k][index[k]]);
+        }
+        args[num_args++] = (char *)"-x";
+        args[num_args++] = (char *)"true";
+        args[num_args] = NULL;
+
+        char approach[64] = "";
+        int succeeded = 0;
+        for (int r = 0; r < spec.repeat; r++)
+        {
+            if (bench_run(exe, args, approach, sizeof(approach), &runs[succeeded * BENCH_COLUMNS]) == 0)
+                succeeded++;
+            else
+                failed++;
+        }
+
+        if (succeeded == 0)
+        {
+            fprintf(stderr, "BENCH: %s: every run failed\n", point);
+        }
+        else
+        {
+            double median[BENCH_COLUMNS];
+            double low[BENCH_COLUMNS];
+            double high[BENCH_COLUMNS];
+            for (int c = 1; c < BENCH_COLUMNS; c++)
+            {
+                for (int r = 0; r < succeeded; r++)
+                    column[r] = runs[r * BENCH_COLUMNS + c];
+                qsort(column, succeeded, sizeof(double), compare_doubles);
+                median[c] = bench_median(column, succeeded, &low[c], &high[c]);
+            }
+            // the same format as the -x true line of a single run
+            fprintf(csv, "%s,%.0f,%.0f,%.0f,%.0f,%.2f,%.0f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n", approach,
+                    median[1], median[2], median[3], median[4], median[5], median[6], median[7], median[8],
+                    median[9], median[10], median[11], median[12], median[13], median[14]);
+            fflush(csv);
+            fprintf(stderr, "BENCH: %s: %d runs, throughput %.2f MH/s (95%% interval %.2f - %.2f), total time %.2f s (95%% interval %.2f - %.2f)\n",
+                    point[0] ? point : "defaults", succeeded, median[7], low[7], high[7], median[13], low[13], high[13]);
+        }
+
+        done = true;
+        for (int k = BENCH_KEYS - 1; k >= 0; k--)
+        {
+            if (spec.counts[k] > 0 && ++index[k] < spec.counts[k])
+            {
+                done = false;
+                break;
+            }
+            index[k] = 0;
+        }
+    }
+
+    if (csv != stdout)
+        fclose(csv);
+    free(runs);
+    free(column);
+    free(args);
+    free(text);
+    return failed > 0 ? 1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
     // Default values
@@ -2279,6 +7614,57 @@ int main(int argc, char *argv[])
     char *FILENAME_FINAL = NULL;  // Default output file name
     char *FILENAME_TABLE2 = NULL; // Default output file name
     char *SEARCH_STRING = NULL;   // Default output file name
+    char *QUERY_FILE = NULL;      // Streamed queries, - for stdin
+    bool QUERY_BINARY = false;
+    int QUERY_BYTES = PREFIX_SIZE;
+    int QUERY_IN_FLIGHT = 4096;
+    char *SERVE_SOCKET = NULL;
+    char *CLIENT_SOCKET = NULL;
+    char *FARM_SOURCE = NULL;
+    char *PROOF_FILE = NULL; // proofs to verify, - for stdin
+    unsigned long long VERIFY_SAMPLE = 0; // buckets to sample, 0 to verify the whole plot
+    unsigned long long SAMPLE_SEED = (unsigned long long)time(NULL);
+    bool OCCUPANCY = false;
+    char *METRICS_FILE = NULL; // --metrics JSON of plot generation
+    bool PERF_COUNTERS = false;
+    bool MEMORY_BUDGET = false; // -m given: a hard budget for everything a round allocates
+    char *BENCH_SPEC = NULL; // --bench sweep
+    char *BENCH_CSV = NULL;
+    char *MICROBENCH_STAGES_LIST = NULL; // --microbench stages
+    char *MICROBENCH_THREADS = NULL;
+    char *PLOT_NAMES[MAX_STRIPES]; // every -j given, for --serve
+    size_t num_plot_names = 0;
+
+    // Options that only have a long form
+    enum
+    {
+        OPT_RESUME = 256,
+        OPT_COMPACT,
+        OPT_SORTED,
+        OPT_FILTER,
+        OPT_FILTER_BYTES,
+        OPT_FILTER_BITS,
+        OPT_MMAP,
+        OPT_QUERIES,
+        OPT_QUERY_FORMAT,
+        OPT_QUERY_BYTES,
+        OPT_IN_FLIGHT,
+        OPT_SERVE,
+        OPT_CLIENT,
+        OPT_FARM,
+        OPT_LIMIT,
+        OPT_COLD,
+        OPT_VERIFY_PROOFS,
+        OPT_VERIFY_SAMPLE,
+        OPT_SEED,
+        OPT_OCCUPANCY,
+        OPT_METRICS,
+        OPT_PERF,
+        OPT_BENCH,
+        OPT_BENCH_CSV,
+        OPT_MICROBENCH,
+        OPT_MICROBENCH_THREADS,
+    };
 
     // Define long options
     static struct option long_options[] = {
@@ -2299,6 +7685,32 @@ int main(int argc, char *argv[])
         {"benchmark", required_argument, 0, 'x'},
         {"full_buckets", required_argument, 0, 'y'},
         {"debug", required_argument, 0, 'd'},
+        {"resume", no_argument, 0, OPT_RESUME},
+        {"compact", no_argument, 0, OPT_COMPACT},
+        {"sorted", no_argument, 0, OPT_SORTED},
+        {"filter", no_argument, 0, OPT_FILTER},
+        {"filter-bytes", required_argument, 0, OPT_FILTER_BYTES},
+        {"filter-bits", required_argument, 0, OPT_FILTER_BITS},
+        {"mmap", no_argument, 0, OPT_MMAP},
+        {"queries", required_argument, 0, OPT_QUERIES},
+        {"query-format", required_argument, 0, OPT_QUERY_FORMAT},
+        {"query-bytes", required_argument, 0, OPT_QUERY_BYTES},
+        {"in-flight", required_argument, 0, OPT_IN_FLIGHT},
+        {"serve", required_argument, 0, OPT_SERVE},
+        {"client", required_argument, 0, OPT_CLIENT},
+        {"farm", required_argument, 0, OPT_FARM},
+        {"limit", required_argument, 0, OPT_LIMIT},
+        {"cold", no_argument, 0, OPT_COLD},
+        {"verify-proofs", required_argument, 0, OPT_VERIFY_PROOFS},
+        {"verify-sample", required_argument, 0, OPT_VERIFY_SAMPLE},
+        {"seed", required_argument, 0, OPT_SEED},
+        {"occupancy", no_argument, 0, OPT_OCCUPANCY},
+        {"metrics", required_argument, 0, OPT_METRICS},
+        {"perf", no_argument, 0, OPT_PERF},
+        {"bench", required_argument, 0, OPT_BENCH},
+        {"bench-csv", required_argument, 0, OPT_BENCH_CSV},
+        {"microbench", required_argument, 0, OPT_MICROBENCH},
+        {"microbench-threads", required_argument, 0, OPT_MICROBENCH_THREADS},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}};
 
@@ -2354,10 +7766,13 @@ int main(int argc, char *argv[])
             break;
         case 'm':
             MEMORY_SIZE_MB = atoi(optarg);
+            MEMORY_BUDGET = true;
             // MEMORY_SIZE_bytes_original = MEMORY_SIZE_MB * 1024 * 1024;
-            if (MEMORY_SIZE_MB < 64)
+            // -m is a hard budget on everything a round allocates; one record per bucket is the least a round holds
+            if (MEMORY_SIZE_MB < (unsigned long long)ceil(memory_round_bytes(1, 1, false) / (1024 * 1024.0)))
             {
-                fprintf(stderr, "Memory size must be at least 64 MB.\n");
+                fprintf(stderr, "Memory budget must be at least %.0f MB: -m bounds the whole footprint of a round, bucket metadata included.\n",
+                        ceil(memory_round_bytes(1, 1, false) / (1024 * 1024.0)));
                 print_usage(argv[0]);
                 exit(EXIT_FAILURE);
             }
@@ -2373,6 +7788,8 @@ int main(int argc, char *argv[])
         case 'j':
             FILENAME_TABLE2 = optarg;
             writeDataTable2 = true;
+            if (num_plot_names < MAX_STRIPES)
+                PLOT_NAMES[num_plot_names++] = optarg;
             break;
         case 'b':
             BATCH_SIZE = atoi(optarg);
@@ -2423,9 +7840,9 @@ int main(int argc, char *argv[])
             SEARCH = true;
             HASHGEN = false;
             PREFIX_SEARCH_SIZE = atoi(optarg);
-            if (PREFIX_SEARCH_SIZE < 1)
+            if (PREFIX_SEARCH_SIZE < 1 || PREFIX_SEARCH_SIZE > QUERY_MAX_BYTES)
             {
-                fprintf(stderr, "PREFIX_SEARCH_SIZE must be 1 or greater.\n");
+                fprintf(stderr, "PREFIX_SEARCH_SIZE must be 1 to %d bytes.\n", QUERY_MAX_BYTES);
                 print_usage(argv[0]);
                 exit(EXIT_FAILURE);
             }
@@ -2450,14 +7867,156 @@ int main(int argc, char *argv[])
                 FULL_BUCKETS = false;
             }
             break;
-        case 'd':
-            if (strcmp(optarg, "true") == 0)
+        case 'd':
+            if (strcmp(optarg, "true") == 0)
+            {
+                DEBUG = true;
+            }
+            else
+            {
+                DEBUG = false;
+            }
+            break;
+        case OPT_RESUME:
+            RESUME = true;
+            break;
+        case OPT_COMPACT:
+            COMPACT = true;
+            break;
+        case OPT_SORTED:
+            SORTED_BUCKETS = true;
+            break;
+        case OPT_FILTER:
+            FILTER = true;
+            break;
+        case OPT_FILTER_BYTES:
+            FILTER_KEY_SIZE = atoi(optarg);
+            if (FILTER_KEY_SIZE < 1 || FILTER_KEY_SIZE > BLAKE3_OUT_LEN)
+            {
+                fprintf(stderr, "Filter bytes must be between 1 and %d.\n", BLAKE3_OUT_LEN);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_FILTER_BITS:
+            FILTER_BITS = atoi(optarg);
+            if (FILTER_BITS < 1)
+            {
+                fprintf(stderr, "Filter bits must be at least 1.\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_MMAP:
+            SEARCH_MMAP = true;
+            break;
+        case OPT_COLD:
+#ifndef __linux__
+            // Without posix_fadvise nothing evicts the plot, so the numbers would be warm-cache ones
+            printf("--cold needs posix_fadvise and is only supported on Linux, exiting...\n");
+            exit(1);
+#endif
+            COLD = true;
+            break;
+        case OPT_VERIFY_PROOFS:
+            PROOF_FILE = optarg;
+            SEARCH = true;
+            HASHGEN = false;
+            break;
+        case OPT_VERIFY_SAMPLE:
+            VERIFY_SAMPLE = strtoull(optarg, NULL, 10);
+            if (VERIFY_SAMPLE < 1)
+            {
+                fprintf(stderr, "The sample must be 1 or more buckets.\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            SEARCH = true;
+            HASHGEN = false;
+            break;
+        case OPT_SEED:
+            SAMPLE_SEED = strtoull(optarg, NULL, 10);
+            break;
+        case OPT_BENCH:
+            BENCH_SPEC = optarg;
+            break;
+        case OPT_BENCH_CSV:
+            BENCH_CSV = optarg;
+            break;
+        case OPT_MICROBENCH:
+            MICROBENCH_STAGES_LIST = optarg;
+            break;
+        case OPT_MICROBENCH_THREADS:
+            MICROBENCH_THREADS = optarg;
+            break;
+        case OPT_PERF:
+            PERF_COUNTERS = true;
+            break;
+        case OPT_METRICS:
+            METRICS_FILE = optarg;
+            break;
+        case OPT_OCCUPANCY:
+            OCCUPANCY = true;
+            SEARCH = true;
+            HASHGEN = false;
+            break;
+        case OPT_QUERIES:
+            QUERY_FILE = optarg;
+            SEARCH = true;
+            HASHGEN = false;
+            break;
+        case OPT_QUERY_FORMAT:
+            if (strcmp(optarg, "hex") == 0 || strcmp(optarg, "binary") == 0)
+            {
+                QUERY_BINARY = strcmp(optarg, "binary") == 0;
+            }
+            else
+            {
+                fprintf(stderr, "Invalid query format: %s\n", optarg);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_QUERY_BYTES:
+            QUERY_BYTES = atoi(optarg);
+            if (QUERY_BYTES < 1 || QUERY_BYTES > QUERY_MAX_BYTES)
+            {
+                fprintf(stderr, "Query bytes must be between 1 and %d.\n", QUERY_MAX_BYTES);
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_SERVE:
+            SERVE_SOCKET = optarg;
+            SEARCH = true;
+            HASHGEN = false;
+            break;
+        case OPT_CLIENT:
+            CLIENT_SOCKET = optarg;
+            SEARCH = true;
+            HASHGEN = false;
+            break;
+        case OPT_FARM:
+            FARM_SOURCE = optarg;
+            SEARCH = true;
+            HASHGEN = false;
+            break;
+        case OPT_LIMIT:
+            SEARCH_LIMIT = atoll(optarg);
+            if (atoll(optarg) < 1)
             {
-                DEBUG = true;
+                fprintf(stderr, "The match limit must be 1 or more.\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
             }
-            else
+            break;
+        case OPT_IN_FLIGHT:
+            QUERY_IN_FLIGHT = atoi(optarg);
+            if (QUERY_IN_FLIGHT < 1)
             {
-                DEBUG = false;
+                fprintf(stderr, "In-flight queries must be 1 or more.\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
             }
             break;
         case 'h':
@@ -2467,6 +8026,55 @@ int main(int argc, char *argv[])
         }
     }
 
+    // A sweep runs each point as a child of this binary with these options
+    if (BENCH_SPEC != NULL)
+    {
+        int result = run_bench(BENCH_SPEC, argc, argv, BENCH_CSV);
+        return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (MICROBENCH_STAGES_LIST != NULL)
+    {
+        int thread_counts[64];
+        size_t num_counts = 0;
+        if (MICROBENCH_THREADS != NULL)
+        {
+            char *saveptr = NULL;
+            for (char *count = strtok_r(MICROBENCH_THREADS, ",", &saveptr); count != NULL && num_counts < 64; count = strtok_r(NULL, ",", &saveptr))
+            {
+                thread_counts[num_counts] = atoi(count);
+                if (thread_counts[num_counts] <= 0)
+                {
+                    fprintf(stderr, "Number of threads must be positive.\n");
+                    exit(EXIT_FAILURE);
+                }
+                num_counts++;
+            }
+        }
+        else
+        {
+            int most = num_threads > 0 ? num_threads : omp_get_num_procs();
+            for (int t = 1; t < most; t *= 2)
+                thread_counts[num_counts++] = t;
+            thread_counts[num_counts++] = most;
+        }
+        return run_microbench(MICROBENCH_STAGES_LIST, thread_counts, num_counts, MEMORY_SIZE_MB, FILENAME) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Each file option accepts a comma separated list of files or directories, one per device
+    StripeSet stripes_temp = {0};
+    StripeSet stripes_final = {0};
+    StripeSet stripes_table2 = {0};
+    if ((writeData && parse_stripe_list(FILENAME, "memo.t", &stripes_temp) != 0) ||
+        (writeDataFinal && parse_stripe_list(FILENAME_FINAL, "memo.x", &stripes_final) != 0) ||
+        (writeDataTable2 && parse_stripe_list(FILENAME_TABLE2, "memo.xx", &stripes_table2) != 0))
+    {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    // the table2 file is the final destination; without -j the table1 name is used
+    StripeSet *stripes_dest = writeDataTable2 ? &stripes_table2 : &stripes_final;
+
     NUM_THREADS = num_threads;
     // Set the number of threads if specified
     if (num_threads > 0)
@@ -2479,8 +8087,8 @@ int main(int argc, char *argv[])
         num_threads_io = 1;
     }
 
-    // Display selected configurations
-    if (!BENCHMARK)
+    // Display selected configurations; streamed answers keep stdout to themselves
+    if (!BENCHMARK && QUERY_FILE == NULL && PROOF_FILE == NULL && VERIFY_SAMPLE == 0 && !OCCUPANCY)
     {
         if (!SEARCH)
         {
@@ -2494,6 +8102,7 @@ int main(int argc, char *argv[])
     unsigned long long file_size_bytes = num_iterations * NONCE_SIZE;
     double file_size_gb = file_size_bytes / (1024 * 1024 * 1024.0);
     unsigned long long MEMORY_SIZE_bytes = 0;
+    unsigned long long MEMORY_BUDGET_bytes = MEMORY_BUDGET ? MEMORY_SIZE_MB * 1024 * 1024 : 0;
 
     // if (MEMORY_SIZE_MB / 1024.0 > file_size_gb) {
     if (MEMORY_SIZE_MB * 1024 * 1024 > file_size_bytes)
@@ -2507,7 +8116,22 @@ int main(int argc, char *argv[])
     // printf("Memory Size (MB)            : %llu\n", MEMORY_SIZE_MB);
     // printf("Memory Size (bytes)            : %llu\n", MEMORY_SIZE_bytes);
 
-    rounds = ceil(file_size_bytes / MEMORY_SIZE_bytes);
+    // -m bounds everything a round allocates, not only table1: table1 gets what the rest leaves of it
+    if (MEMORY_BUDGET && HASHGEN)
+    {
+        int threads = num_threads > 0 ? num_threads : omp_get_max_threads();
+        unsigned long long fit = memory_plan(MEMORY_BUDGET_bytes, threads, SORTED_BUCKETS);
+        if (fit == 0)
+        {
+            fprintf(stderr, "Error: -m %llu MB cannot hold a round; its bucket metadata and one record per bucket need %.0f MB.\n",
+                    MEMORY_BUDGET_bytes / (1024 * 1024), ceil(memory_round_bytes(1, threads, SORTED_BUCKETS) / (1024 * 1024.0)));
+            exit(EXIT_FAILURE);
+        }
+        MEMORY_SIZE_bytes = min(MEMORY_SIZE_bytes, fit * (1ULL << (PREFIX_SIZE * 8)) * sizeof(MemoRecord));
+    }
+
+    // rounded up, so that no round is larger than MEMORY_SIZE_bytes
+    rounds = (file_size_bytes + MEMORY_SIZE_bytes - 1) / MEMORY_SIZE_bytes;
     MEMORY_SIZE_bytes = file_size_bytes / rounds;
     num_hashes = floor(MEMORY_SIZE_bytes / NONCE_SIZE);
     MEMORY_SIZE_bytes = num_hashes * NONCE_SIZE;
@@ -2529,7 +8153,14 @@ int main(int argc, char *argv[])
     num_hashes = floor(MEMORY_SIZE_bytes / NONCE_SIZE);
     num_iterations = num_hashes * rounds;
 
-    if (!BENCHMARK)
+    // the compact index keeps 16-bit record counts per bucket
+    if (COMPACT && HASHGEN && num_records_in_bucket * rounds > UINT16_MAX)
+    {
+        fprintf(stderr, "Error: --compact supports at most %u records per bucket, this plot has %llu.\n", UINT16_MAX, num_records_in_bucket * rounds);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!BENCHMARK && QUERY_FILE == NULL && PROOF_FILE == NULL && VERIFY_SAMPLE == 0 && !OCCUPANCY)
     {
         if (SEARCH)
         {
@@ -2545,6 +8176,9 @@ int main(int argc, char *argv[])
 
             printf("Memory Size (MB)            : %llu\n", MEMORY_SIZE_MB);
             printf("Memory Size (bytes)         : %llu\n", MEMORY_SIZE_bytes);
+            if (MEMORY_BUDGET)
+                printf("Memory Budget (MB)          : %llu\n", MEMORY_BUDGET_bytes / (1024 * 1024));
+            printf("Memory Footprint (MB)       : %llu\n", memory_round_bytes(num_records_in_bucket, num_threads > 0 ? num_threads : omp_get_max_threads(), SORTED_BUCKETS && rounds == 1) / (1024 * 1024));
 
             printf("Number of Hashes (RAM)      : %llu\n", num_hashes);
 
@@ -2577,6 +8211,16 @@ int main(int argc, char *argv[])
             else
                 printf("FULL_BUCKETS                : false\n");
 
+            if (COMPACT)
+                printf("COMPACT                     : true\n");
+            else
+                printf("COMPACT                     : false\n");
+
+            if (SORTED_BUCKETS)
+                printf("SORTED_BUCKETS              : true\n");
+            else
+                printf("SORTED_BUCKETS              : false\n");
+
             if (writeData)
             {
                 printf("Temporary File              : %s\n", FILENAME);
@@ -2598,17 +8242,53 @@ int main(int argc, char *argv[])
         if (!BENCHMARK)
             printf("HASHGEN                     : true\n");
 
-        // Open the file for writing in binary mode
-        FILE *fd = NULL;
+        // A compact plot of a single round is written straight from memory, without a temporary file to resume from
+        bool compact_direct = COMPACT && writeData && (writeDataTable2 || writeDataFinal) && rounds == 1;
+
+        // The journal lives next to the first temporary stripe; with --resume it tells which work is already durable
+        journal_init(&journal, stripes_temp.count, stripes_dest->count);
+        if (writeData && !compact_direct)
+        {
+            journal_path = concat_strings(stripes_temp.paths[0], ".journal");
+            if (RESUME)
+            {
+                int loaded = journal_load(&journal, stripes_temp.count, stripes_dest->count);
+                if (loaded < 0)
+                    return EXIT_FAILURE;
+                if (loaded == 0)
+                    printf("no journal %s found, starting from round 0\n", journal_path);
+                else if (!BENCHMARK)
+                    printf("resuming from journal %s: %llu of %llu rounds done\n", journal_path, (unsigned long long)journal.rounds_done, rounds);
+            }
+        }
+
+        // Open the files for writing in binary mode, one per temporary stripe, sized for the rounds they will hold
+        FILE *fd_temp[MAX_STRIPES] = {NULL};
+        off_t round_bytes = num_records_in_bucket * num_buckets * sizeof(MemoRecord2);
         if (writeData)
         {
-            fd = fopen(FILENAME, "wb+");
-            if (fd == NULL)
+            for (size_t s = 0; s < stripes_temp.count; s++)
             {
-                printf("Error opening file %s (#4)\n", FILENAME);
+                // finished rounds must survive, so only a fresh run truncates
+                fd_temp[s] = fopen(stripes_temp.paths[s], journal.rounds_done > 0 ? "rb+" : "wb+");
+                if (fd_temp[s] == NULL)
+                {
+                    printf("Error opening file %s (#4)\n", stripes_temp.paths[s]);
 
-                perror("Error opening file");
-                return EXIT_FAILURE;
+                    perror("Error opening file");
+                    return EXIT_FAILURE;
+                }
+                unsigned long long rounds_in_stripe = rounds / stripes_temp.count + (s < rounds % stripes_temp.count ? 1 : 0);
+                unsigned long long rounds_done_in_stripe = journal.rounds_done / stripes_temp.count + (s < journal.rounds_done % stripes_temp.count ? 1 : 0);
+
+                struct stat st;
+                if (fstat(fileno(fd_temp[s]), &st) != 0 || (rounds_done_in_stripe > 0 && st.st_size < (off_t)(PLOT_HEADER_SIZE + rounds_done_in_stripe * round_bytes)))
+                {
+                    fprintf(stderr, "Error: %s is too short to hold the %llu rounds the journal says are done.\n", stripes_temp.paths[s], rounds_done_in_stripe);
+                    return EXIT_FAILURE;
+                }
+                if (!compact_direct)
+                    preallocate_file(fileno(fd_temp[s]), PLOT_HEADER_SIZE + rounds_in_stripe * round_bytes);
             }
         }
 
@@ -2623,15 +8303,16 @@ int main(int argc, char *argv[])
             exit(EXIT_FAILURE);
         }
 
-        // Allocate memory for each bucket's records
+        // Allocate the records of every bucket in one piece, without a heap chunk per bucket
+        MemoRecord *records_table1 = (MemoRecord *)calloc(num_buckets * num_records_in_bucket, sizeof(MemoRecord));
+        if (records_table1 == NULL)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory for records.\n");
+            exit(EXIT_FAILURE);
+        }
         for (unsigned long long i = 0; i < num_buckets; i++)
         {
-            buckets[i].records = (MemoRecord *)calloc(num_records_in_bucket, sizeof(MemoRecord));
-            if (buckets[i].records == NULL)
-            {
-                fprintf(stderr, "Error: Unable to allocate memory for records.\n");
-                exit(EXIT_FAILURE);
-            }
+            buckets[i].records = &records_table1[i * num_records_in_bucket];
         }
 
         // Allocate memory for the array of Buckets
@@ -2642,24 +8323,35 @@ int main(int argc, char *argv[])
             exit(EXIT_FAILURE);
         }
 
-        // Allocate memory for each bucket's records
+        // Allocate the records of every bucket in one piece
+        bool sort_keys = SORTED_BUCKETS && rounds == 1;
+        MemoRecord2 *records_table2 = (MemoRecord2 *)calloc(num_buckets * num_records_in_bucket, sizeof(MemoRecord2));
+        // a single round is sorted with the keys computed while pairing; more rounds are sorted by the shuffle
+        uint32_t *keys_table2 = sort_keys ? (uint32_t *)malloc(num_buckets * num_records_in_bucket * sizeof(uint32_t)) : NULL;
+        if (records_table2 == NULL || (sort_keys && keys_table2 == NULL))
+        {
+            fprintf(stderr, "Error: Unable to allocate memory for records.\n");
+            exit(EXIT_FAILURE);
+        }
         for (unsigned long long i = 0; i < num_buckets; i++)
         {
-            buckets2[i].records = (MemoRecord2 *)calloc(num_records_in_bucket, sizeof(MemoRecord2));
-            if (buckets2[i].records == NULL)
-            {
-                fprintf(stderr, "Error: Unable to allocate memory for records.\n");
-                exit(EXIT_FAILURE);
-            }
+            buckets2[i].records = &records_table2[i * num_records_in_bucket];
+            if (sort_keys)
+                buckets2[i].keys = &keys_table2[i * num_records_in_bucket];
         }
 
+        memory_reserve(MEMORY_BUDGET_bytes, num_threads > 0 ? num_threads : omp_get_max_threads(), sort_keys);
+        memory_account(MEM_METADATA, num_buckets * (sizeof(Bucket) + sizeof(Bucket2)));
+        memory_account(MEM_TABLE1, num_buckets * num_records_in_bucket * sizeof(MemoRecord));
+        memory_account(MEM_TABLE2, num_buckets * num_records_in_bucket * (sizeof(MemoRecord2) + (sort_keys ? sizeof(uint32_t) : 0)));
+        memory_phase("allocate");
+
         double throughput_hash = 0.0;
         double throughput_io = 0.0;
 
         double start_time_io = 0.0;
         double end_time_io = 0.0;
         double elapsed_time_io = 0.0;
-        double elapsed_time_io2 = 0.0;
         double start_time_hash = 0.0;
         double end_time_hash = 0.0;
         double elapsed_time_hash = 0.0;
@@ -2668,9 +8360,17 @@ int main(int argc, char *argv[])
         double elapsed_time_io_total = 0.0;
         double elapsed_time_io2_total = 0.0;
 
-        for (unsigned long long r = 0; r < rounds; r++)
+        if (METRICS_FILE != NULL)
+            metrics_open(METRICS_FILE, rounds, max(num_threads > 0 ? num_threads : omp_get_max_threads(), num_threads_io));
+        // before the first parallel region, so the counters follow every thread
+        if (PERF_COUNTERS)
+            perf_open();
+
+        for (unsigned long long r = journal.rounds_done; r < rounds; r++)
         {
             start_time_hash = omp_get_wtime();
+            METRICS_ROUND = r;
+            perf_begin();
 
             // Reset bucket counts
             for (unsigned long long i = 0; i < num_buckets; i++)
@@ -2678,7 +8378,6 @@ int main(int argc, char *argv[])
                 buckets[i].count = 0;
                 buckets[i].count_waste = 0;
                 buckets[i].full = false;
-                buckets[i].flush = 0;
             }
 
             unsigned long long MAX_NUM_HASHES = 1ULL << (NONCE_SIZE * 8);
@@ -2755,24 +8454,13 @@ int main(int argc, char *argv[])
                     if (cancel_flag)
                         continue;
 
-                    MemoRecord record;
-                    uint8_t record_hash[HASH_SIZE];
-
                     unsigned long long batch_end = i + BATCH_SIZE;
                     if (batch_end > end_idx)
                     {
                         batch_end = end_idx;
                     }
 
-                    for (unsigned long long j = i; j < batch_end; j++)
-                    {
-                        generateBlake3(record_hash, &record, j);
-                        if (MEMORY_WRITE)
-                        {
-                            off_t bucketIndex = getBucketIndex(record_hash, PREFIX_SIZE);
-                            insert_record(buckets, &record, bucketIndex);
-                        }
-                    }
+                    hash_insert_range(buckets, i, batch_end);
 
                     // Set the flag if the termination condition is met.
                     // if (i > end_idx/2 && full_buckets_global == num_buckets) {
@@ -2833,7 +8521,16 @@ int main(int argc, char *argv[])
 
             // after else if
 
+            // the other approaches hash and insert together; their phase counts as hashing, on the main thread
+            if (strcmp(approach, "for") != 0)
+            {
+                metrics_stop(METRIC_HASH, start_time_hash);
+                metrics_count(end_idx - start_idx, 0);
+            }
+
             // End hash computation time measurement
+            perf_end(PERF_GENERATE);
+            memory_phase("generate");
             end_time_hash = omp_get_wtime();
             elapsed_time_hash = end_time_hash - start_time_hash;
             elapsed_time_hash_total += elapsed_time_hash;
@@ -2843,8 +8540,17 @@ int main(int argc, char *argv[])
             {
                 start_time_io = omp_get_wtime();
 
-                // Seek to the correct position in the file
-                off_t offset = r * num_records_in_bucket * num_buckets * NONCE_SIZE;
+                // The previous round had this round's hash phase to reach the disk; make it durable and checkpoint it
+                if (r > 0 && r > journal.rounds_done)
+                {
+                    double start_sync = metrics_start();
+                    round_checkpoint(fileno(fd_temp[(r - 1) % stripes_temp.count]), PLOT_HEADER_SIZE + ((r - 1) / stripes_temp.count) * round_bytes, round_bytes, r);
+                    metrics_stop(METRIC_SYNC, start_sync);
+                }
+
+                // Rounds are dealt round robin over the temporary stripes; seek to this round's segment
+                FILE *fd = fd_temp[r % stripes_temp.count];
+                off_t offset = PLOT_HEADER_SIZE + (r / stripes_temp.count) * round_bytes;
                 if (fseeko(fd, offset, SEEK_SET) < 0)
                 {
                     perror("Error seeking in file");
@@ -2869,14 +8575,29 @@ int main(int argc, char *argv[])
                             //printf("writeBucketToDiskSequential(): %llu bytes\n",bytesWritten);
                         }*/
 
+                // buckets are sorted and paired a chunk at a time, so each phase is timed once per chunk;
+                // every thread holds the MemoAllRecord scratch of one sort at a time
+                perf_begin();
+                long long sort_bytes = (long long)omp_get_max_threads() * num_records_in_bucket * sizeof(MemoAllRecord);
+                memory_account(MEM_SORT, sort_bytes);
 #pragma omp parallel for schedule(static)
-                for (unsigned long long i = 0; i < num_buckets; i++)
+                for (unsigned long long c = 0; c < num_buckets; c += METRICS_CHUNK_BUCKETS)
                 {
-                    // printf("num_records_in_bucket=%llu sizeof(MemoRecord)=%d\n",num_records_in_bucket,sizeof(MemoRecord));
-                    // need to store this better
-                    // MemoRecord *sorted_nonces = sort_bucket_records(buckets[i].records, num_records_in_bucket);
-                    sort_bucket_records_inplace(buckets[i].records, num_records_in_bucket);
-                    generate_table2(buckets[i].records, num_records_in_bucket);
+                    unsigned long long chunk_end = min(c + METRICS_CHUNK_BUCKETS, num_buckets);
+                    double start_phase = metrics_start();
+                    for (unsigned long long i = c; i < chunk_end; i++)
+                    {
+                        // MemoRecord *sorted_nonces = sort_bucket_records(buckets[i].records, num_records_in_bucket);
+                        sort_bucket_records_inplace(buckets[i].records, num_records_in_bucket);
+                    }
+                    start_phase = metrics_stop(METRIC_SORT, start_phase);
+                    unsigned long long pairs = 0;
+                    for (unsigned long long i = c; i < chunk_end; i++)
+                    {
+                        pairs += generate_table2(buckets[i].records, num_records_in_bucket);
+                    }
+                    metrics_stop(METRIC_PAIR, start_phase);
+                    metrics_count(0, pairs);
 
                     // size_t elementsWritten = fwrite(buckets[i].records, sizeof(MemoRecord), num_records_in_bucket, fd);
                     // size_t elementsWritten = fwrite(sorted_nonces, sizeof(MemoRecord), num_records_in_bucket, fd);
@@ -2914,21 +8635,63 @@ int main(int argc, char *argv[])
                  bytesWritten += elementsWritten*sizeof(MemoRecord);
                          }            */
 
+                if (SORTED_BUCKETS && rounds == 1)
+                {
+#pragma omp parallel for schedule(dynamic, 1)
+                    for (unsigned long long c = 0; c < num_buckets; c += METRICS_CHUNK_BUCKETS)
+                    {
+                        double start_sort = metrics_start();
+                        for (unsigned long long i = c; i < min(c + METRICS_CHUNK_BUCKETS, num_buckets); i++)
+                        {
+                            sort_bucket_records2(buckets2[i].records, buckets2[i].keys, min(buckets2[i].count, num_records_in_bucket));
+                        }
+                        metrics_stop(METRIC_SORT, start_sort);
+                    }
+                }
+
+                memory_account(MEM_SORT, -sort_bytes);
+                perf_end(PERF_SORT_PAIR);
+                memory_phase("sort_pair");
+
                 // write table2
                 // 		#pragma omp parallel for schedule(static)
-                for (unsigned long long i = 0; i < num_buckets; i++)
+                perf_begin();
+                double start_write = metrics_start();
+                if (compact_direct)
                 {
-                    size_t elementsWritten = fwrite(buckets2[i].records, sizeof(MemoRecord2), num_records_in_bucket, fd);
-                    if (elementsWritten != num_records_in_bucket)
+                    write_table2_compact(stripes_dest);
+                    metrics_stop(METRIC_WRITE, start_write);
+                }
+                else
+                {
+                    for (unsigned long long i = 0; i < num_buckets; i++)
+                    {
+                        size_t elementsWritten = fwrite(buckets2[i].records, sizeof(MemoRecord2), num_records_in_bucket, fd);
+                        if (elementsWritten != num_records_in_bucket)
+                        {
+                            fprintf(stderr, "Error writing bucket to file; elements written %zu when expected %llu\n",
+                                    elementsWritten, num_records_in_bucket);
+                            fclose(fd);
+                            exit(EXIT_FAILURE);
+                        }
+                        bytesWritten += elementsWritten * sizeof(MemoRecord2);
+                    }
+
+                    start_write = metrics_stop(METRIC_WRITE, start_write);
+
+                    // start writeback of this round, so dirty pages never pile up
+                    if (fflush(fd) != 0)
                     {
-                        fprintf(stderr, "Error writing bucket to file; elements written %zu when expected %llu\n",
-                                elementsWritten, num_records_in_bucket);
-                        fclose(fd);
+                        perror("Failed to flush buffer");
                         exit(EXIT_FAILURE);
                     }
-                    bytesWritten += elementsWritten * sizeof(MemoRecord2);
+                    sync_range_start(fileno(fd), offset, round_bytes);
+                    metrics_stop(METRIC_SYNC, start_write);
                 }
 
+                perf_end(PERF_WRITE);
+                memory_phase("write");
+
                 // printf("writeBucketToDiskSequential(): %llu bytes at offset %llu; num_hashes=%llu\n",bytesWritten,offset,num_hashes);
 
                 // End I/O time measurement
@@ -2964,6 +8727,8 @@ int main(int argc, char *argv[])
             // Calculate I/O throughput
             throughput_io = (num_hashes * NONCE_SIZE * 2) / ((elapsed_time_hash + elapsed_time_io) * 1024 * 1024);
 
+            metrics_round(r, elapsed_time_hash + elapsed_time_io, buckets, buckets2);
+
             if (!BENCHMARK)
                 printf("[%.2f] HashGen %.2f%%: %.2f MH/s : I/O %.2f MB/s\n", omp_get_wtime() - start_time, (r + 1) * 100.0 / rounds, throughput_hash, throughput_io);
             // end of loop
@@ -2973,17 +8738,24 @@ int main(int argc, char *argv[])
         }
 
         start_time_io = omp_get_wtime();
+        METRICS_ROUND = rounds;
+        double start_finish = start_time_io;
 
-        // Flush and close the file
+        // Flush the files; only the last round can still be in flight
         if (writeData)
         {
-            if (fflush(fd) != 0)
+            for (size_t s = 0; s < stripes_temp.count; s++)
             {
-                perror("Failed to flush buffer");
-                fclose(fd);
-                return EXIT_FAILURE;
+                if (fflush(fd_temp[s]) != 0)
+                {
+                    perror("Failed to flush buffer");
+                    fclose(fd_temp[s]);
+                    return EXIT_FAILURE;
+                }
             }
-            // fclose(fd);
+            if (journal.rounds_done < rounds && !compact_direct)
+                round_checkpoint(fileno(fd_temp[(rounds - 1) % stripes_temp.count]), PLOT_HEADER_SIZE + ((rounds - 1) / stripes_temp.count) * round_bytes, round_bytes, rounds);
+            metrics_stop(METRIC_SYNC, start_time_io);
         }
 
         end_time_io = omp_get_wtime();
@@ -3006,69 +8778,46 @@ int main(int argc, char *argv[])
         }*/
 
         // Free allocated memory
-        for (unsigned long long i = 0; i < num_buckets; i++)
-        {
-            free(buckets[i].records);
-            free(buckets2[i].records);
-        }
+        free(records_table1);
+        free(records_table2);
+        free(keys_table2);
         free(buckets);
         free(buckets2);
+        memory_account(MEM_TABLE1, -(long long)MEMORY.current[MEM_TABLE1]);
+        memory_account(MEM_TABLE2, -(long long)MEMORY.current[MEM_TABLE2]);
+        memory_account(MEM_METADATA, -(long long)MEMORY.current[MEM_METADATA]);
 
-        if (writeDataFinal && rounds > 1)
+        if (compact_direct)
         {
-            // Open the file for writing in binary mode
-            FILE *fd_dest = NULL;
-            if (writeDataFinal)
+            // the final stripes were written by write_table2_compact(); the temporary file was never used
+            for (size_t s = 0; s < stripes_temp.count; s++)
+            {
+                fclose(fd_temp[s]);
+                remove_file(stripes_temp.paths[s]);
+            }
+        }
+        else if (writeData && (writeDataTable2 || writeDataFinal) && (rounds > 1 || stripes_dest->count > 1))
+        {
+            // Open the final stripes for writing in binary mode; a resumed shuffle keeps what it already wrote
+            int fds_dest[MAX_STRIPES];
+            for (size_t s = 0; s < stripes_dest->count; s++)
             {
-                fd_dest = fopen(FILENAME_FINAL, "wb+");
-                if (fd_dest == NULL)
+                fds_dest[s] = open(stripes_dest->paths[s], O_RDWR | O_CREAT | (journal.shuffle_done[s] > 0 ? 0 : O_TRUNC), 0644);
+                if (fds_dest[s] == -1)
                 {
-                    printf("Error opening file %s (#5)\n", FILENAME_FINAL);
+                    printf("Error opening file %s (#5)\n", stripes_dest->paths[s]);
                     perror("Error opening file");
-
-                    // perror("Error opening file");
                     return EXIT_FAILURE;
                 }
+                // the size of a compact stripe is only known once it is written
+                unsigned long long buckets_in_stripe = stripe_first_bucket(s + 1, stripes_dest->count, num_buckets) - stripe_first_bucket(s, stripes_dest->count, num_buckets);
+                preallocate_file(fds_dest[s], COMPACT ? 0 : PLOT_HEADER_SIZE + buckets_in_stripe * round_bytes / num_buckets * rounds);
             }
 
-            unsigned long long num_buckets_to_read = ceil((MEMORY_SIZE_bytes / (num_records_in_bucket * rounds * NONCE_SIZE)) / 2);
-            if (DEBUG)
-                printf("will read %llu buckets at one time, %llu bytes\n", num_buckets_to_read, num_records_in_bucket * rounds * NONCE_SIZE * num_buckets_to_read);
-            // need to fix this for 5 byte NONCE_SIZE
-            if (num_buckets % num_buckets_to_read != 0)
-            {
-                uint64_t ratio = num_buckets / num_buckets_to_read;
-                uint64_t result = largest_power_of_two_less_than(ratio);
-                if (DEBUG)
-                    printf("Largest power of 2 less than %lu is %lu\n", ratio, result);
-                num_buckets_to_read = num_buckets / result;
-                if (DEBUG)
-                    printf("will read %llu buckets at one time, %llu bytes\n", num_buckets_to_read, num_records_in_bucket * rounds * NONCE_SIZE * num_buckets_to_read);
-                // printf("error, num_buckets_to_read is not a multiple of num_buckets, exiting: num_buckets=%llu num_buckets_to_read=%llu...\n",num_buckets,num_buckets_to_read);
-                // return EXIT_FAILURE;
-            }
-
-            // Calculate the total number of records to read per batch
-            size_t records_per_batch = num_records_in_bucket * num_buckets_to_read;
-            // Calculate the size of the buffer needed
-            size_t buffer_size = records_per_batch * rounds;
-            // Allocate the buffer
-            if (DEBUG)
-                printf("allocating %lu bytes for buffer\n", buffer_size * sizeof(MemoRecord));
-            MemoRecord *buffer = (MemoRecord *)malloc(buffer_size * sizeof(MemoRecord));
-            if (buffer == NULL)
-            {
-                fprintf(stderr, "Error allocating memory for buffer.\n");
-                exit(EXIT_FAILURE);
-            }
-
-            if (DEBUG)
-                printf("allocating %lu bytes for bufferShuffled\n", buffer_size * sizeof(MemoRecord));
-            MemoRecord *bufferShuffled = (MemoRecord *)malloc(buffer_size * sizeof(MemoRecord));
-            if (bufferShuffled == NULL)
+            int fds_temp[MAX_STRIPES];
+            for (size_t s = 0; s < stripes_temp.count; s++)
             {
-                fprintf(stderr, "Error allocating memory for bufferShuffled.\n");
-                exit(EXIT_FAILURE);
+                fds_temp[s] = fileno(fd_temp[s]);
             }
 
             // Set the number of threads if specified
@@ -3077,177 +8826,61 @@ int main(int argc, char *argv[])
                 omp_set_num_threads(num_threads_io);
             }
 
-            for (unsigned long long i = 0; i < num_buckets; i = i + num_buckets_to_read)
-            {
-                double start_time_io2 = omp_get_wtime();
-
-#pragma omp parallel for schedule(static)
-                for (unsigned long long r = 0; r < rounds; r++)
-                {
-                    // off_t offset_src_old = r * num_records_in_bucket * num_buckets * NONCE_SIZE + i*num_records_in_bucket*NONCE_SIZE;
-                    //  Calculate the source offset
-                    off_t offset_src = ((r * num_buckets + i) * num_records_in_bucket) * sizeof(MemoRecord);
-                    // printf("read data: offset_src_old=%llu offset_src=%llu\n",offset_src_old,offset_src);
-                    // if (DEBUG) printf("read data: offset_src_old=%llu bytes=%llu\n",offset_src_old,num_records_in_bucket*NONCE_SIZE*num_buckets_to_read);
-                    if (DEBUG)
-                        printf("read data: offset_src=%lu bytes=%lu\n",
-                               offset_src, records_per_batch * sizeof(MemoRecord));
-
-                    if (fseeko(fd, offset_src, SEEK_SET) < 0)
-                    {
-                        perror("Error seeking in file");
-                        fclose(fd);
-                        exit(EXIT_FAILURE);
-                    }
-
-                    // size_t recordsRead = fread(buffer+num_records_in_bucket*num_buckets_to_read*sizeof(MemoRecord)*r, sizeof(MemoRecord), num_records_in_bucket*num_buckets_to_read, fd);
-                    //  Correct pointer arithmetic
-
-                    size_t index = r * records_per_batch;
-                    if (DEBUG)
-                        printf("storing read data at index %lu\n", index);
-                    size_t recordsRead = fread(&buffer[index],
-                                               sizeof(MemoRecord),
-                                               records_per_batch,
-                                               fd);
-                    // size_t recordsRead = fread(buffer + r * records_per_batch,
-                    //                        sizeof(MemoRecord),
-                    //                        records_per_batch,
-                    //                        fd);
-                    if (recordsRead != records_per_batch)
-                    {
-                        fprintf(stderr, "Error reading file, records read %zu instead of %zu\n",
-                                recordsRead, records_per_batch);
-                        fclose(fd);
-                        exit(EXIT_FAILURE);
-                    }
-                    else
-                    {
-                        if (DEBUG)
-                            printf("read %zu records from disk...\n", recordsRead);
-                    }
-
-                    off_t offset_dest = i * num_records_in_bucket * NONCE_SIZE * rounds;
-                    if (DEBUG)
-                        printf("write data: offset_dest=%lu bytes=%llu\n", offset_dest, num_records_in_bucket * NONCE_SIZE * rounds * num_buckets_to_read);
-
-                    if (fseeko(fd_dest, offset_dest, SEEK_SET) < 0)
-                    {
-                        perror("Error seeking in file");
-                        fclose(fd_dest);
-                        exit(EXIT_FAILURE);
-                    }
-                    // needs to make sure its ok, fix things....
-                    // printf("buffer_size=%llu my_buffer_size=%llu\n",buffer_size,num_records_in_bucket*num_buckets_to_read*rounds);
-                }
-                // end of for loop rounds
-
-                if (DEBUG)
-                    printf("shuffling %llu buckets with %llu bytes each...\n", num_buckets_to_read * rounds, num_records_in_bucket * NONCE_SIZE);
-#pragma omp parallel for schedule(static)
-                for (unsigned long long s = 0; s < num_buckets_to_read; s++)
-                {
-                    for (unsigned long long r = 0; r < rounds; r++)
-                    {
-                        // off_t index_src = s*num_records_in_bucket+r*num_records_in_bucket*rounds;
-                        // off_t index_dest = s + r*num_records_in_bucket*rounds;
-
-                        off_t index_src = ((r * num_buckets_to_read + s) * num_records_in_bucket);
-                        off_t index_dest = (s * rounds + r) * num_records_in_bucket;
-
-                        // printf("SHUFFLE: index_src=%llu index_dest=%llu\n",index_src,index_dest);
-                        // printf("SHUFFLE: s=%llu, r=%llu, index_src=%llu, index_dest=%llu\n", s, r, index_src, index_dest);
-
-                        memcpy(&bufferShuffled[index_dest], &buffer[index_src], num_records_in_bucket * sizeof(MemoRecord));
-                    }
-                }
-                // end of for loop num_buckets_to_read
-
-                // bufferShuffled needs to be sorted first before it is written
-                //  Sort the bucket by computing hashes and extracting the sorted nonces.
-                // make sure this works...
-                // MemoRecord *sorted_nonces = sort_bucket_records(bufferShuffled, num_records_in_bucket*num_buckets_to_read*rounds);
-
-                // should write in parallel if possible
-                size_t elementsWritten = fwrite(bufferShuffled, sizeof(MemoRecord), num_records_in_bucket * num_buckets_to_read * rounds, fd_dest);
-                // size_t elementsWritten = fwrite(sorted_nonces, sizeof(MemoRecord), num_records_in_bucket*num_buckets_to_read*rounds, fd_dest);
-                if (elementsWritten != num_records_in_bucket * num_buckets_to_read * rounds)
-                {
-                    fprintf(stderr, "Error writing bucket to file; elements written %zu when expected %llu\n",
-                            elementsWritten, num_records_in_bucket * num_buckets_to_read * rounds);
-                    fclose(fd_dest);
-                    exit(EXIT_FAILURE);
-                }
-
-                /*if (fsync(fileno(fd_dest)) != 0) {
-                    perror("Failed to fsync buffer");
-                    fclose(fd_dest);
-                    return EXIT_FAILURE;
-                }*/
+            double start_shuffle = metrics_start();
+            perf_begin();
+            // the buckets are freed by now, so the shuffle may use all of -m
+            elapsed_time_io2_total += shuffle_table2(fds_temp, stripes_temp.count, fds_dest, stripes_dest->count, MEMORY_BUDGET ? MEMORY_BUDGET_bytes : MEMORY_SIZE_bytes, start_time);
+            perf_end(PERF_SHUFFLE);
+            memory_phase("shuffle");
+            metrics_stop(METRIC_SHUFFLE, start_shuffle);
 
-                double end_time_io2 = omp_get_wtime();
-                elapsed_time_io2 = end_time_io2 - start_time_io2;
-                elapsed_time_io2_total += elapsed_time_io2;
-                double throughput_io2 = (num_records_in_bucket * num_buckets_to_read * rounds * NONCE_SIZE) / (elapsed_time_io2 * 1024 * 1024);
-                if (!BENCHMARK)
-                    printf("[%.2f] Shuffle %.2f%%: %.2f MB/s\n", omp_get_wtime() - start_time, (i + 1) * 100.0 / num_buckets, throughput_io2);
-            }
-            // end of for loop
             start_time_io = omp_get_wtime();
 
-            // Flush and close the file
-            if (writeData)
+            // Flush and close the files; the data ranges were already synced batch by batch
+            for (size_t s = 0; s < stripes_dest->count; s++)
             {
-                if (fflush(fd) != 0)
-                {
-                    perror("Failed to flush buffer");
-                    fclose(fd);
-                    return EXIT_FAILURE;
-                }
-
-                if (fsync(fileno(fd)) != 0)
+                if (fdatasync(fds_dest[s]) != 0)
                 {
                     perror("Failed to fsync buffer");
-                    fclose(fd);
+                    close(fds_dest[s]);
                     return EXIT_FAILURE;
                 }
-                fclose(fd);
+                close(fds_dest[s]);
             }
+            metrics_stop(METRIC_SYNC, start_time_io);
 
-            if (writeDataFinal)
+            for (size_t s = 0; s < stripes_temp.count; s++)
             {
-                if (fflush(fd_dest) != 0)
-                {
-                    perror("Failed to flush buffer");
-                    fclose(fd_dest);
-                    return EXIT_FAILURE;
-                }
-
-                if (fsync(fileno(fd_dest)) != 0)
-                {
-                    perror("Failed to fsync buffer");
-                    fclose(fd_dest);
-                    return EXIT_FAILURE;
-                }
-
-                fclose(fd_dest);
-
-                remove_file(FILENAME);
+                fclose(fd_temp[s]);
+                remove_file(stripes_temp.paths[s]);
             }
-
-            free(buffer);
         }
-        else if (writeDataTable2 && rounds == 1)
+        else if (writeData && (writeDataTable2 || writeDataFinal) && rounds == 1)
         {
+            // a single round is already in final layout in the first temporary stripe, behind the header gap
+            double start_sync = metrics_start();
+            if (plot_write_header(fileno(fd_temp[0]), 0, 1, PLOT_LAYOUT_FIXED, 0) != 0 || fdatasync(fileno(fd_temp[0])) != 0)
+            {
+                perror("Failed to fsync buffer");
+                return EXIT_FAILURE;
+            }
+            metrics_stop(METRIC_SYNC, start_sync);
+            for (size_t s = 0; s < stripes_temp.count; s++)
+            {
+                fclose(fd_temp[s]);
+                if (s > 0)
+                    remove_file(stripes_temp.paths[s]);
+            }
+
             // Call the rename_file function
-            if (move_file_overwrite(FILENAME, FILENAME_TABLE2) == 0)
+            if (move_file_overwrite(stripes_temp.paths[0], stripes_dest->paths[0]) == 0)
             {
                 if (!BENCHMARK)
-                    printf("File renamed/moved successfully from '%s' to '%s'.\n", FILENAME, FILENAME_TABLE2);
+                    printf("File renamed/moved successfully from '%s' to '%s'.\n", stripes_temp.paths[0], stripes_dest->paths[0]);
             }
             else
             {
-                printf("Error in moving file '%s' to '%s'.\n", FILENAME, FILENAME_TABLE2);
+                printf("Error in moving file '%s' to '%s'.\n", stripes_temp.paths[0], stripes_dest->paths[0]);
                 return EXIT_FAILURE;
                 // Error message already printed by rename_file via perror()
                 // Additional handling can be done here if necessary
@@ -3255,31 +8888,16 @@ int main(int argc, char *argv[])
             }
         }
 
-// will need to check on MacOS with a spinning hdd if we need to call sync() to flush all filesystems
-#ifdef __linux__
-
-        if (writeData)
+        // The plot is complete and durable, nothing is left to resume
+        if (journal_path != NULL)
         {
-            if (DEBUG)
-                printf("Final flush in progress...\n");
-            int fd2 = open(FILENAME_TABLE2, O_RDWR);
-            if (fd2 == -1)
-            {
-                printf("Error opening file %s (#6)\n", FILENAME_TABLE2);
-
-                perror("Error opening file");
-                return EXIT_FAILURE;
-            }
+            remove_file(journal_path);
+        }
 
-            // Sync the entire filesystem
-            if (syncfs(fd2) == -1)
-            {
-                perror("Error syncing filesystem with syncfs");
-                close(fd2);
-                return EXIT_FAILURE;
-            }
+        if (FILTER && writeData && (writeDataTable2 || writeDataFinal) && filter_build(stripes_dest, FILTER_KEY_SIZE, FILTER_BITS) != 0)
+        {
+            return EXIT_FAILURE;
         }
-#endif
 
         end_time_io = omp_get_wtime();
         elapsed_time_io = end_time_io - start_time_io;
@@ -3311,16 +8929,29 @@ int main(int argc, char *argv[])
         double end_time = omp_get_wtime();
         double elapsed_time = end_time - start_time;
 
+        if (METRICS != NULL)
+        {
+            METRICS->rounds[rounds].seconds = end_time - start_finish;
+            if (metrics_write(approach, num_threads > 0 ? num_threads : omp_get_max_threads(), MEMORY_SIZE_MB, elapsed_time) != 0)
+                return EXIT_FAILURE;
+        }
+
         // Calculate total throughput
         double total_throughput = (num_iterations / elapsed_time) / 1e6;
         if (!BENCHMARK)
         {
             printf("Total Throughput: %.2f MH/s  %.2f MB/s\n", total_throughput, total_throughput * NONCE_SIZE);
             printf("Total Time: %.6f seconds\n", elapsed_time);
+            if (PERF != NULL)
+                perf_report(false);
+            memory_report(stdout, false);
         }
         else
         {
-            printf("%s,%d,%lu,%d,%llu,%.2f,%zu,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n", approach, K, sizeof(MemoRecord), num_threads, MEMORY_SIZE_MB, file_size_gb, BATCH_SIZE, total_throughput, total_throughput * NONCE_SIZE, elapsed_time_hash_total, elapsed_time_io_total, elapsed_time_io2_total, elapsed_time - elapsed_time_hash_total - elapsed_time_io_total - elapsed_time_io2_total, elapsed_time, record_counts * 100.0 / (num_buckets * num_records_in_bucket));
+            printf("%s,%d,%lu,%d,%llu,%.2f,%zu,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f", approach, K, sizeof(MemoRecord), num_threads, MEMORY_SIZE_MB, file_size_gb, BATCH_SIZE, total_throughput, total_throughput * NONCE_SIZE, elapsed_time_hash_total, elapsed_time_io_total, elapsed_time_io2_total, elapsed_time - elapsed_time_hash_total - elapsed_time_io_total - elapsed_time_io2_total, elapsed_time, record_counts * 100.0 / (num_buckets * num_records_in_bucket));
+            if (PERF != NULL)
+                perf_report(true);
+            printf("\n");
             return 0;
         }
     }
@@ -3328,16 +8959,81 @@ int main(int argc, char *argv[])
 
     omp_set_num_threads(num_threads);
 
-    if (SEARCH && !SEARCH_BATCH)
+    if (SERVE_SOCKET != NULL)
+    {
+        StripeSet *plot_sets = (StripeSet *)calloc(num_plot_names, sizeof(StripeSet));
+        for (size_t p = 0; p < num_plot_names; p++)
+        {
+            if (plot_sets == NULL || parse_stripe_list(PLOT_NAMES[p], "memo.xx", &plot_sets[p]) != 0)
+                return EXIT_FAILURE;
+        }
+        if (num_plot_names == 0)
+        {
+            fprintf(stderr, "Error: --serve needs at least one plot (-j).\n");
+            return EXIT_FAILURE;
+        }
+        return serve_plots(plot_sets, num_plot_names, SERVE_SOCKET, num_threads > 0 ? num_threads : omp_get_max_threads());
+    }
+    else if (PROOF_FILE != NULL)
+    {
+        // the pairing distance comes from the plot given with -j, otherwise from -K
+        uint64_t pairing_distance = 1ULL << (64 - K);
+        if (writeDataTable2)
+        {
+            PlotFile plot;
+            if (plot_open(&plot, &stripes_table2) != 0)
+                return EXIT_FAILURE;
+            if (!plot.legacy && !plot.table1_nonces)
+                fprintf(stderr, "Warning: %s was written before records held their table1 nonces; its proofs will not verify.\n", plot.paths[0]);
+            pairing_distance = plot.pairing_distance;
+            plot_close(&plot);
+        }
+        return verify_proofs_file(PROOF_FILE, pairing_distance) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    else if (VERIFY_SAMPLE > 0)
+    {
+        if (!writeDataTable2)
+        {
+            fprintf(stderr, "Error: --verify-sample needs a plot (-j).\n");
+            return EXIT_FAILURE;
+        }
+        return verify_sample(&stripes_table2, VERIFY_SAMPLE, SAMPLE_SEED) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    else if (OCCUPANCY)
+    {
+        if (!writeDataTable2)
+        {
+            fprintf(stderr, "Error: --occupancy needs a plot (-j).\n");
+            return EXIT_FAILURE;
+        }
+        return plot_occupancy(&stripes_table2) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    else if (FARM_SOURCE != NULL)
+    {
+        if (SEARCH_STRING == NULL && !SEARCH_BATCH)
+        {
+            fprintf(stderr, "Error: --farm needs a challenge (-s) or random challenges (-b with -p).\n");
+            return EXIT_FAILURE;
+        }
+        search_farm(FARM_SOURCE, SEARCH_BATCH ? NULL : SEARCH_STRING, BATCH_SIZE, PREFIX_SEARCH_SIZE);
+    }
+    else if (CLIENT_SOCKET != NULL)
+    {
+        serve_client(CLIENT_SOCKET, BATCH_SIZE, PREFIX_SEARCH_SIZE > 1 ? PREFIX_SEARCH_SIZE : PREFIX_SIZE, QUERY_IN_FLIGHT);
+    }
+    else if (QUERY_FILE != NULL)
+    {
+        search_memo_records_stream(&stripes_table2, QUERY_FILE, QUERY_BINARY, QUERY_BYTES, QUERY_IN_FLIGHT);
+    }
+    else if (SEARCH && !SEARCH_BATCH)
     {
         // printf("search has not been implemented yet...\n");
-        search_memo_records(FILENAME_TABLE2, SEARCH_STRING);
+        search_memo_records(&stripes_table2, SEARCH_STRING);
     }
-
-    if (SEARCH_BATCH)
+    else if (SEARCH_BATCH)
     {
         // printf("search has not been implemented yet...\n");
-        search_memo_records_batch(FILENAME_TABLE2, BATCH_SIZE, PREFIX_SEARCH_SIZE);
+        search_memo_records_batch(&stripes_table2, BATCH_SIZE, PREFIX_SEARCH_SIZE);
     }
 
     // Call the function to count zero-value MemoRecords
@@ -3352,7 +9048,7 @@ int main(int argc, char *argv[])
         // process_memo_records(FILENAME_FINAL,MEMORY_SIZE_bytes/sizeof(MemoRecord));
         // process_memo_records(FILENAME_FINAL,num_records_in_bucket*rounds);
         //  FILENAME_TABLE2
-        process_memo_records_table2(FILENAME_TABLE2, num_records_in_bucket * rounds);
+        process_memo_records_table2(stripes_dest);
     }
 
     if (DEBUG)